@@ -39,6 +39,13 @@ enum StrandMode {
     TAG_REV = 2  // Tag maps to the reverse strand // For 10X 5' R2 maps to the reverse strand of the transcript
 };
 
+// When to align a read to the genome after aligning it to the transcriptome
+enum GenomeAlignPolicy {
+    GENOME_ALWAYS = 0,   // Always align to both
+    GENOME_FALLBACK = 1, // Skip the genome when the transcriptome alignment is conclusive
+    GENOME_NEVER = 2     // Transcriptome only
+};
+
 static const char * CIGAR_CHARS = (char*)"MIDNSHP=XB";
 
 enum class Cigar : std::uint8_t {
@@ -377,6 +384,14 @@ struct AlignSummary{
     }
 };
 
+// Alignment summaries split by a hash of the barcode, every read of a barcode is in the same bucket
+using AlignBuckets = std::vector<std::vector<AlignSummary>>;
+const size_t ALIGN_BUCKETS = 1024;
+
+inline size_t align_bucket(AlignSummary::bint barcode, size_t buckets) {
+    return ((static_cast<uint64_t>(barcode) * 0x9e3779b97f4a7c15ULL) >> 32) % buckets;
+}
+
 struct AlignTagOut{
     AlignTagOut() 
         : barcode(0), intronic(false), gene_id(0), umi(0)
@@ -492,6 +507,7 @@ struct AlignGroup {
         MULTIMAPPED,
         AMBIGUOUS,
         ANTISENSE,
+        EMPTY_DROPLET,
         ELEM_COUNT
     };
 
@@ -517,6 +533,8 @@ struct AlignGroup {
                 return nice ? "Ambiguous" : "ambiguous";
             case Result::ANTISENSE:
                 return nice ? "Antisense" : "antisense";
+            case Result::EMPTY_DROPLET:
+                return nice ? "Empty Droplet (not aligned)" : "empty_droplet";
             case Result::ELEM_COUNT:
                 return "";
         }
@@ -545,6 +563,8 @@ struct AlignGroup {
                 return '?';
             case Result::ANTISENSE:
                 return 'A';
+            case Result::EMPTY_DROPLET:
+                return 'D';
             case Result::ELEM_COUNT:
                 return '?';
         }
@@ -553,23 +573,27 @@ struct AlignGroup {
 
     using ResultCounts = std::array<unsigned int, AlignGroup::Result::ELEM_COUNT>;
 
+    AlignGroup( const AlignGroup& ) = delete;
+    AlignGroup& operator=(const AlignGroup&) = delete;
+
     AlignGroup() {
         alns.resize(10);
         transcript_ar.a = NULL;
         transcript_ar.n = 0;
+        transcript_ar.m = 0;
         genome_ar.a = NULL;
         genome_ar.n = 0;
+        genome_ar.m = 0;
     }
 
     ~AlignGroup(){
+        if(genome_ar.a != NULL) free(genome_ar.a);
+        if(transcript_ar.a != NULL) free(transcript_ar.a);
     }
 
+    // The region arrays keep their storage so they can be reused by mem_align1_buf
     void reset(){
-        if(genome_ar.a != NULL) free(genome_ar.a);
-        genome_ar.a = NULL;
         genome_ar.n = 0;
-        if(transcript_ar.a != NULL) free(transcript_ar.a);
-        transcript_ar.a = NULL;
         transcript_ar.n = 0;
         summary.reset();
         res = UNMAPPED;
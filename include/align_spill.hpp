@@ -0,0 +1,158 @@
+/*
+Copyright (c) 2018-2020 Gavin W. Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "align_aux.hpp"
+
+namespace gwsc {
+
+// A sorted run of alignment summaries spilled to disk, bucket b is records [offsets[b], offsets[b + 1])
+struct AlignRun {
+    std::string           file;
+    std::vector<uint64_t> offsets;
+};
+
+// Sorts every bucket and writes them back to back as one run, the buckets are left empty
+inline AlignRun write_align_run(const std::string & fname, AlignBuckets & buckets) {
+    AlignRun run;
+    run.file = fname;
+    run.offsets.resize(buckets.size() + 1);
+    FILE * fp = fopen(fname.c_str(), "wb");
+    if(fp == nullptr) {
+        std::cout << "Error! Could not open " << fname << " to spill alignment tags\n";
+        exit(1);
+    }
+    for(size_t b = 0; b < buckets.size(); b++) {
+        auto & bucket = buckets[b];
+        std::sort(bucket.begin(), bucket.end());
+        if(!bucket.empty() && fwrite(bucket.data(), sizeof(AlignSummary), bucket.size(), fp) != bucket.size()) {
+            std::cout << "Error! Failed writing the alignment tags to " << fname << "\n";
+            exit(1);
+        }
+        run.offsets[b + 1] = run.offsets[b] + bucket.size();
+        bucket.clear();
+    }
+    fclose(fp);
+    return run;
+}
+
+// Buffered reader over one bucket of a run
+class AlignRunReader {
+    public:
+        AlignRunReader(const AlignRun & run, size_t bucket) : left_(run.offsets[bucket + 1] - run.offsets[bucket]) {
+            fp_ = fopen(run.file.c_str(), "rb");
+            if(fp_ == nullptr || fseeko(fp_, run.offsets[bucket] * sizeof(AlignSummary), SEEK_SET) != 0) {
+                std::cout << "Error! Could not read the spilled alignment tags in " << run.file << "\n";
+                exit(1);
+            }
+            fill_();
+        }
+
+        ~AlignRunReader() {
+            if(fp_ != nullptr) fclose(fp_);
+        }
+
+        bool done() const {
+            return pos_ >= buf_.size();
+        }
+
+        const AlignSummary & head() const {
+            return buf_[pos_];
+        }
+
+        void pop() {
+            if(++pos_ >= buf_.size()) fill_();
+        }
+
+    private:
+        static const size_t BUFFER = 4096;
+
+        void fill_() {
+            size_t n = std::min<size_t>(left_, BUFFER);
+            buf_.resize(n);
+            if(n > 0 && fread(&buf_[0], sizeof(AlignSummary), n, fp_) != n) {
+                std::cout << "Error! Truncated alignment tag spill file\n";
+                exit(1);
+            }
+            left_ -= n;
+            pos_ = 0;
+        }
+
+        FILE                      * fp_ = nullptr;
+        std::vector<AlignSummary>   buf_;
+        size_t                      left_ = 0;
+        size_t                      pos_ = 0;
+};
+
+// Streams a bucket one barcode at a time from its sorted in memory records and the spilled runs
+class AlignBucketMerger {
+    public:
+        void open(const std::vector<AlignSummary> & mem, const std::vector<AlignRun> & runs, size_t bucket) {
+            mit_ = mem.begin();
+            mend_ = mem.end();
+            readers_.clear();
+            for(auto & r : runs) {
+                if(r.offsets[bucket + 1] > r.offsets[bucket]) {
+                    readers_.emplace_back(new AlignRunReader(r, bucket));
+                }
+            }
+        }
+
+        // All the records of the next barcode in sorted order, false when the bucket is done
+        bool next(std::vector<AlignSummary> & out) {
+            out.clear();
+            bool found = mit_ != mend_;
+            AlignSummary::bint barcode = found ? mit_->barcode : 0;
+            for(auto & r : readers_) {
+                if(!r->done() && (!found || r->head().barcode < barcode)) {
+                    barcode = r->head().barcode;
+                    found = true;
+                }
+            }
+            if(!found) return false;
+
+            while(mit_ != mend_ && mit_->barcode == barcode) out.push_back(*mit_++);
+            for(auto & r : readers_) {
+                while(!r->done() && r->head().barcode == barcode) {
+                    out.push_back(r->head());
+                    r->pop();
+                }
+            }
+            std::sort(out.begin(), out.end());
+            return true;
+        }
+
+    private:
+        std::vector<AlignSummary>::const_iterator        mit_;
+        std::vector<AlignSummary>::const_iterator        mend_;
+        std::vector<std::unique_ptr<AlignRunReader>>     readers_;
+};
+
+}
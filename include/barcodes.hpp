@@ -59,8 +59,19 @@ class CBWhiteListShort{
         void         merge(const std::string & wlist);
         int          count(const std::string & bc);
         int          count(const std::string & bc, CountSummary & summary);
+        // Thread safe count, exact matches are tallied in local and merged later with add_counts
+        int          count(const std::string & bc, CountSummary & summary, 
+                           phmap::flat_hash_map<AlignSummary::bint, unsigned int> & local) const;
+        void         add_counts(const phmap::flat_hash_map<AlignSummary::bint, unsigned int> & local);
         int          correct(std::string & bc, AlignSummary::bint & code) const;
+        // Same as correct for a 2 bit packed barcode, code is replaced by the corrected barcode
+        int          correct_code(uint64_t & code, unsigned int len, AlignSummary::bint & index) const;
         void         write(const std::string & out) const;
+        // One mismatch index mapping every neighbour of a counted barcode to the barcode correct would pick
+        void         build_correction();
+        void         write_correction(const std::string & out) const;
+        // Returns false if the file is missing or was built from different counts
+        bool         load_correction(const std::string & in);
         void         copy(const CBWhiteListShort & src);
         void         reset();
 
@@ -80,13 +91,21 @@ class CBWhiteListShort{
             return barcodes_[bc];
         }
 
+        unsigned int barcode_count(AlignSummary::bint bc) const {
+            return counts_[bc];
+        }
+
         AlignSummary::bint bid(const std::string & bc) const;
 
     private:
         bool get_index_(const std::string & bc, AlignSummary::bint & code) const;
+        bool better_(AlignSummary::bint a, AlignSummary::bint b, uint64_t code) const;
+        uint64_t counts_total_() const;
         std::vector<std::string>                       barcodes_;
         std::vector<unsigned int>                      counts_;
         phmap::flat_hash_map<AlignSummary::bint, AlignSummary::bint>       hash_;
+        phmap::flat_hash_map<uint64_t, AlignSummary::bint>                 corr_;
+        bool                                                               indexed_ = false;
 };
 
 class CBDeNovo{
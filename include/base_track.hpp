@@ -0,0 +1,250 @@
+/*
+Copyright (c) 2018-2020 Gavin W. Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index.hpp"
+
+namespace gwsc {
+
+// Genome wide base annotation (exon, UTR, non-coding and intron per strand) stored as
+// sorted runs per contig. scsnv index writes <prefix>_btypes.bin which is memory mapped,
+// indexes without it are annotated once from the transcript index on load.
+class BaseTrack {
+    BaseTrack( const BaseTrack& ) = delete;
+    BaseTrack& operator=(const BaseTrack&) = delete;
+    public:
+        static const uint64_t MAGIC = 0x3154424353435347ULL; // "GSCSCBT1"
+
+        enum SBaseType {
+            PINTRON=1,
+            PEXON=2,
+            PNC=4,
+            P5UTR=8,
+            P3UTR=16,
+            MINTRON=32,
+            MEXON=64,
+            MNC=128,
+            M5UTR=256,
+            M3UTR=512
+        };
+
+        // Bases from start up to the next run share type
+        struct Run {
+            uint32_t start;
+            uint32_t type;
+        };
+
+        BaseTrack() {
+        }
+
+        ~BaseTrack() {
+            close();
+        }
+
+        // Uses the prebuilt track when present and falls back to annotating the index
+        void load(const std::string & prefix, const TXIndex & idx) {
+            std::string fname = prefix + "_btypes.bin";
+            std::ifstream in(fname, std::ios::binary);
+            if(in.good()){
+                in.close();
+                open(fname);
+            }else{
+                build(idx);
+            }
+        }
+
+        void build(const TXIndex & idx) {
+            close();
+            const size_t N = idx.refs().size();
+            owned_.resize(N);
+            // +1 at the first base and -1 after the last base of every annotated block per type bit
+            std::vector<std::pair<uint32_t, int>> events;
+            for(size_t tid = 0; tid < N; tid++){
+                auto const & r = idx.ref(tid);
+                events.clear();
+                for(size_t gi = r.start; gi < r.end; gi++){
+                    const auto & g = idx.gene(gi);
+                    for(auto const & intron : g.introns){
+                        add_(events, intron.lft, intron.rgt, g.strand == '+' ? PINTRON : MINTRON);
+                    }
+                    for(size_t txid = g.tstart; txid < g.tend; txid++){
+                        const auto & t = idx.transcript(txid);
+                        bool plus = t.strand == '+';
+                        for(auto const & e : t.exons){
+                            long int l = e.lft, rr = e.rgt;
+                            if(t.coding_start > -1 && l < t.coding_start){
+                                add_(events, l, std::min<long int>(rr, t.coding_start - 1), plus ? P5UTR : M3UTR);
+                                l = t.coding_start;
+                            }
+                            if(t.coding_end > -1 && rr > t.coding_end){
+                                add_(events, std::max<long int>(l, t.coding_end + 1), rr, plus ? P3UTR : M5UTR);
+                                rr = t.coding_end;
+                            }
+                            if(t.coding_start > -1){
+                                add_(events, l, rr, plus ? PEXON : MEXON);
+                            }else{
+                                add_(events, l, rr, plus ? PNC : MNC);
+                            }
+                        }
+                    }
+                }
+                sweep_(events, owned_[tid]);
+            }
+            contigs_.resize(N);
+            for(size_t i = 0; i < N; i++){
+                contigs_[i] = {owned_[i].data(), owned_[i].size()};
+            }
+        }
+
+        // Header {MAGIC, version, contigs}, then {run offset, run count} per contig and the runs
+        void write(const std::string & fname) const {
+            std::ofstream out(fname, std::ios::binary);
+            if(!out.good()){
+                std::cerr << "Could not open " << fname << " for writing\n";
+                exit(1);
+            }
+            uint64_t header[3] = {MAGIC, 1, contigs_.size()};
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            uint64_t off = sizeof(header) + contigs_.size() * 2 * sizeof(uint64_t);
+            for(auto const & c : contigs_){
+                uint64_t entry[2] = {off, c.second};
+                out.write(reinterpret_cast<const char*>(entry), sizeof(entry));
+                off += c.second * sizeof(Run);
+            }
+            for(auto const & c : contigs_){
+                out.write(reinterpret_cast<const char*>(c.first), c.second * sizeof(Run));
+            }
+        }
+
+        void open(const std::string & fname) {
+            close();
+            int fd = ::open(fname.c_str(), O_RDONLY);
+            struct stat st;
+            if(fd < 0 || fstat(fd, &st) != 0){
+                std::cerr << "Could not open " << fname << " for reading\n";
+                exit(1);
+            }
+            map_size_ = st.st_size;
+            void * addr = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(addr == MAP_FAILED){
+                std::cerr << "Could not memory map " << fname << "\n";
+                exit(1);
+            }
+            map_addr_ = addr;
+            const uint8_t * base = static_cast<const uint8_t*>(addr);
+            uint64_t header[3];
+            memcpy(header, base, sizeof(header));
+            if(header[0] != MAGIC){
+                std::cerr << fname << " is not a base annotation track\n";
+                exit(1);
+            }
+            contigs_.resize(header[2]);
+            const uint8_t * tp = base + sizeof(header);
+            for(auto & c : contigs_){
+                uint64_t entry[2];
+                memcpy(entry, tp, sizeof(entry));
+                tp += sizeof(entry);
+                c = {reinterpret_cast<const Run*>(base + entry[0]), entry[1]};
+            }
+        }
+
+        void close() {
+            if(map_addr_ != nullptr) munmap(map_addr_, map_size_);
+            map_addr_ = nullptr;
+            map_size_ = 0;
+            contigs_.clear();
+            owned_.clear();
+        }
+
+        // Annotation bits at pos, 0 outside of every gene
+        uint16_t at(size_t tid, uint32_t pos) const {
+            if(tid >= contigs_.size()) return 0;
+            auto const & c = contigs_[tid];
+            const Run * it = std::upper_bound(c.first, c.first + c.second, pos, [](uint32_t p, const Run & r){ return p < r.start; });
+            return it == c.first ? 0 : (it - 1)->type;
+        }
+
+        size_t runs() const {
+            size_t tot = 0;
+            for(auto const & c : contigs_) tot += c.second;
+            return tot;
+        }
+
+    private:
+        static int bit_(unsigned int type) {
+            int b = 0;
+            while((type >>= 1) != 0) b++;
+            return b;
+        }
+
+        static void add_(std::vector<std::pair<uint32_t, int>> & events, long int lft, long int rgt, unsigned int type) {
+            if(rgt < lft) return;
+            int b = bit_(type) + 1;
+            events.push_back({static_cast<uint32_t>(lft), b});
+            events.push_back({static_cast<uint32_t>(rgt + 1), -b});
+        }
+
+        static void sweep_(std::vector<std::pair<uint32_t, int>> & events, std::vector<Run> & runs) {
+            std::sort(events.begin(), events.end());
+            std::array<unsigned int, 10> depth{};
+            uint32_t last = 0;
+            size_t i = 0;
+            while(i < events.size()){
+                uint32_t pos = events[i].first;
+                for(; i < events.size() && events[i].first == pos; i++){
+                    int b = events[i].second;
+                    if(b > 0) depth[b - 1]++;
+                    else depth[-b - 1]--;
+                }
+                uint32_t type = 0;
+                for(size_t j = 0; j < depth.size(); j++){
+                    if(depth[j] > 0) type |= 1U << j;
+                }
+                if(type != last){
+                    runs.push_back({pos, type});
+                    last = type;
+                }
+            }
+        }
+
+        std::vector<std::pair<const Run*, size_t>>   contigs_;
+        std::vector<std::vector<Run>>                owned_;
+        void                                       * map_addr_ = nullptr;
+        size_t                                       map_size_ = 0;
+};
+
+}
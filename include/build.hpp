@@ -24,6 +24,7 @@ SOFTWARE.
 #include <string>
 #include "gtf.hpp"
 #include "fasta.hpp"
+#include "genome_store.hpp"
 namespace gwsc {
 
 //Genome and junction index
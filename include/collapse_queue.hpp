@@ -0,0 +1,139 @@
+#pragma once
+
+/*
+Copyright (c) 2018-2020 Gavin W. Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <deque>
+#include <map>
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include "bam_genes_aux.hpp"
+
+namespace gwsc {
+
+// Collapsed reads gathered before a batch is handed to the bam writer
+const size_t COLLAPSE_WRITE_BATCH = 50000;
+
+// One gene group handed from the reader to a worker and then to the writer
+struct CollapseTask {
+    BamBuffer                 buffer;
+    std::vector<BamDetail*>   collapsed;
+    size_t                    seq = 0;
+    // Worker statistics accumulated while processing this group
+    unsigned int              total = 0;
+    unsigned int              ambig = 0;
+    unsigned int              rlost = 0;
+    unsigned int              rreads = 0;
+    unsigned int              rdups = 0;
+    unsigned int              rcollapsed = 0;
+    unsigned int              creads = 0;
+};
+
+// Blocking FIFO of tasks, the number of tasks in circulation bounds the queue
+class CollapseQueue {
+    public:
+        void push(CollapseTask * t){
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                tasks_.push_back(t);
+            }
+            cv_.notify_one();
+        }
+
+        // Blocks until a task is available, returns nullptr once closed and empty
+        CollapseTask * pop(){
+            auto start = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]{ return !tasks_.empty() || closed_; });
+            wait_ += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            if(tasks_.empty()) return nullptr;
+            CollapseTask * t = tasks_.front();
+            tasks_.pop_front();
+            return t;
+        }
+
+        void close(){
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = true;
+            }
+            cv_.notify_all();
+        }
+
+        // Total seconds callers spent blocked in pop
+        double wait() const {
+            return 1.0 * wait_ / 1000000.0;
+        }
+
+    private:
+        std::deque<CollapseTask*>   tasks_;
+        std::mutex                  mutex_;
+        std::condition_variable     cv_;
+        uint64_t                    wait_ = 0;
+        bool                        closed_ = false;
+};
+
+// Finished tasks released strictly in read order
+class CollapseOrder {
+    public:
+        void push(CollapseTask * t){
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_[t->seq] = t;
+            }
+            cv_.notify_one();
+        }
+
+        // Blocks until the next task in sequence is done, nullptr when all have been returned
+        CollapseTask * pop(){
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]{ return done_.count(next_) > 0 || (closed_ && next_ >= last_); });
+            auto it = done_.find(next_);
+            if(it == done_.end()) return nullptr;
+            CollapseTask * t = it->second;
+            done_.erase(it);
+            next_++;
+            return t;
+        }
+
+        // Called by the reader once it knows how many tasks were issued
+        void close(size_t last){
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = true;
+                last_ = last;
+            }
+            cv_.notify_all();
+        }
+
+    private:
+        std::map<size_t, CollapseTask*>   done_;
+        std::mutex                        mutex_;
+        std::condition_variable           cv_;
+        size_t                            next_ = 0;
+        size_t                            last_ = 0;
+        bool                              closed_ = false;
+};
+
+}
@@ -20,6 +20,7 @@ SOFTWARE.
 
 #include "bam_genes.hpp"
 #include "fasta.hpp"
+#include "genome_store.hpp"
 #include <thread>
 #include "collapse_aux.hpp"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
@@ -34,7 +35,7 @@ class CollapseWorker {
         using cb_bhash = std::function<AlignSummary::bint(std::string &)>;
 
         using clengths = std::vector<std::pair<unsigned int, unsigned int>>;
-        CollapseWorker(BamOutputBuffer & cbuffer, const Fastas & genome)
+        CollapseWorker(BamOutputBuffer & cbuffer, const GenomeStore & genome)
             : cbuffer_(cbuffer), genome_(genome) {
         }
 
@@ -121,7 +122,7 @@ class CollapseWorker {
         cb_bhash                                  bhash_;
 
         BamOutputBuffer                         & cbuffer_;
-        const Fastas                            & genome_;
+        const GenomeStore                       & genome_;
         BamBuffer                               * buffer_;
         double                                    fds_filter = 1.1;
         unsigned int                              ccount_ = 0;
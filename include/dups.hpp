@@ -25,8 +25,8 @@ SOFTWARE.
 #include "dfix.hpp"
 #include "sequence.hpp"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
+#include <array>
 #include <cassert>
-#include <stack>
 #include <iomanip>
 #include <vector>
 #include <unordered_set>
@@ -81,77 +81,8 @@ struct DupNode {
     //uint32_t intronic;
 };
 
-template <typename N>
-class DupGraph {
-    public:
-        void reset(){
-            for(auto & e :edges_) e.clear();
-            for(auto & n :nodes_) n.reset();
-            N_ = 0;
-            E_ = 0;
-        }
-
-        void add_edge(size_t i, size_t j){
-            edges_[i].push_back(j);
-            edges_[j].push_back(i);
-            E_++;
-        }
-
-        bool empty() const {
-            return N_ == 0;
-        }
-
-        size_t nodes() const {
-            return N_;
-        }
-
-        size_t edges() const {
-            return E_;
-        }
-
-        const N & node(size_t i) const {
-            return nodes_[i];
-        }
-
-        N & node(size_t i) {
-            return nodes_[i];
-        }
-
-        const std::vector<uint32_t> & nedges(size_t i) const {
-            return edges_[i];
-        }
-
-        std::vector<uint32_t> & nedges(size_t i) {
-            return edges_[i];
-        }
-
-        N & add_node(){
-            N_++;
-            if(nodes_.size() < N_) {
-                nodes_.push_back(N());
-                edges_.push_back(std::vector<uint32_t>());
-            }
-            return nodes_[N_ - 1];
-        }
-
-        N & back() {
-            return nodes_[N_ - 1];
-        }
-
-        const N & back() const {
-            return nodes_[N_ - 1];
-        }
-
-    private:
-        std::vector<std::vector<uint32_t>>         edges_;
-        std::vector<N>                             nodes_;
-        unsigned int                               N_;
-        unsigned int                               E_;
-};
-
 template <typename N, typename A>
 class Dedup {
-    using umi_map = phmap::flat_hash_map<uint32_t, uint32_t>; 
     using group_hash = phmap::flat_hash_map<uint32_t, std::vector<uint32_t>>;
     Dedup(const Dedup & d) = delete;
     Dedup & operator=(const Dedup & d) = delete;
@@ -185,17 +116,21 @@ class Dedup {
         }
 
         using aiterator = typename std::vector<A>::iterator;
-        Dedup(unsigned int umi_len, uint32_t total_barcodes, uint32_t num_groups, const group_hash & gh) 
+        // Counts of one barcode, a row is only added for barcodes that have tags
+        struct BarcodeCounts {
+            AlignSummary::bint                    barcode;
+            std::array<uint32_t, ELEM_COUNT>      counts;
+        };
+
+        Dedup(unsigned int umi_len, uint32_t num_groups, const group_hash & gh) 
             : gh_(gh), umi_len_(umi_len), num_groups_(num_groups)
         {
-            molecule_counts.resize(total_barcodes * ELEM_COUNT);
-            group_counts.resize(total_barcodes * num_groups_);
         }
 
         void process(aiterator start, aiterator end);
 
-        std::vector<uint32_t>        molecule_counts;
-        std::vector<uint32_t>        group_counts;
+        std::vector<BarcodeCounts>   barcode_counts;
+        std::vector<uint32_t>        group_counts;     // num_groups per row of barcode_counts
         std::vector<GeneCount>       gene_counts;
         std::vector<UMIMap>          umi_correct;
         std::vector<UMIBad>          umi_bad;
@@ -208,18 +143,43 @@ class Dedup {
     private:
         void process_gene_(aiterator start, aiterator end);
         void apply_corrections_(AlignSummary::bint barcode, uint32_t gene_id, aiterator start, aiterator end);
+        uint32_t row_(AlignSummary::bint barcode);
         void count_gene_(AlignSummary::bint barcode, uint32_t gene_id, aiterator gstart, aiterator gend, size_t bstart);
 
-        void make_edges_(size_t nid, const N & node);
-        void find_subgraphs_();
+        // UMI clustering, UMIs one substitution apart are found by the pigeonhole principle over the two
+        // halves of the packed UMI and grouped with union-find
+        void find_pairs_();
+        void find_clusters_();
+        uint32_t dfs_winner_(uint32_t start, uint32_t max_count);
+        uint32_t find_(uint32_t i) {
+            while(parent_[i] != i) {
+                parent_[i] = parent_[parent_[i]];
+                i = parent_[i];
+            }
+            return i;
+        }
+
+        // Edge between two UMIs, from is the UMI whose count allowed the edge
+        struct UEdge {
+            uint32_t from;
+            uint32_t to;
+            uint32_t pb;   // Position * 4 + base of the substitution in to
+        };
 
-        DupGraph<N>                                   G_;
-        umi_map                                       H_;
+        std::vector<N>                                nodes_;
+        std::vector<UEdge>                            edges_;
+        std::vector<uint64_t>                         order_;
+        std::vector<uint32_t>                         parent_;
+        std::vector<uint32_t>                         winner_;
+        std::vector<uint32_t>                         maxc_;
+        std::vector<uint32_t>                         nmax_;
+        std::vector<uint32_t>                         csize_;
+        std::vector<uint32_t>                         adj_off_;
+        std::vector<uint64_t>                         adj_;
+        std::vector<uint32_t>                         stack_;
         std::vector<bool>                             V_;
-        std::vector<uint32_t>                         SG_;
-        std::vector<uint32_t>                         SC_;
-        std::stack<uint32_t, std::vector<uint32_t>>   stack_;
         std::vector<uint64_t>                         positions_;
+        phmap::flat_hash_map<AlignSummary::bint, uint32_t> rows_;
         TagFixer<A>                                   tfix_;
         size_t                                        cstart_ = 0;
 
@@ -284,8 +244,7 @@ void Dedup<N, A>::process(aiterator start, aiterator end){
 template <typename N, typename A>
 void Dedup<N, A>::process_gene_(aiterator start, aiterator end){
     if(start == end) return;
-    G_.reset();
-    H_.clear();
+    nodes_.clear();
 
     uint32_t gene_id = start->gene_id;
     auto barcode = start->barcode;
@@ -293,21 +252,21 @@ void Dedup<N, A>::process_gene_(aiterator start, aiterator end){
     for(auto it = start; it != end; it++){
         assert(start->barcode == it->barcode);
         assert(start->gene_id == it->gene_id);
-        if(G_.empty() || !G_.back().merge(*it)){
-            G_.add_node().init(*it);
-            H_[G_.back().hash()] = G_.nodes() - 1;
+        if(nodes_.empty() || !nodes_.back().merge(*it)){
+            nodes_.push_back(N());
+            nodes_.back().init(*it);
         }
     }
 
-    for(size_t i = 0; i < G_.nodes(); i++) {
-        //G_.node(i).prepare();
-        total_reads2 += G_.node(i).count;
+    for(auto & n : nodes_) {
+        total_reads2 += n.count;
+        total_reads3 += n.count;
     }
 
-    for(size_t i = 0; i < G_.nodes(); i++){
-        make_edges_(i, G_.node(i));
-    }
-    find_subgraphs_();
+    if(nodes_.size() < 2) return;
+    find_pairs_();
+    if(edges_.empty()) return;
+    find_clusters_();
     apply_corrections_(barcode, gene_id, start, end);
 }
 
@@ -315,34 +274,14 @@ template <typename N, typename A>
 void Dedup<N, A>::apply_corrections_(AlignSummary::bint barcode, uint32_t gene_id, aiterator gstart, aiterator gend){
 
     size_t ustart = umi_correct.size();
-    for(size_t i = 0; i < SC_.size() - 1; i++){
-        size_t max_count = 0, total_umis = 0;
-        uint32_t max_umi = 0;
-        auto start = SG_.begin() + SC_[i];
-        auto end = SG_.begin() + SC_[i + 1];
-        size_t r = 0;
-        positions_.clear();
-        while(start != end){
-            auto const & n = G_.node(*start);
-            total_umis++;
-            if(n.count > max_count) {
-                max_count = n.count;
-                max_umi = n.umi;
-            }
-            r += n.count;
-            start++;
-        }
-
-        if(total_umis > 1){
-            for(auto it = SG_.begin() + SC_[i]; it != end; it++){
-                auto const & n = G_.node(*it);
-                if(n.umi != max_umi) umi_correct.push_back(UMIMap(barcode, gene_id, n.umi, max_umi));
-            }
+    for(uint32_t i = 0; i < nodes_.size(); i++){
+        uint32_t r = find_(i);
+        if(csize_[r] > 1 && winner_[r] != i){
+            umi_correct.push_back(UMIMap(barcode, gene_id, nodes_[i].umi, nodes_[winner_[r]].umi));
         }
     }
 
     if(ustart == umi_correct.size()){
-        //std::cout << "  " << barcode << " corrected 0 out of " << (gend - gstart) << "\n";
         return;
     }
     size_t corrected = 0;
@@ -357,7 +296,17 @@ void Dedup<N, A>::apply_corrections_(AlignSummary::bint barcode, uint32_t gene_i
             corrected++;
         }
     }
-    //std::cout << "  " << barcode << " corrected " << corrected << " out of " << (gend - gstart) << "\n";
+}
+
+template <typename N, typename A>
+uint32_t Dedup<N, A>::row_(AlignSummary::bint barcode){
+    auto it = rows_.find(barcode);
+    if(it != rows_.end()) return it->second;
+    uint32_t row = barcode_counts.size();
+    rows_.insert(std::make_pair(barcode, row));
+    barcode_counts.push_back(BarcodeCounts{barcode, {}});
+    group_counts.resize(group_counts.size() + num_groups_, 0);
+    return row;
 }
 
 template <typename N, typename A>
@@ -431,20 +380,21 @@ void Dedup<N, A>::count_gene_(AlignSummary::bint barcode, uint32_t gene_id, aite
     }
     //std::cout << "  Discarded = " << dreads << " vs " << tfix_.discarded << "\n";
     dcount_ += dreads;
-    auto idx = barcode * CountType::ELEM_COUNT;
-    molecule_counts[idx + CountType::DREADS] += dreads;
+    auto row = row_(barcode);
+    auto & counts = barcode_counts[row].counts;
+    counts[CountType::DREADS] += dreads;
     if(intronic == 0 && molecules == 0) return;
     gene_counts.push_back(GeneCount(barcode, gene_id, molecules, intronic));
 
-    molecule_counts[idx + CountType::MOLECULES] += molecules;
-    molecule_counts[idx + CountType::PCR_DUPS] += dups;
-    molecule_counts[idx + CountType::READS] += reads;
-    molecule_counts[idx + CountType::INTRONIC] += intronic;
-    molecule_counts[idx + CountType::IREADS] += intronic_reads;
-    molecule_counts[idx + CountType::IPCR_DUPS] += intronic_dups;
+    counts[CountType::MOLECULES] += molecules;
+    counts[CountType::PCR_DUPS] += dups;
+    counts[CountType::READS] += reads;
+    counts[CountType::INTRONIC] += intronic;
+    counts[CountType::IREADS] += intronic_reads;
+    counts[CountType::IPCR_DUPS] += intronic_dups;
     if(molecules > 0){
-        molecule_counts[idx + CountType::GENES]++; // Total genes for this barcode
-        auto gidx = barcode * num_groups_;
+        counts[CountType::GENES]++; // Total genes for this barcode
+        auto gidx = static_cast<size_t>(row) * num_groups_;
         auto git = gh_.find(gene_id);
         if(git != gh_.end()) {
             //std::cout << " barcode = " << barcode << " num_genes = " << num_groups_ << " gidx = " << gidx << " gid = " << gene_id << " molecules = " << molecules << " groups = ";
@@ -459,54 +409,122 @@ void Dedup<N, A>::count_gene_(AlignSummary::bint barcode, uint32_t gene_id, aite
 
 
 template <typename N, typename A>
-void Dedup<N, A>::make_edges_(size_t nid, const N & node){
-    for(size_t i = 0; i < umi_len_; i++){
-        uint32_t mask = node.umi & ~getmask<uint32_t>(i, 2);
-        for(uint32_t b = 0; b < 4; b++){
-            uint32_t m = mask | (b << (i * 2));
-            if(m != node.umi){
-                auto it = H_.find(m);
-                if(it == H_.end()) continue;
-                auto c = G_.node(it->second).count;
-                if((node.count == 1 && c == 1 && nid < it->second) || ((c > 1 || node.count > 1) && node.count >= (c * 2 - 1))){
-                    //std::cout <<  "  Add Edge " << nid << " --> " << it-> second << ", "
-                    //    << int2seq<ADNA4>(node.umi, umi_len_) << " --> " << int2seq<ADNA4>(G_.node(it->second).umi, umi_len_) << "\n";
-                    G_.add_edge(nid, it->second);
+void Dedup<N, A>::find_pairs_(){
+    // Two UMIs one substitution apart match exactly on one of the halves, so only UMIs sharing
+    // a half are compared. Each pair is found once as the other half holds the substitution
+    uint32_t n = nodes_.size();
+    unsigned int half = umi_len_ / 2;
+    uint32_t lo = getmask<uint32_t>(0, 2 * half);
+    uint32_t hi = static_cast<uint32_t>(getmask<uint64_t>(0, 2 * umi_len_)) & ~lo;
+    edges_.clear();
+    parent_.resize(n);
+    for(uint32_t i = 0; i < n; i++) parent_[i] = i;
+
+    for(uint32_t mask : {lo, hi}){
+        order_.clear();
+        for(uint32_t i = 0; i < n; i++){
+            order_.push_back((static_cast<uint64_t>(nodes_[i].umi & mask) << 32) | i);
+        }
+        std::sort(order_.begin(), order_.end());
+        size_t gs = 0;
+        while(gs < order_.size()){
+            size_t ge = gs + 1;
+            while(ge < order_.size() && (order_[ge] >> 32) == (order_[gs] >> 32)) ge++;
+            for(size_t x = gs; x < ge; x++){
+                uint32_t a = static_cast<uint32_t>(order_[x]);
+                for(size_t y = x + 1; y < ge; y++){
+                    uint32_t b = static_cast<uint32_t>(order_[y]);
+                    uint32_t d = nodes_[a].umi ^ nodes_[b].umi;
+                    d = (d | (d >> 1)) & 0x55555555U;
+                    if(__builtin_popcount(d) != 1) continue;
+
+                    // a < b as the nodes are sorted by UMI and the index is the tie breaker in order_
+                    uint32_t ca = nodes_[a].count, cb = nodes_[b].count;
+                    uint32_t from, to;
+                    if((ca == 1 && cb == 1) || ((ca > 1 || cb > 1) && ca >= (cb * 2 - 1))){
+                        from = a;
+                        to = b;
+                    }else if((ca > 1 || cb > 1) && cb >= (ca * 2 - 1)){
+                        from = b;
+                        to = a;
+                    }else{
+                        continue;
+                    }
+                    uint32_t pos = __builtin_ctz(d) / 2;
+                    edges_.push_back(UEdge{from, to, pos * 4 + ((nodes_[to].umi >> (2 * pos)) & 3)});
+                    uint32_t ra = find_(a), rb = find_(b);
+                    if(ra < rb) parent_[rb] = ra;
+                    else if(rb < ra) parent_[ra] = rb;
                 }
             }
+            gs = ge;
         }
     }
 }
 
 template <typename N, typename A>
-void Dedup<N, A>::find_subgraphs_(){
-    // Each connected component represents a umi group
-    //SG_ should be naturally sorted by their gene ID because the nodes in G are sorted
-    V_.clear();
-    V_.resize(G_.nodes(), false);
-    SG_.clear();
-    SC_.clear();
-    SC_.push_back(SG_.size());
-    for(size_t i = 0; i < V_.size(); i++){
-        if(V_[i]) continue;
-        stack_.push(i);
-        //std::cout << "  Subgraph\n";
-        while(!stack_.empty()){
-            uint32_t t = stack_.top();
-            stack_.pop();
-            if(V_[t]) continue;
-            SG_.push_back(t);
-            total_reads3 += G_.node(t).count;
-            //std::cout << "    " << t << " umi = " << int2seq<ADNA4>(G_.node(t).umi, umi_len_) << " visited = " << V_[t] << " edges = [";
-            V_[t] = true;
-            for(auto e : G_.nedges(t)){
-                //std::cout << e << ", ";
-                if(!V_[e]) stack_.push(e);
-            }
-            //std::cout << "]\n";
+void Dedup<N, A>::find_clusters_(){
+    // The root of each cluster is its lowest node. The UMI kept is the first node with the highest count
+    // in the order a depth first search from the root visits them, the search is only needed for ties
+    uint32_t n = nodes_.size();
+    winner_.resize(n);
+    maxc_.assign(n, 0);
+    nmax_.assign(n, 0);
+    csize_.assign(n, 0);
+    for(uint32_t i = 0; i < n; i++){
+        uint32_t r = find_(i);
+        uint32_t c = nodes_[i].count;
+        csize_[r]++;
+        if(c > maxc_[r]){
+            maxc_[r] = c;
+            nmax_[r] = 1;
+            winner_[r] = i;
+        }else if(c == maxc_[r]){
+            nmax_[r]++;
+        }
+    }
+    adj_off_.clear();
+    for(uint32_t r = 0; r < n; r++){
+        if(parent_[r] != r || nmax_[r] < 2 || nodes_[r].count == maxc_[r]) continue;
+        winner_[r] = dfs_winner_(r, maxc_[r]);
+    }
+}
+
+template <typename N, typename A>
+uint32_t Dedup<N, A>::dfs_winner_(uint32_t start, uint32_t max_count){
+    uint32_t n = nodes_.size();
+    if(adj_off_.empty()){
+        // Adjacency in the order the edges were originally added, by the adding node and then
+        // the position and base of the substitution
+        adj_off_.assign(n + 1, 0);
+        for(auto & e : edges_){
+            adj_off_[e.from + 1]++;
+            adj_off_[e.to + 1]++;
+        }
+        for(uint32_t i = 0; i < n; i++) adj_off_[i + 1] += adj_off_[i];
+        adj_.resize(adj_off_.back());
+        stack_.assign(adj_off_.begin(), adj_off_.end() - 1);
+        for(auto & e : edges_){
+            adj_[stack_[e.from]++] = (static_cast<uint64_t>(e.from) << 40) | (static_cast<uint64_t>(e.pb) << 32) | e.to;
+            adj_[stack_[e.to]++] = (static_cast<uint64_t>(e.from) << 40) | e.from;
+        }
+        for(uint32_t i = 0; i < n; i++) std::sort(adj_.begin() + adj_off_[i], adj_.begin() + adj_off_[i + 1]);
+        V_.assign(n, false);
+    }
+    stack_.clear();
+    stack_.push_back(start);
+    while(!stack_.empty()){
+        uint32_t t = stack_.back();
+        stack_.pop_back();
+        if(V_[t]) continue;
+        if(nodes_[t].count == max_count) return t;
+        V_[t] = true;
+        for(uint32_t k = adj_off_[t]; k < adj_off_[t + 1]; k++){
+            uint32_t e = static_cast<uint32_t>(adj_[k]);
+            if(!V_[e]) stack_.push_back(e);
         }
-        SC_.push_back(SG_.size());
     }
+    return start;
 }
 
 }
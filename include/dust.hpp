@@ -28,6 +28,7 @@ namespace gwsc {
 class Dust{
     public:
         double calculate(const std::string & r, unsigned int end);
+        double calculate(const char * r, unsigned int end);
 
     private:
         std::array<unsigned int, 64> hash;
@@ -35,15 +36,23 @@ class Dust{
 };
 
 inline double Dust::calculate(const std::string & r, unsigned int end){
+    return calculate(r.c_str(), end);
+}
+
+// Rolls the 2 bit packed 3-mer along the read instead of recoding each base three times
+inline double Dust::calculate(const char * r, unsigned int end){
     hash.fill(0);
-    for(size_t i = 0; i < end - 2; i++){
-        if(r[i] == 'N' || r[i + 1] == 'N' || r[i + 2] == 'N'){
+    if(end < 3) return 0.0;
+    uint32_t k = 0;
+    unsigned int valid = 0;
+    for(size_t i = 0; i < end; i++){
+        char c = ADNA4::ltable_[static_cast<unsigned int>(r[i])];
+        if(r[i] == 'N' || c < 0){
+            valid = 0;
             continue;
         }
-        uint32_t k = (ADNA4::ltable_[static_cast<unsigned int>(r[i])] << 4) 
-                        | (ADNA4::ltable_[static_cast<unsigned int>(r[i + 1])] << 2)
-                        | (ADNA4::ltable_[static_cast<unsigned int>(r[i + 2])]);
-        hash[k]++;
+        k = ((k << 2) | c) & 0x3F;
+        if(++valid >= 3) hash[k]++;
     }
 
     double score = 0.0;
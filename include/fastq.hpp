@@ -56,11 +56,16 @@ class FastqReader {
 
         }
 
-        bool open(const std::string & fin){
+        // async inflates gzip files on a dedicated thread
+        bool open(const std::string & fin, bool async = false){
             close();
             static const std::string gzp = ".gz";
             if(fin.size() > 3 && std::equal(gzp.rbegin(), gzp.rend(), fin.rbegin())){
-                buffer = new GzipBuffer;
+                if(async){
+                    buffer = new AsyncGzipBuffer;
+                }else{
+                    buffer = new GzipBuffer;
+                }
             }else{
                 buffer = new FileBuffer;
             }
@@ -114,7 +119,43 @@ class FastqReader {
             return true;
         }
 
+        // Append the name, seq and qual to arena each NUL terminated, the comment is dropped
+        bool append(std::string & arena, uint32_t & name_len, uint32_t & seq_len){
+            if(buffer->last_char == 0){
+                int c;
+                while((c = buffer->get_char()) != -1 && c != '@'){
+                    if(c == -1) return false;
+                    buffer->last_char = c;
+                }
+            }
+            size_t start = arena.size();
+            if(buffer->get_until(0, arena) < 0){
+                return false;
+            }
+            name_len = arena.size() - start;
+            arena.push_back('\0');
+
+            if(*std::next(buffer->begin, -1) != '\n'){
+                comment_.clear();
+                buffer->get_until('\n', comment_);
+            }
+
+            start = arena.size();
+            buffer->get_until('\n', arena);
+            seq_len = arena.size() - start;
+            arena.push_back('\0');
+            char c = 0;
+            while((c = buffer->get_char()) != -1 && c != '\n');
+            buffer->get_until('\n', arena);
+            arena.push_back('\0');
+            buffer->last_char = 0;
+            return true;
+        }
+
         BufferBase          * buffer = nullptr;
+
+    private:
+        std::string           comment_;
 };
 
 }
@@ -22,6 +22,7 @@ SOFTWARE.
 */
 #include "align_aux.hpp"
 #include "index.hpp"
+#include "sequence.hpp"
 #include "bwamem.h"
 
 namespace gwsc {
@@ -40,11 +41,13 @@ class GenomeAlign{
             if(args_ != nullptr)
                 free(args_);
         }
-        void load(const std::string & prefix, unsigned int min_overhang);
-        void align(AlignGroup & ad, const std::string & seq, unsigned int len) const;
-        void get(AlignGroup & ad, size_t i, const std::string & seq, unsigned int len) const;
-        void rescore(AlignData & a, const std::string & seq) const;
-        void verify(AlignData & a, const std::string & seq, const std::string & msg = "") const;
+        // When shm is set the index is attached from shared memory if it was staged with scsnv shm load
+        void load(const std::string & prefix, unsigned int min_overhang, bool shm = false);
+        // buf is the calling thread's BWA scratch space, it is reused across reads
+        void align(AlignGroup & ad, const ArenaStr & seq, unsigned int len, mem_buf_t * buf) const;
+        void get(AlignGroup & ad, size_t i, const ArenaStr & seq, unsigned int len, mem_buf_t * buf) const;
+        void rescore(AlignData & a, const ArenaStr & seq) const;
+        void verify(AlignData & a, const ArenaStr & seq, const std::string & msg = "") const;
         const bwaidx_t * gidx() const {
             return bidx_;
         }
@@ -0,0 +1,305 @@
+/*
+Copyright (c) 2018-2020 Gavin W. Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fasta.hpp"
+
+namespace gwsc {
+
+// Reference genome packed at 2 bits per base with a list of N runs per contig.
+// scsnv index writes <prefix>_genome.bin which is memory mapped on load, a plain
+// FASTA file is also accepted and packed in memory.
+class GenomeStore {
+    GenomeStore( const GenomeStore& ) = delete;
+    GenomeStore& operator=(const GenomeStore&) = delete;
+    public:
+        static const uint64_t MAGIC = 0x3142324753435347ULL; // "GSCSG2B1"
+
+        // Half open run of bases that are not A, C, G or T
+        struct NRun {
+            uint32_t lft;
+            uint32_t rgt;
+        };
+
+        struct Contig {
+            std::string      name;
+            uint64_t         length = 0;
+            const uint8_t  * seq = nullptr;
+            const NRun     * nruns = nullptr;
+            uint64_t         ncount = 0;
+        };
+
+        GenomeStore() {
+        }
+
+        explicit GenomeStore(const std::string & fname) {
+            open(fname);
+        }
+
+        ~GenomeStore() {
+            close();
+        }
+
+        void open(const std::string & fname) {
+            close();
+            uint64_t magic = 0;
+            {
+                std::ifstream in(fname, std::ios::binary);
+                if(!in.good()){
+                    std::cerr << "Could not open " << fname << " for reading\n";
+                    exit(1);
+                }
+                in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+            }
+            if(magic == MAGIC){
+                map_(fname);
+            }else{
+                load_fasta_(fname);
+            }
+        }
+
+        void close() {
+            if(map_addr_ != nullptr) munmap(map_addr_, map_size_);
+            map_addr_ = nullptr;
+            map_size_ = 0;
+            contigs_.clear();
+            packed_.clear();
+            nruns_.clear();
+        }
+
+        size_t size() const {
+            return contigs_.size();
+        }
+
+        const std::string & name(size_t tid) const {
+            return contigs_[tid].name;
+        }
+
+        uint64_t length(size_t tid) const {
+            return contigs_[tid].length;
+        }
+
+        // Contig index for a name or -1 when missing
+        int tid(const std::string & name) const {
+            for(size_t i = 0; i < contigs_.size(); i++){
+                if(contigs_[i].name == name) return static_cast<int>(i);
+            }
+            return -1;
+        }
+
+        // Upper case base at pos, N for masked or out of range positions
+        char base(size_t tid, uint64_t pos) const {
+            const Contig & c = contigs_[tid];
+            if(pos >= c.length || masked_(c, pos)) return 'N';
+            return base_(c, pos);
+        }
+
+        // Decode [lft, rgt) into out
+        void fetch(size_t tid, uint64_t lft, uint64_t rgt, std::string & out) const {
+            const Contig & c = contigs_[tid];
+            rgt = std::min(rgt, c.length);
+            out.clear();
+            if(lft >= rgt) return;
+            out.resize(rgt - lft);
+            for(uint64_t p = lft; p < rgt; p++){
+                out[p - lft] = base_(c, p);
+            }
+            const NRun * it = std::upper_bound(c.nruns, c.nruns + c.ncount, lft, [](uint64_t v, const NRun & r){ return v < r.rgt; });
+            for(; it != c.nruns + c.ncount && it->lft < rgt; it++){
+                uint64_t s = std::max<uint64_t>(it->lft, lft), e = std::min<uint64_t>(it->rgt, rgt);
+                std::fill(out.begin() + (s - lft), out.begin() + (e - lft), 'N');
+            }
+        }
+
+        size_t bytes() const {
+            size_t tot = 0;
+            for(auto const & c : contigs_) tot += (c.length + 3) / 4 + c.ncount * sizeof(NRun);
+            return tot;
+        }
+
+        // Packs one contig, bases are stored A=0 C=1 G=2 T=3 with anything else masked as N
+        static void pack(const std::string & seq, std::vector<uint8_t> & packed, std::vector<NRun> & nruns) {
+            packed.assign((seq.size() + 3) / 4, 0);
+            nruns.clear();
+            for(size_t i = 0; i < seq.size(); i++){
+                uint8_t v;
+                switch(seq[i]){
+                    case 'A': case 'a': v = 0; break;
+                    case 'C': case 'c': v = 1; break;
+                    case 'G': case 'g': v = 2; break;
+                    case 'T': case 't': v = 3; break;
+                    default:
+                        if(!nruns.empty() && nruns.back().rgt == i){
+                            nruns.back().rgt++;
+                        }else{
+                            nruns.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(i + 1)});
+                        }
+                        continue;
+                }
+                packed[i >> 2] |= v << ((i & 3) << 1);
+            }
+        }
+
+    private:
+        static char base_(const Contig & c, uint64_t pos) {
+            return "ACGT"[(c.seq[pos >> 2] >> ((pos & 3) << 1)) & 3];
+        }
+
+        bool masked_(const Contig & c, uint64_t pos) const {
+            if(c.ncount == 0) return false;
+            const NRun * it = std::upper_bound(c.nruns, c.nruns + c.ncount, pos, [](uint64_t v, const NRun & r){ return v < r.rgt; });
+            return it != c.nruns + c.ncount && it->lft <= pos;
+        }
+
+        void map_(const std::string & fname) {
+            int fd = ::open(fname.c_str(), O_RDONLY);
+            struct stat st;
+            if(fd < 0 || fstat(fd, &st) != 0){
+                std::cerr << "Could not open " << fname << " for reading\n";
+                exit(1);
+            }
+            map_size_ = st.st_size;
+            void * addr = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(addr == MAP_FAILED){
+                std::cerr << "Could not memory map " << fname << "\n";
+                exit(1);
+            }
+            map_addr_ = addr;
+            const uint8_t * base = static_cast<const uint8_t*>(addr);
+            uint64_t header[4];
+            memcpy(header, base, sizeof(header));
+            uint64_t count = header[2];
+            const uint8_t * tp = base + header[3];
+            contigs_.resize(count);
+            for(auto & c : contigs_){
+                uint64_t entry[5];
+                memcpy(entry, tp, sizeof(entry));
+                tp += sizeof(entry);
+                c.length = entry[0];
+                c.seq = base + entry[1];
+                c.nruns = reinterpret_cast<const NRun*>(base + entry[2]);
+                c.ncount = entry[3];
+                c.name.assign(reinterpret_cast<const char*>(tp), entry[4]);
+                tp += entry[4];
+            }
+        }
+
+        void load_fasta_(const std::string & fname) {
+            FastaReader fr(fname);
+            Fasta fa;
+            while(fr.read(fa)){
+                packed_.emplace_back();
+                nruns_.emplace_back();
+                pack(fa.seq.str(), packed_.back(), nruns_.back());
+                contigs_.emplace_back();
+                contigs_.back().name = fa.name;
+                contigs_.back().length = fa.seq.size();
+            }
+            for(size_t i = 0; i < contigs_.size(); i++){
+                contigs_[i].seq = packed_[i].data();
+                contigs_[i].nruns = nruns_[i].data();
+                contigs_[i].ncount = nruns_[i].size();
+            }
+        }
+
+        std::vector<Contig>                  contigs_;
+        std::vector<std::vector<uint8_t>>    packed_;
+        std::vector<std::vector<NRun>>       nruns_;
+        void                               * map_addr_ = nullptr;
+        size_t                               map_size_ = 0;
+};
+
+// Streams contigs into the binary layout read by GenomeStore. The header holds
+// {MAGIC, version, contig count, table offset}, each contig stores its packed bases
+// and N runs 8 byte aligned and the table at the end holds
+// {length, seq offset, N run offset, N run count, name length} followed by the name.
+class GenomeStoreWriter {
+    public:
+        explicit GenomeStoreWriter(const std::string & fname) : out_(fname, std::ios::binary) {
+            if(!out_.good()){
+                std::cerr << "Could not open " << fname << " for writing\n";
+                exit(1);
+            }
+            uint64_t header[4] = {GenomeStore::MAGIC, 1, 0, 0};
+            out_.write(reinterpret_cast<const char*>(header), sizeof(header));
+            pos_ = sizeof(header);
+        }
+
+        ~GenomeStoreWriter() {
+            close();
+        }
+
+        void add(const std::string & name, const std::string & seq) {
+            GenomeStore::pack(seq, packed_, nruns_);
+            uint64_t soff = pos_;
+            write_(packed_.data(), packed_.size());
+            uint64_t noff = pos_;
+            write_(nruns_.data(), nruns_.size() * sizeof(GenomeStore::NRun));
+            uint64_t entry[5] = {seq.size(), soff, noff, nruns_.size(), name.size()};
+            table_.append(reinterpret_cast<const char*>(entry), sizeof(entry));
+            table_.append(name);
+            count_++;
+        }
+
+        void close() {
+            if(!out_.is_open()) return;
+            uint64_t toff = pos_;
+            out_.write(table_.data(), table_.size());
+            uint64_t header[4] = {GenomeStore::MAGIC, 1, count_, toff};
+            out_.seekp(0);
+            out_.write(reinterpret_cast<const char*>(header), sizeof(header));
+            out_.close();
+        }
+
+    private:
+        void write_(const void * data, size_t n) {
+            out_.write(static_cast<const char*>(data), n);
+            pos_ += n;
+            // Keep every block 8 byte aligned in the mapped file
+            static const char pad[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            size_t r = (8 - (pos_ & 7)) & 7;
+            out_.write(pad, r);
+            pos_ += r;
+        }
+
+        std::ofstream               out_;
+        std::string                 table_;
+        std::vector<uint8_t>        packed_;
+        std::vector<GenomeStore::NRun> nruns_;
+        uint64_t                    pos_ = 0;
+        uint64_t                    count_ = 0;
+};
+
+}
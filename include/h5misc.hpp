@@ -22,23 +22,169 @@ SOFTWARE.
 */
 
 #include <H5Cpp.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
 #include <vector>
 
+// Compression of the numeric datasets, level 0 disables deflate
+struct H5Compression {
+    unsigned int level = 6;
+    bool         shuffle = false;
+    size_t       chunk = 1 << 16;   // Elements per chunk
+    unsigned int threads = 1;       // Threads compressing chunks before they are written
+};
+
+// Process wide settings used when a writer is not given its own
+inline H5Compression & h5_compression() {
+    static H5Compression opts;
+    return opts;
+}
+
+// Appends to an extendable chunked 1D dataset. Full chunks are filtered on worker threads
+// and written directly so the dataset never has to be held in memory
+template <typename T>
+class H5ChunkWriter {
+    H5ChunkWriter(const H5ChunkWriter &) = delete;
+    H5ChunkWriter & operator=(const H5ChunkWriter &) = delete;
+
+    public:
+        template <typename F, typename P>
+        H5ChunkWriter(const std::string & name, F & h5, P dtype, const H5Compression & opts = h5_compression()) 
+            : opts_(opts)
+        {
+            using namespace H5;
+            opts_.chunk = std::max<size_t>(1, opts_.chunk);
+            opts_.threads = std::max(1U, opts_.threads);
+            hsize_t dims[1] = {0};
+            hsize_t maxdims[1] = {H5S_UNLIMITED};
+            hsize_t cdims[1] = {opts_.chunk};
+            DataSpace dataspace(1, dims, maxdims);
+            IntType datatype(dtype);
+            datatype.setOrder( H5T_ORDER_LE );
+            DSetCreatPropList ds_creatplist;
+            ds_creatplist.setChunk( 1, cdims );
+            if(opts_.shuffle) ds_creatplist.setShuffle();
+            if(opts_.level > 0) ds_creatplist.setDeflate( opts_.level );
+            dataset_ = h5.createDataSet(name, datatype, dataspace, ds_creatplist);
+            pending_.reserve(opts_.chunk * batch_());
+        }
+
+        ~H5ChunkWriter() {
+            close();
+        }
+
+        void push_back(const T & v) {
+            pending_.push_back(v);
+            if(pending_.size() == pending_.capacity()) flush_(false);
+        }
+
+        void append(const T * data, size_t n) {
+            while(n > 0) {
+                size_t k = std::min(n, pending_.capacity() - pending_.size());
+                pending_.insert(pending_.end(), data, data + k);
+                data += k;
+                n -= k;
+                if(pending_.size() == pending_.capacity()) flush_(false);
+            }
+        }
+
+        void append(const std::vector<T> & data) {
+            append(data.data(), data.size());
+        }
+
+        size_t size() const {
+            return written_ + pending_.size();
+        }
+
+        // Writes the partial last chunk, nothing can be appended afterwards
+        void close() {
+            if(closed_) return;
+            flush_(true);
+            dataset_.close();
+            closed_ = true;
+        }
+
+    private:
+        size_t batch_() const {
+            return 4 * opts_.threads;
+        }
+
+        // Shuffle and deflate a chunk the same way the HDF5 filter pipeline does
+        void filter_(size_t c, std::vector<unsigned char> & tmp) {
+            size_t first = c * opts_.chunk;
+            size_t n = std::min(opts_.chunk, pending_.size() - first);
+            size_t bytes = opts_.chunk * sizeof(T);
+            auto & out = chunks_[c];
+            // The last chunk is padded to the full chunk size
+            tmp.assign(bytes, 0);
+            const unsigned char * src = reinterpret_cast<const unsigned char*>(pending_.data() + first);
+            if(opts_.shuffle && sizeof(T) > 1) {
+                for(size_t i = 0; i < n; i++) {
+                    for(size_t j = 0; j < sizeof(T); j++) tmp[j * opts_.chunk + i] = src[i * sizeof(T) + j];
+                }
+            }else{
+                std::memcpy(tmp.data(), src, n * sizeof(T));
+            }
+            if(opts_.level == 0) {
+                out.swap(tmp);
+                return;
+            }
+            uLongf len = compressBound(bytes);
+            out.resize(len);
+            if(compress2(out.data(), &len, tmp.data(), bytes, opts_.level) != Z_OK) {
+                std::cout << "Error! Failed compressing an HDF5 chunk\n";
+                exit(1);
+            }
+            out.resize(len);
+        }
+
+        void flush_(bool last) {
+            size_t N = (pending_.size() + opts_.chunk - 1) / opts_.chunk;
+            if(!last) N = pending_.size() / opts_.chunk;
+            if(N == 0) return;
+            chunks_.resize(std::max(chunks_.size(), N));
+
+            unsigned int nt = std::min<size_t>(opts_.threads, N);
+            std::vector<std::thread> threads;
+            auto work = [this, N, nt](unsigned int t) {
+                std::vector<unsigned char> tmp;
+                for(size_t c = t; c < N; c += nt) filter_(c, tmp);
+            };
+            for(unsigned int t = 1; t < nt; t++) threads.emplace_back(work, t);
+            work(0);
+            for(auto & t : threads) t.join();
+
+            size_t n = std::min(pending_.size(), N * opts_.chunk);
+            hsize_t extent[1] = {written_ + n};
+            dataset_.extend(extent);
+            for(size_t c = 0; c < N; c++) {
+                hsize_t offset[1] = {written_ + c * opts_.chunk};
+                if(H5Dwrite_chunk(dataset_.getId(), H5P_DEFAULT, 0, offset, chunks_[c].size(), chunks_[c].data()) < 0) {
+                    std::cout << "Error! Failed writing an HDF5 chunk\n";
+                    exit(1);
+                }
+            }
+            written_ += n;
+            pending_.erase(pending_.begin(), pending_.begin() + n);
+        }
+
+        H5::DataSet                                  dataset_;
+        H5Compression                                opts_;
+        std::vector<T>                               pending_;
+        std::vector<std::vector<unsigned char>>      chunks_;
+        size_t                                       written_ = 0;
+        bool                                         closed_ = false;
+};
+
 template <typename T, typename F, typename P>
 void write_h5_numeric(const std::string & name, const std::vector<T> & data, F & h5, P dtype){
-    using namespace H5;
-    //tout << "Writing samples\n";
-    hsize_t dimsf[1];
-    dimsf[0] = data.size();
-    DataSpace dataspace(1, dimsf);
-    //
-    IntType datatype(dtype);
-    datatype.setOrder( H5T_ORDER_LE );
-    DSetCreatPropList ds_creatplist;  // create dataset creation prop list
-    ds_creatplist.setChunk( 1, dimsf );  // then modify it for compression
-    ds_creatplist.setDeflate( 6 );
-    DataSet count_dataset = h5.createDataSet(name, datatype, dataspace, ds_creatplist);
-    count_dataset.write(data.data(), dtype);
+    H5ChunkWriter<T> writer(name, h5, dtype);
+    writer.append(data);
+    writer.close();
 }
 
 template <typename F>
@@ -47,10 +193,10 @@ void write_h5_string(const std::string & name, const std::vector<const char *> &
     StrType st(H5::PredType::C_S1, H5T_VARIABLE);
     st.setCset(H5T_CSET_UTF8);
     hsize_t dim[1] = {data.size()};
+    hsize_t cdim[1] = {std::max<hsize_t>(1, std::min<hsize_t>(data.size(), h5_compression().chunk))};
     H5::DataSpace ds = H5::DataSpace(1, dim);
     DSetCreatPropList ds_creatplist;  // create dataset creation prop list
-    ds_creatplist.setChunk( 1, dim );  // then modify it for compression
-    ds_creatplist.setDeflate( 6 );
+    ds_creatplist.setChunk( 1, cdim );  // then modify it for compression
+    if(h5_compression().level > 0) ds_creatplist.setDeflate( h5_compression().level );
     h5.createDataSet(name,st,ds, ds_creatplist).write(data.data(), st);
 }
-
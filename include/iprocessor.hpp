@@ -119,9 +119,9 @@ struct BarcodeCall{
 class IndexProcessor{
     public:
         using getrange = std::function<std::pair<size_t, size_t>(size_t)>;
-        IndexProcessor(const std::string & name, ProcessorBase * processor, const TXIndex & index, Fastas & genome, bool use_dups, 
+        IndexProcessor(const std::string & name, ProcessorBase * processor, const TXIndex & index, const GenomeStore & genome, const BaseTrack & btrack, bool use_dups, 
                 std::string & bam_file, const phmap::flat_hash_map<std::string, unsigned int> & bchash, size_t BC, bool filter_barcodes) 
-            : bchash_(bchash), name_(name), processor_(processor), pileup_(bchash.size(), index, genome, use_dups), filter_barcodes_(filter_barcodes)
+            : bchash_(bchash), name_(name), processor_(processor), pileup_(bchash.size(), index, genome, btrack, use_dups), filter_barcodes_(filter_barcodes)
 
         {
             //code 0  for genome 1 for scsnv 2 for cellranger
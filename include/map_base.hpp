@@ -29,6 +29,7 @@ SOFTWARE.
 #include "pmap.hpp"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
 #include "sbam_writer.hpp"
+#include "umi_table.hpp"
 #include "transcript_align.hpp"
 #include "genome_align.hpp"
 #include <exception>
@@ -43,18 +44,18 @@ namespace gwsc{
 template <typename T>
 class MapBase {
     public:
-        MapBase() : counts{}, index_(), bout_(), txa_(index_, T::LibraryStrand), gna_(index_, T::LibraryStrand) {
+        MapBase() : counts{}, avoided_counts{}, index_(), bout_(), txa_(index_, T::LibraryStrand), gna_(index_, T::LibraryStrand) {
             smode_ = T::LibraryStrand;
         }
 
-        void load_index(const std::string & txindex, unsigned int min_overhang, const std::string & gindex){
+        void load_index(const std::string & txindex, unsigned int min_overhang, const std::string & gindex, bool shm = false){
             index_.load(txindex);
             index_.build_splice_index(min_overhang);
-            txa_.load(txindex, min_overhang);
+            txa_.load(txindex, min_overhang, shm);
             AlignScore ascore;
             gna_.ascore = ascore;
             txa_.ascore = ascore;
-            gna_.load(gindex, min_overhang);
+            gna_.load(gindex, min_overhang, shm);
             txa_.set_gidx(&gna_);
             //index_.load(txindex, exonic_intergenic_ratio, true);
             //if(!gindex.empty()) index_.load_genome(gindex);
@@ -69,8 +70,37 @@ class MapBase {
             return btotal_;
         }
 
+        void set_genome_policy(GenomeAlignPolicy policy){
+            gpolicy_ = policy;
+        }
+
+        // Alignment tags beyond max_mem bytes are spilled to sorted runs in dir, 0 keeps them all in memory
+        void set_max_mem(size_t max_mem, const std::string & dir){
+            max_mem_ = max_mem;
+            spill_dir_ = dir;
+        }
+
+        void remove_runs(){
+            for(auto & r : runs) unlink(r.file.c_str());
+            runs.clear();
+        }
+
+        // Number of fastq pairs to read and decompress concurrently
+        void set_read_lanes(unsigned int lanes){
+            lanes_ = lanes;
+        }
+
+        // Only align barcodes with at least min_reads counted reads and within the top_n barcodes, 0 disables either
+        void set_cell_filter(unsigned int min_reads, unsigned int top_n, bool write_empty){
+            min_cell_reads_ = min_reads;
+            top_cells_ = top_n;
+            write_empty_ = write_empty;
+        }
+
         void load_barcode_counts(const std::string & barcodes, FastqPairs & fastqs){
             bc_.load(barcodes + "_counts.txt.gz");
+            // Written by scsnv count --correct-index, otherwise every mismatch is searched
+            bc_.load_correction(barcodes + "_correct.gz");
             btotal_ = T::LibraryBarcode::find_total_reads(barcodes, fastqs);
         }
 
@@ -81,11 +111,11 @@ class MapBase {
         }
 
         void prepare_bam(const std::string & prog_name, unsigned int bam_per_thread, unsigned int bam_per_file, 
-                const std::string & prefix, unsigned int threads);
+                const std::string & prefix, unsigned int threads, unsigned int spill_threads);
 
         void run(unsigned int num_threads, FastqPairs & fastqs, double dust, bool internal, size_t downsample, size_t seed);
         void write_output(const std::string & prefix);
-        void write_tags(const std::string & prefix, const std::vector<UMIMap> & correct, const std::vector<uint32_t> & bidx);
+        void write_tags(const std::string & prefix, const UMICorrectTable & correct);
 
         TXIndex & index() {
             return index_;
@@ -96,13 +126,18 @@ class MapBase {
         }
 
         AlignGroup::ResultCounts   counts;
-        std::vector<AlignSummary>  aligns;
+        AlignGroup::ResultCounts   avoided_counts;
+        size_t                     genome_aligned = 0;
+        size_t                     genome_avoided = 0;
+        AlignBuckets               aligns;
+        std::vector<AlignRun>      runs;
         std::map<AlignSummary::bint, AlignGroup::ResultCounts> brates;
         unsigned int               barcode_correct = 0;
         unsigned int               barcode_corrected = 0;
 
     private:
-        unsigned int read_(size_t N, Reads & reads, const AlignGroup::ResultCounts & counts);
+        unsigned int read_(size_t N, ReadBatch & reads, const AlignGroup::ResultCounts & counts);
+        void build_cells_();
 
         using lib_bc = typename T::LibraryBarcode;
 
@@ -114,6 +149,8 @@ class MapBase {
         GenomeAlign                gna_;
         std::mutex                 mtx_read_;
         std::string                bam_tmp_;
+        std::string                spill_dir_;
+        size_t                     max_mem_ = 0;
         double                     ds_ = 0.0;
         size_t                     start_;
         size_t                     total_ = 0;
@@ -122,6 +159,12 @@ class MapBase {
         size_t                     btotal_ = 0;
         int                        write_threads_ = 0;
         StrandMode                 smode_;
+        GenomeAlignPolicy          gpolicy_ = GENOME_ALWAYS;
+        unsigned int               lanes_ = 1;
+        unsigned int               min_cell_reads_ = 0;
+        unsigned int               top_cells_ = 0;
+        std::vector<bool>          cells_;
+        bool                       write_empty_ = false;
         bool                       bam_ = false;
         bool                       internal_ = false;
 };
@@ -132,7 +175,7 @@ inline void MapBase<T>::run(unsigned int num_threads, FastqPairs & fastqs, doubl
     internal_ = internal;
     start_ = tout.seconds();
     std::list<MapWorker> threads;
-    in_.set_files(fastqs);
+    in_.set_files(fastqs, false);
 
 
     if(downsample > 0){
@@ -147,15 +190,35 @@ inline void MapBase<T>::run(unsigned int num_threads, FastqPairs & fastqs, doubl
             << (1.0 * sizeof(AlignSummary) * btotal_ / (1024 * 1024 * 1024)) << " GB\n";
     }
 
+    size_t spill_limit = 0;
+    if(max_mem_ > 0){
+        spill_limit = std::max<size_t>(1, max_mem_ / sizeof(AlignSummary) / num_threads);
+        tout << "Spilling alignment tags beyond " << std::setprecision(2) << std::fixed 
+            << (1.0 * max_mem_ / (1024 * 1024 * 1024)) << " GB to " << spill_dir_ << "\n";
+    }
+
+    if(min_cell_reads_ > 0 || top_cells_ > 0) build_cells_();
+
+    in_.start(lanes_, READS_PER_STEP, 2 * num_threads);
+
     using namespace std::placeholders;
-    MapWorker::cb_correct correct_cb = std::bind(&lib_bc::correct, &bc_, _1, _2);
+    MapWorker::cb_correct correct_cb = std::bind(&lib_bc::correct_code, &bc_, _1, _2, _3);
     MapWorker::cb_read read_cb = std::bind(&MapBase<T>::read_, this, _1, _2, _3);
 
+    aligns.clear();
+    aligns.resize(ALIGN_BUCKETS);
     for(size_t i = 0; i < num_threads; i++){
-        threads.emplace_back(READS_PER_STEP, read_cb, correct_cb, smode_, dust);
+        threads.emplace_back(READS_PER_STEP, read_cb, correct_cb, smode_, dust, gpolicy_);
         threads.back().tx_align = &txa_;
         threads.back().genome_align = &gna_;
         threads.back().tx_idx = &index_;
+        threads.back().aligns.resize(ALIGN_BUCKETS);
+        threads.back().spill_limit = spill_limit;
+        threads.back().spill_prefix = spill_dir_ + "/scsnv_align_" + std::to_string(i);
+        if(!cells_.empty()){
+            threads.back().cells = &cells_;
+            threads.back().write_empty = write_empty_;
+        }
         if(bam_) {
             threads.back().bout = &bout_;
             threads.back().prepare_bam();
@@ -170,6 +233,7 @@ inline void MapBase<T>::run(unsigned int num_threads, FastqPairs & fastqs, doubl
     while(++it != threads.end()){
         it->join();
     }
+    in_.stop();
 
     it = threads.begin();
     size_t test = 0;
@@ -179,9 +243,19 @@ inline void MapBase<T>::run(unsigned int num_threads, FastqPairs & fastqs, doubl
         }
         barcode_corrected += it->barcode_corrected;
         barcode_correct += it->barcode_correct;
-        for(auto & g : it->aligns){
-            aligns.push_back(g);
+        genome_aligned += it->genome_aligned;
+        genome_avoided += it->genome_avoided;
+        for(size_t i = 0; i < avoided_counts.size(); i++) avoided_counts[i] += it->avoided_counts[i];
+        for(size_t b = 0; b < aligns.size(); b++){
+            auto & src = it->aligns[b];
+            if(aligns[b].empty()){
+                aligns[b].swap(src);
+            }else{
+                aligns[b].insert(aligns[b].end(), src.begin(), src.end());
+                std::vector<AlignSummary>().swap(src);
+            }
         }
+        runs.insert(runs.end(), it->runs.begin(), it->runs.end());
         for(auto & r : it->bc_rates){
             for(size_t i = 0; i < r.second.size(); i++) {
                 brates[r.first][i] += r.second[i];
@@ -190,11 +264,47 @@ inline void MapBase<T>::run(unsigned int num_threads, FastqPairs & fastqs, doubl
         }
         it = threads.erase(it);
     }
-    if(bam_) bout_.force_write();
-    tout << "Merged alignments size = " << aligns.size() << " Merged barcode rate size = " << brates.size() << " sum = " << test << "\n";
+    if(bam_) {
+        bout_.force_write();
+        tout << "Mapping threads waited " << std::setprecision(2) << std::fixed << bout_.spill_wait() << " sec on " 
+            << bout_.spill_stalls() << " bam spills and " << bout_.lock_wait() << " sec on the bam write lock\n";
+    }
+    size_t atotal = 0;
+    for(auto & b : aligns) atotal += b.size();
+    size_t spilled = 0;
+    for(auto & r : runs) spilled += r.offsets.back();
+    if(!runs.empty()){
+        tout << "Spilled " << spilled << " alignment tags in " << runs.size() << " sorted runs\n";
+    }
+    tout << "Merged alignments size = " << atotal << " in " << aligns.size() << " barcode buckets, Merged barcode rate size = " << brates.size() << " sum = " << test << "\n";
     tout << "Wrote " << bout_.total_reads() << " sorted alignments across " << bout_.total_files() << " bam files\n";
-    tout << "Sorting the alignment tags\n";
-    std::sort(aligns.begin(), aligns.end());
+}
+
+template <typename T>
+inline void MapBase<T>::build_cells_() {
+    // Barcodes tied with the last of the top N are kept too
+    unsigned int min_reads = std::max(1U, min_cell_reads_);
+    if(top_cells_ > 0 && top_cells_ < bc_.size()){
+        std::vector<unsigned int> counts(bc_.size());
+        for(size_t i = 0; i < bc_.size(); i++) counts[i] = bc_.barcode_count(i);
+        std::nth_element(counts.begin(), counts.begin() + (top_cells_ - 1), counts.end(), std::greater<unsigned int>());
+        min_reads = std::max(min_reads, counts[top_cells_ - 1]);
+    }
+    cells_.assign(bc_.size(), false);
+    size_t kept = 0;
+    uint64_t kept_reads = 0, total_reads = 0;
+    for(size_t i = 0; i < bc_.size(); i++){
+        unsigned int c = bc_.barcode_count(i);
+        total_reads += c;
+        if(c >= min_reads){
+            cells_[i] = true;
+            kept++;
+            kept_reads += c;
+        }
+    }
+    tout << "Aligning reads from " << kept << " barcodes with at least " << min_reads << " reads ["
+         << std::fixed << std::setprecision(2) << (total_reads > 0 ? 100.0 * kept_reads / total_reads : 0.0) 
+         << "% of the barcode matched reads], the rest are counted as empty droplets\n";
 }
 
 template <typename T>
@@ -227,6 +337,31 @@ inline void MapBase<T>::write_output(const std::string & prefix) {
         out << "barcodes_corrected" 
             << "\t" << barcode_corrected << "\t" 
             << std::fixed << std::setprecision(2) << 100.0 * barcode_corrected / total_ << "%\n";
+
+        if(gpolicy_ != GENOME_ALWAYS){
+            size_t attempted = genome_aligned + genome_avoided;
+            double pavoided = attempted > 0 ? 100.0 * genome_avoided / attempted : 0.0;
+            std::cout << std::setfill(' ') << std::setw(35) << std::left <<
+                "Genome Alignments Avoided" << std::right
+                << "\t" << std::setfill(' ') << std::setw(9) << genome_avoided << "\t" 
+                << std::fixed << std::setprecision(2) << std::setw(6) << pavoided << "%\n";
+            out << "genome_aligned\t" << genome_aligned << "\t" 
+                << std::fixed << std::setprecision(2) << (attempted > 0 ? 100.0 - pavoided : 0.0) << "%\n";
+            out << "genome_avoided\t" << genome_avoided << "\t" 
+                << std::fixed << std::setprecision(2) << pavoided << "%\n";
+            // Classification of the reads that were only aligned to the transcriptome
+            for(size_t i = 0; i < AlignGroup::ELEM_COUNT; i++){
+                if(avoided_counts[i] == 0) continue;
+                double p = 100.0 * avoided_counts[i] / std::max<size_t>(1, genome_avoided);
+                std::cout << std::setfill(' ') << std::setw(35) << std::left <<
+                    ("  Avoided " + std::string(AlignGroup::alignres2str(static_cast<AlignGroup::Result>(i), true))) << std::right
+                    << "\t" << std::setfill(' ') << std::setw(9) << avoided_counts[i] << "\t" 
+                    << std::fixed << std::setprecision(2) << std::setw(6) << p << "%\n";
+                out << "genome_avoided_" << AlignGroup::alignres2str(static_cast<AlignGroup::Result>(i), false)
+                    << "\t" << avoided_counts[i] << "\t" 
+                    << std::fixed << std::setprecision(2) << p << "%\n";
+            }
+        }
     }
 
     /*
@@ -250,68 +385,35 @@ inline void MapBase<T>::write_output(const std::string & prefix) {
     */
 }
 template <typename T>
-inline void MapBase<T>::write_tags(const std::string & prefix, const std::vector<UMIMap> & correct, const std::vector<uint32_t> & bidx) {
+inline void MapBase<T>::write_tags(const std::string & prefix, const UMICorrectTable & correct) {
     gzFile zout = gzopen((prefix + "_tags.gz").c_str(), "wb");
     gzFile zout2 = gzopen((prefix + "_tags_idx.gz").c_str(), "wb");
 
-    tout << "Correcting the tag data\n";
-    //std::ofstream os(prefix + "_test.txt");
-    std::vector<bool> ccheck(correct.size());
-    auto rit = correct.begin() + bidx[0];
-    auto rend = correct.begin() + bidx[1];
-    auto bstart = aligns.begin();
-    bool corrected = false;
-    for(auto it = aligns.begin(); it != aligns.end(); it++){
-        if(bstart->barcode != it->barcode){
-            if(corrected){
-                std::sort(bstart, it,
-                    [&](const AlignSummary & m1, AlignSummary & m2) { 
-                    return 
-                        std::tie(m1.gene_id, m1.umi) < 
-                        std::tie(m2.gene_id, m2.umi);
-                    }
-                );
-            }
-
-            rit = correct.begin() + bidx[it->barcode];
-            rend = correct.begin() + bidx[it->barcode + 1];
-            bstart = it;
-            corrected = false;
-        }
-
-        while(rit != rend && std::tie(rit->gene_id, rit->umi_from) < std::tie(it->gene_id, it->umi)){
-            rit++;
-        }
-        if(rit != rend && rit->gene_id == it->gene_id && rit->umi_from == it->umi){
-            size_t ridx = std::distance(correct.begin(), rit);
-            ccheck[ridx] = true;
-            corrected = true;
-            it->umi = rit->umi_to;
-        }
-    }
-    size_t missing = 0;
-    for(auto c : ccheck){
-        if(!c){
-            missing++;
-        }
-    }
-
-    if(missing > 0)
-        std::cout << "Missed " << missing << " out of " << correct.size() << " UMI corrections\n";
-    tout << "Writing the tag data\n";
-    AlignSummary::bint lbarcode = std::numeric_limits<AlignSummary::bint>::max();
-
+    tout << "Correcting and writing the tag data\n";
+    AlignSummary::bint lbarcode;
     size_t i = 0;
-    for(auto & a : aligns){
-        if(a.barcode != lbarcode){
-            lbarcode = a.barcode;
+    std::vector<AlignSummary> tags;
+    AlignBucketMerger merger;
+    for(size_t b = 0; b < aligns.size(); b++){
+        std::sort(aligns[b].begin(), aligns[b].end());
+        merger.open(aligns[b], runs, b);
+        while(merger.next(tags)){
+            for(auto & a : tags){
+                size_t slot = correct.find(a.barcode, a.gene_id, a.umi);
+                if(slot != UMICorrectTable::npos && correct.corrected(slot)){
+                    a.umi = correct.umi_to(slot);
+                }
+            }
+            std::sort(tags.begin(), tags.end());
+            lbarcode = tags.front().barcode;
             gzwrite(zout2, reinterpret_cast<char*>(&lbarcode), sizeof(lbarcode));
             gzwrite(zout2, reinterpret_cast<char*>(&i), sizeof(i));
+            for(auto & a : tags){
+                AlignTagOut tag(a.barcode, a.gene_id, a.umi, a.intronic);
+                gzwrite(zout, reinterpret_cast<char*>(&tag), sizeof(AlignTagOut));
+                i++;
+            }
         }
-
-        AlignTagOut tag(a.barcode, a.gene_id, a.umi, a.intronic);
-        gzwrite(zout, reinterpret_cast<char*>(&tag), sizeof(AlignTagOut));
-        i++;
     }
     lbarcode = std::numeric_limits<AlignSummary::bint>::max();
     gzwrite(zout2, reinterpret_cast<char*>(&lbarcode), sizeof(lbarcode));
@@ -321,8 +423,11 @@ inline void MapBase<T>::write_tags(const std::string & prefix, const std::vector
 }
 
 template <typename T>
-unsigned int MapBase<T>::read_(size_t N, Reads & reads, const AlignGroup::ResultCounts & rcounts) {
+unsigned int MapBase<T>::read_(size_t, ReadBatch & reads, const AlignGroup::ResultCounts & rcounts) {
+    // The batch queue has its own lock so waiting on it does not block progress reporting
+    auto read = in_.next_batch(reads);
     std::lock_guard<std::mutex> lock(mtx_read_);
+    rtotal_ += read;
     // Update alignment counts
     for(size_t i = 0; i < rcounts.size(); i++) {
         counts[i] += rcounts[i];
@@ -363,14 +468,12 @@ unsigned int MapBase<T>::read_(size_t N, Reads & reads, const AlignGroup::Result
         ltotal_ = total_;
     }
     //if(total_ >= 100000) return 0;
-    auto read = in_.read_N(N, reads);
-    rtotal_ += read;
     return read;
 }
 
 template <typename T>
 void MapBase<T>::prepare_bam(const std::string & prog_name, unsigned int bam_per_thread, unsigned int bam_per_file, 
-        const std::string & prefix, unsigned int threads)
+        const std::string & prefix, unsigned int threads, unsigned int spill_threads)
 {
     tout << "Preparing bam header for " << index_.refs().size() << " references\n";
     bam_tmp_ = prefix;
@@ -383,7 +486,7 @@ void MapBase<T>::prepare_bam(const std::string & prog_name, unsigned int bam_per
     std::stringstream lines;
     lines << "@HD\tSO:coordinate\n@PG\tID:scsnv\tCL:" << prog_name << "\tVN:1.0\n";
     bh.set_text(lines.str());
-    bout_.set_thread_buffer(bam_per_file, bam_per_thread);
+    bout_.set_thread_buffer(bam_per_file, bam_per_thread, spill_threads);
     bout_.set_prefix(prefix);
     if(threads > 1) bout_.make_pool(threads);
     write_threads_ = threads;
@@ -31,6 +31,7 @@ SOFTWARE.
 #include "dust.hpp"
 #include "transcript_align.hpp"
 #include "genome_align.hpp"
+#include "align_spill.hpp"
 #include "reader.hpp"
 #include <exception>
 #include <fstream>
@@ -46,14 +47,21 @@ class MapWorker {
     MapWorker& operator=(const MapWorker&) = delete;
 
     public:
-        using cb_read = std::function<unsigned int(size_t, Reads &, const AlignGroup::ResultCounts &s)>;
-        using cb_correct = std::function<int(std::string &, AlignSummary::bint &)>;
-
-        MapWorker(unsigned int reads_per_step, cb_read in, cb_correct bc, StrandMode smode, double max_dust) 
-            : counts{}, in_(in), bc_(bc), max_dust_(max_dust), rps_(reads_per_step), smode_(smode) {
+        using cb_read = std::function<unsigned int(size_t, ReadBatch &, const AlignGroup::ResultCounts &s)>;
+        using cb_correct = std::function<int(uint64_t &, unsigned int, AlignSummary::bint &)>;
+
+        MapWorker(unsigned int reads_per_step, cb_read in, cb_correct bc, StrandMode smode, double max_dust, 
+                GenomeAlignPolicy gpolicy = GENOME_ALWAYS) 
+            : counts{}, avoided_counts{}, batch(reads_per_step), in_(in), bc_(bc), max_dust_(max_dust), rps_(reads_per_step), 
+              smode_(smode), gpolicy_(gpolicy) {
+            abuf_ = mem_buf_init();
+            pending_.resize(rps_);
+            genome_.resize(rps_);
         }
 
         ~MapWorker(){
+            mem_buf_destroy(abuf_);
+            abuf_ = nullptr;
             for(auto a : buff){
                 bam_destroy1(a);
             }
@@ -78,32 +86,50 @@ class MapWorker {
         void operator()();
 
         phmap::flat_hash_map<AlignSummary::bint, AlignGroup::ResultCounts> bc_rates;
-        std::vector<AlignSummary>                                aligns;
+        AlignBuckets                                             aligns;
         AlignGroup::ResultCounts                                 counts;
+        AlignGroup::ResultCounts                                 avoided_counts; // Results of reads that skipped the genome
         SortedBamWriter::read_buffer                             buff;
-        AlignGroup                                               data;
+        std::vector<AlignGroup>                                  batch;
 
         // Could probably make these private but whatever
         SortedBamWriter                                        * bout = nullptr;
         const TranscriptAlign                                  * tx_align = nullptr;
         const GenomeAlign                                      * genome_align = nullptr;
         const TXIndex                                          * tx_idx = nullptr;
+        // Barcodes that are aligned, the rest are counted as empty droplets. nullptr aligns every barcode
+        const std::vector<bool>                                * cells = nullptr;
+        bool                                                     write_empty = false;
+        // Spill the alignment tags to sorted runs on disk once this many are held, 0 keeps them all in memory
+        size_t                                                   spill_limit = 0;
+        std::string                                              spill_prefix;
+        std::vector<AlignRun>                                    runs;
 
         unsigned int                                             barcode_correct = 0;
         unsigned int                                             barcode_corrected = 0;
         unsigned int                                             rcount = 0;
+        size_t                                                   genome_aligned = 0;
+        size_t                                                   genome_avoided = 0;
 
     private:
-        void map_(Read & read);
+        // Barcode, UMI and tag checks, returns true if the read should be aligned
+        bool prepare_(size_t i, AlignGroup & data);
+        void classify_(size_t i, AlignGroup & data);
+        void spill_();
         std::thread                      thread_;
+        std::vector<bool>                pending_;
+        std::vector<bool>                genome_;
+        mem_buf_t                      * abuf_ = nullptr;
         Dust                             dust_;
-        Reads                            reads_;
+        ReadBatch                        reads_;
         cb_read                          in_;
         cb_correct                       bc_;
         std::string                      bprefix_;
         double                           max_dust_;
         unsigned int                     rps_;
         StrandMode                       smode_;
+        GenomeAlignPolicy                gpolicy_;
+        size_t                           held_ = 0;
         bool                             write_bam_ = false;
 };
 
@@ -25,6 +25,8 @@ SOFTWARE.
 #include "index.hpp"
 #include "tokenizer.hpp"
 #include "fasta.hpp"
+#include "genome_store.hpp"
+#include "base_track.hpp"
 #include "pileup_aux.hpp"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
 #include <exception>
@@ -58,7 +60,8 @@ class ProgAccuracy : public ProgBase {
         std::string              bam_;
         std::string              aligners_;
         std::vector<std::string> barcodes_;
-        Fastas                   genome_;
+        GenomeStore              genome_;
+        BaseTrack                btrack_;
         unsigned int             threads_;
         unsigned int             window_;
 };
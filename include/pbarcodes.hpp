@@ -29,6 +29,10 @@ SOFTWARE.
 #include <fstream>
 #include <iomanip>
 #include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <list>
+#include <functional>
 
 namespace gwsc{
 
@@ -43,60 +47,67 @@ class ProgBarcodes : public ProgBase {
         template <typename R> 
         int run_10X_();
 
+        template <typename R> 
+        void count_files_(const typename R::LibraryBarcode & bcs, std::vector<typename R::LibraryBarcode::CountSummary> & totals,
+                std::atomic<size_t> & next, phmap::flat_hash_map<AlignSummary::bint, unsigned int> & local);
+
         std::string              known_;
         std::string              out_;
         std::string              lib_type_;
         std::vector<std::string> dirs_;
         FastqPairs               fastqs_;
+        unsigned int             threads_ = 1;
+        bool                     correct_index_ = false;
 };
 
+template <typename R> 
+void ProgBarcodes::count_files_(const typename R::LibraryBarcode & bcs, std::vector<typename R::LibraryBarcode::CountSummary> & totals,
+        std::atomic<size_t> & next, phmap::flat_hash_map<AlignSummary::bint, unsigned int> & local) {
+    std::string bc, bq;
+    size_t idx = 0;
+    while((idx = next++) < fastqs_.size()){
+        auto & f = fastqs_[idx];
+        R in;
+        // Inflate on a separate thread so parsing and decompression overlap
+        in.set_async(threads_ > 1);
+        in.open(f.first, f.second);
+        auto & cc = totals[idx];
+        tout << "Counting barcodes for " << f.first << "\n";
+        while(in.read_barcode(bc, bq)){
+            bcs.count(bc, cc, local);
+            if(cc.total % 10000000 == 0){
+                tout << "Processed " << cc.total << " reads and " << (100.0 * cc.correct / cc.total) << "% matched known barcodes in " << f.first << "\n";
+            }
+        }
+    }
+}
+
 template <typename R> 
 int ProgBarcodes::run_10X_() {
     typename R::LibraryBarcode bcs;
     if(known_.empty()) return EXIT_FAILURE;
     bcs.load(known_);
-    std::string bc, bq;
-    size_t idx = 0;
-    std::vector<typename R::LibraryBarcode::CountSummary> totals;
     for(auto & d : dirs_){
         tout << "Processing read directory " << d << "\n";
         auto fastqs = find_fastq_files(d);
-        totals.resize(totals.size() + fastqs.size());
-        //std::string bout = d + "_barcode_counts.txt.gz";
-        //std::string sout = d + "_barcode_totals.txt";
         fastqs_.insert(fastqs_.end(), fastqs.begin(), fastqs.end());
-        /*
-        //struct stat sb1 = {}, sb2 = {};   
-        if(stat(bout.c_str(), &sb1) == 0 && stat(sout.c_str(), &sb2) == 0){
-            R::LibraryBarcode::parse_summary(sout, fastqs, totals, idx);
-            bcs.merge(bout);
-            idx += fastqs.size();
-        }else{
-        */
-        //std::ofstream out(sout);
-        //out << "dir\tfile";
-        //bcs.write_header(out);
-        //out << "\n";
-        //bcd.copy(bcs);
-        for(auto & f : fastqs){
-            R in;
-            in.open(f.first, f.second);
-            auto & cc = totals[idx];
-            tout << "Counting barcodes for " << f.first << "\n";
-            tout.flush();
-            while(in.read_barcode(bc, bq)){
-                bcs.count(bc, cc);
-                if(cc.total % 10000000 == 0){
-                    tout << "Processed " << cc.total << " reads and " << (100.0 * cc.correct / cc.total) << "% matched known barcodes\n";
-                }
-            }
-            //out << f.dir << "\t" << f.prefix;
-            //cc.to_tab(out);
-            //out << "\n";
-            idx++;
-        }
-        //bcd.write(bout);
     }
+
+    // Each thread takes the next file and tallies into its own counter, merged once every file is done
+    std::vector<typename R::LibraryBarcode::CountSummary> totals(fastqs_.size());
+    std::vector<phmap::flat_hash_map<AlignSummary::bint, unsigned int>> locals(threads_);
+    std::atomic<size_t> next{0};
+    std::list<std::thread> threads;
+    for(unsigned int t = 0; t < threads_; t++){
+        threads.emplace_back(&ProgBarcodes::count_files_<R>, this, std::cref(bcs), std::ref(totals), std::ref(next), std::ref(locals[t]));
+    }
+    for(auto & t : threads){
+        t.join();
+    }
+    for(auto const & l : locals){
+        bcs.add_counts(l);
+    }
+
     auto total = typename R::LibraryBarcode::CountSummary(); 
     for(auto const & t : totals){
         total += t;
@@ -119,6 +130,10 @@ int ProgBarcodes::run_10X_() {
     }
 
     bcs.write(out_ + "_counts.txt.gz");
+    if(correct_index_){
+        bcs.build_correction();
+        bcs.write_correction(out_ + "_correct.gz");
+    }
     return EXIT_SUCCESS;
 }
 
@@ -21,6 +21,7 @@ SOFTWARE.
 #include <exception>
 #include "bam_genes.hpp"
 #include "fasta.hpp"
+#include "genome_store.hpp"
 
 namespace gwsc{
 
@@ -33,7 +34,7 @@ class ProgCollapse : public ProgBase {
                 { "txidx", {"-i", "--index"},
                   "Transcript Index", 1},
                 { "reference", {"-r", "--ref"},
-                  "Reference Genome File", 1},
+                  "Reference genome FASTA or the _genome.bin from scsnv index (Default <index>_genome.bin)", 1},
                 { "out", {"-o", "--output"},
                   "Output file prefix, ie. sample/merged", 1},
                 { "barcodes", {"-b", "--barcodes"},
@@ -51,7 +52,7 @@ class ProgCollapse : public ProgBase {
         }
 
         std::string usage() const {
-            return "scsnv collapse -r <genome.fa> -i <transcript index prefix> -o <out prefix> -b <barcodes> <tmp bam prefix> <tmp bam prefix 2> ... <tmp bam prefix N>";
+            return "scsnv collapse [-r <genome.fa>] -i <transcript index prefix> -o <out prefix> -b <barcodes> <tmp bam prefix> <tmp bam prefix 2> ... <tmp bam prefix N>";
         }
 
         void load();
@@ -63,7 +64,7 @@ class ProgCollapse : public ProgBase {
         int run_wrap_();
 
         std::string      bam_file_;
-        Fastas           genome_;
+        GenomeStore      genome_;
 
         std::string      index_;
         std::string      umi_map_;
@@ -61,39 +61,16 @@ struct PileupRead {
      *     splitting
      * 2) Since so many neighboring bases have the same values, I did a
      *     rudimentary read-length-encoding where I store {value, # times repeated}.
-     *     Could do gzip, it's all small number of elements. So here, given a target
-     *     `qpos`, I iterate through to find the result. Could destructure once and
-     *     just do a vector look up, dunno. Could also do a gzip decompression
+     * qpos only moves forward while the cigar is walked, so the runs are consumed
+     * with a cursor set up in init instead of decoding the tag at every position.
      */
-
-    //TODO don't read in the bam every time, store the umi_coverage_tmp
-    uint32_t make_umi_coverage() const {
-      unsigned int CC_len = bam_auxB_len(bam_aux_get(d->b, "CC"));
-      std::vector<uint32_t> umi_coverage_tmp;
-      for(unsigned int CC_i=0; CC_i < CC_len; CC_i++){
-        umi_coverage_tmp.push_back(
-                                   bam_auxB2i(bam_aux_get(d->b, "CC"),
-                                              CC_i));
-      }
-
-      //B/c of read length encoding, should always come in pairs 
-      if((CC_len % 2) != 0){
-            __asm__("int $3");
-      }
-
-      auto umi_coverage_it = umi_coverage_tmp.begin();
-      unsigned int currentI = 0;
-      uint32_t  currentCovg = 0;
-
-      //Really should start currentI at -1, and then add 1 in the first round to
-      //get to 0. But b/c of wanting an unsigned int so no casting, start at 0
-      //and then need qpos to be +1.
-      while(currentI < (qpos+1)){
-        currentCovg = *(umi_coverage_it++);
-        currentI   += *(umi_coverage_it++);
-      }
-
-      return currentCovg;
+    uint32_t umi_coverage() {
+        while(cc_end <= qpos && cc_idx < cc_len){
+            cc_value = bam_auxB2i(cc, cc_idx);
+            cc_end += bam_auxB2i(cc, cc_idx + 1);
+            cc_idx += 2;
+        }
+        return cc_value;
     }
 
     int tid() const {
@@ -119,6 +96,14 @@ struct PileupRead {
     unsigned int                  NM;
     unsigned int                  qdist;
     char                          strand;
+    // Dense barcode slot assigned by the caller for the current range
+    uint32_t                      slot = 0;
+    // CC run cursor
+    uint8_t                     * cc;
+    uint32_t                      cc_len;
+    uint32_t                      cc_idx;
+    uint32_t                      cc_end;
+    uint32_t                      cc_value;
 };
 
 struct PileupOut{
@@ -131,7 +116,7 @@ struct PileupOut{
             d(r.d), rpos(r.rpos), qpos(r.qpos), qdist(r.qdist),
             base(r.base()), qual(r.qual()), ibases(r.ibases), 
             dbases(r.dbases), abases(r.abases), NM(r.NM), rev(r.strand == '-'),
-            umi_coverage(r.make_umi_coverage())
+            umi_coverage(r.umi_coverage()), slot(r.slot)
     {
 
     }
@@ -148,6 +133,7 @@ struct PileupOut{
     unsigned int      NM;
     bool              rev;
     uint32_t          umi_coverage;
+    uint32_t          slot;
 };
 
 //template <typename T>
@@ -167,7 +153,7 @@ class Pileup {
             reads_.clear();
         }
 
-        void build_reads(BamBuffer::rpair range);
+        void build_reads(BamBuffer::rpair range, const std::vector<uint32_t> * slots = nullptr);
         bool next(std::vector<PileupOut> & out);
 
         int                tid = -1;
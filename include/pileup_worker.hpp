@@ -24,6 +24,8 @@ SOFTWARE.
 #include "bam_genes.hpp"
 #include "pileup.hpp"
 #include "fasta.hpp"
+#include "genome_store.hpp"
+#include "base_track.hpp"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
 #include "pileup_aux.hpp"
 #include <thread>
@@ -34,24 +36,13 @@ class PileupWorker {
     PileupWorker( const PileupWorker& ) = delete;
     PileupWorker& operator=(const PileupWorker&) = delete;
 
-    enum SBaseType {
-        PINTRON=1,
-        PEXON=2,
-        PNC=4,
-        P5UTR=8,
-        P3UTR=16,
-        MINTRON=32,
-        MEXON=64,
-        MNC=128,
-        M5UTR=256,
-        M3UTR=512
-    };
+    using SBaseType = BaseTrack::SBaseType;
 
     public:
-        PileupWorker(size_t NB, const TXIndex & txidx, const Fastas & genome, bool use_dups) 
+        PileupWorker(size_t NB, const TXIndex & txidx, const GenomeStore & genome, const BaseTrack & btrack, bool use_dups) 
             : 
             bcoverage(NB), bbases(NB), pup_(use_dups), slocs_(txidx), txidx_(txidx), 
-            genome_(genome) 
+            genome_(genome), btrack_(btrack) 
         {
         }
 
@@ -79,6 +70,15 @@ class PileupWorker {
             targets_.rewind(tid, pos);
         }
 
+        // Only positions within [lft, rgt] of tid are kept until the next window is set
+        void set_window(int32_t tid, uint32_t lft, uint32_t rgt){
+            targets_.rewind(tid, lft);
+            wtid_ = tid;
+            wlft_ = lft;
+            wrgt_ = rgt;
+            windowed_ = true;
+        }
+
         void set_debug(bool debug){
             debug_ = debug;
         }
@@ -120,29 +120,37 @@ class PileupWorker {
     private:
 
         void count_barcodes_(PositionCount & p);
-
-        unsigned int build_genes_();
+        void reset_slots_();
 
         std::thread                                                   thread_;
         std::vector<size_t>                                           sidx_;
         Pileup                                                        pup_;
-        std::vector<uint16_t>                                         btypes_;
         TargetFinder                                                  targets_;
         SpliceLocations                                               slocs_;
 
         const TXIndex                                               & txidx_;
-        const Fastas                                                & genome_;
+        const GenomeStore                                           & genome_;
+        const BaseTrack                                             & btrack_;
         BamBuffer                                                   * buffer_;
         std::vector<PileupOut>                                        out_;
-        std::vector<uint32_t>                                         gids_;
         std::string                                                   tmp_;
-        phmap::flat_hash_map<uint32_t, std::array<uint16_t, 8>>       bcounter_;
+        // Barcodes in a range get a dense slot once so each position only touches a flat array
+        phmap::flat_hash_map<uint32_t, uint32_t>                      slot_map_;
+        std::vector<uint32_t>                                         rslots_;
+        std::vector<uint32_t>                                         sbarcodes_;
+        std::vector<std::array<uint16_t, 8>>                          scounts_;
+        std::vector<uint8_t>                                          sused_;
+        std::vector<uint32_t>                                         touched_;
 
         unsigned int                                                  min_alternative_ = 10;
         unsigned int                                                  min_qual_ = 20;
         unsigned int                                                  min_barcodes_ = 15;
         double                                                        min_af_ = 0.01;
         unsigned int                                                  min_edge_ = 5;
+        int32_t                                                       wtid_ = -1;
+        uint32_t                                                      wlft_ = 0;
+        uint32_t                                                      wrgt_ = 0;
+        bool                                                          windowed_ = false;
         bool                                                          tloaded_ = false;
         bool                                                          debug_ = false;
 };
@@ -24,10 +24,18 @@ SOFTWARE.
 #include "pbase.hpp"
 #include "index.hpp"
 #include "reader.hpp"
+#include "htslib/htslib/bgzf.h"
 #include <exception>
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 namespace gwsc{
 
+struct MergeShared;
+struct BamData;
+class UMICorrectTable;
+
 class ProgMap : public ProgBase {
     public:
         argagg::parser parser() const;
@@ -40,6 +48,11 @@ class ProgMap : public ProgBase {
         int run_wrap_();
 
         void write_progress_();
+        // Merge thread, takes genome chunks from ms until none are left
+        void merge_chunks_(MergeShared & ms);
+        // Merges and UMI corrects the temporary bam files into {out_prefix}merged.bam
+        int merge_bams_(const UMICorrectTable & table, unsigned int umi_len);
+        void write_reads_(BGZF * out, std::vector<BamData*> & reads, size_t n);
 
         std::string              tx_idx_;
         std::string              genome_idx_;
@@ -52,19 +65,29 @@ class ProgMap : public ProgBase {
         FastqPairs               fastqs_;
         TXIndex                  txi_;
         double                   dust_;
-        size_t                   written_ = 0;
+        std::atomic<size_t>      written_{0};
+        std::mutex               mtx_progress_;
         size_t                   lwritten_ = 0;
         size_t                   total_ = 0;
         size_t                   start_ = 0;
         size_t                   downsample_ = 0;
         size_t                   seed_ = 0;
+        size_t                   max_mem_ = 0;
         unsigned int             threads_;
         unsigned int             qthreads_;
         unsigned int             min_overhang_;
         unsigned int             bam_per_thread_;
         unsigned int             bam_per_file_;
         unsigned int             bam_write_threads_;
+        unsigned int             bam_spill_threads_;
+        unsigned int             read_lanes_ = 1;
+        unsigned int             min_cell_reads_ = 0;
+        unsigned int             top_cells_ = 0;
         bool                     bam_;
+        bool                     write_empty_ = false;
+        bool                     merge_only_ = false;
+        bool                     shm_ = false;
+        GenomeAlignPolicy        gpolicy_ = GENOME_ALWAYS;
         //bool                     write_tags_;
         bool                     internal_ = false;
 };
@@ -26,7 +26,10 @@ SOFTWARE.
 #include "bam_genes.hpp"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
 #include "fasta.hpp"
+#include "genome_store.hpp"
+#include "base_track.hpp"
 #include "pileup_worker.hpp"
+#include "gzstream.hpp"
 
 namespace gwsc{
 
@@ -42,7 +45,7 @@ class ProgPileup : public ProgBase {
                 { "txidx", {"-i", "--index"},
                   "Transcript Index", 1},
                 { "reference", {"-r", "--ref"},
-                  "Reference Genome File", 1},
+                  "Reference genome FASTA or the _genome.bin from scsnv index (Default <index>_genome.bin)", 1},
                 { "out", {"-o", "--output"},
                   "Output file prefix, ie. mutations.txt", 1},
                 { "threads", {"-t", "--threads"},
@@ -51,6 +54,8 @@ class ProgPileup : public ProgBase {
                   "Number of reader threads (Default 1)", 1},
                 { "snvlist", {"-s", "--snvs"},
                 "Only quantify this list of tab separated SNVs (including reference only bases) with a header chorm, pos (zero based), REF, ALT", 1},
+                { "target_window", {"--target-window"},
+                  "Bases around the SNV list targets to pileup, targets within twice this distance share one indexed bam query (Default 100)", 1},
                 { "passed", {"-p", "--passed"},
                  "Only process reads from the barcodes in this file", 1},
                 { "dups", {"-d", "--dups"},
@@ -71,12 +76,20 @@ class ProgPileup : public ProgBase {
                   "Number of genes to read for paralell processing. Larger values use more memory (Default 500)", 1},
                 { "library", {"-l", "--library"},
                   "libary type (V2)", 1},
+                { "h5_level", {"--h5-level"},
+                  "Deflate level of the HDF5 datasets, 0 disables compression (Default 6)", 1},
+                { "h5_chunk", {"--h5-chunk"},
+                  "Elements per HDF5 dataset chunk (Default 65536)", 1},
+                { "h5_shuffle", {"--h5-shuffle"},
+                  "Byte shuffle the HDF5 chunks before compressing them", 0},
+                { "umi_text", {"--umi-text"},
+                  "Also write the per position UMI coverage as text to <output>_umi_coverage.txt.gz", 0},
               }};
             return argparser;
         }
 
         std::string usage() const {
-            return "scsnv pileup -i <transcript index prefix> -r <genome.fa> -b <barcode_counts.txt.gz> -o <output> in.bam";
+            return "scsnv pileup -i <transcript index prefix> [-r <genome.fa>] -b <barcode_counts.txt.gz> -o <output> in.bam";
         }
 
         void load();
@@ -85,19 +98,13 @@ class ProgPileup : public ProgBase {
 
     private:
 
-        std::vector<uint32_t>    tids_;
-        std::vector<uint32_t>    pos_;
-        std::vector<uint8_t>     refs_;
         //std::vector<BarcodeRate> barcode_rates_;
-        struct BBout{
-            std::vector<uint32_t> barcodes;
-            std::vector<uint32_t> snps;
-            std::vector<uint16_t> plus;
-            std::vector<uint16_t> minus;
-        };
-
-
-        void write_h5f_(const std::string & out, std::vector<BBout> & bouts);
+        // Barcode matrices, coverage datasets and UMI coverage lines appended as each batch finishes
+        struct PileupOutput;
+        void write_batch_(PileupOutput & out, const std::vector<PositionCount*> & buffer, std::vector<PositionCoverage> & coverage);
+        void write_header_(gzofstream & os);
+        const PositionCount * write_workers_(const std::vector<PileupWorker*> & threads, PileupOutput & out, gzofstream & os);
+        void write_barcodes_(const std::vector<PileupWorker*> & threads, const std::vector<unsigned int> & barcode_molecules);
 
         void read_passed_();
         void parse_targets_();
@@ -105,6 +112,10 @@ class ProgPileup : public ProgBase {
         template <typename T, typename P>
         int run_wrap_();
 
+        // Seeks to each cluster of SNV list targets with the bam index instead of streaming the whole bam
+        template <typename T, typename P>
+        int run_targets_(const TXIndex & index);
+
         unsigned int filter_func(const std::string & barcode, unsigned int fno){
             (void)fno;
             auto it = bchash_.find(barcode);
@@ -114,9 +125,9 @@ class ProgPileup : public ProgBase {
             return std::numeric_limits<unsigned int>::max();
         }
 
-        Fastas                        genome_;
+        GenomeStore                   genome_;
+        BaseTrack                     btrack_;
         std::string                   bam_file_;
-        std::vector<PositionCoverage> coverage_;
         std::vector<std::string>      barcodes_;
         BarcodeHash                   bchash_;
         std::vector<std::string>      bmap_;
@@ -137,12 +148,14 @@ class ProgPileup : public ProgBase {
         unsigned int min_edge_ = 5;
         unsigned int splice_win_ = 10;
         unsigned int read_genes_ = 500;
+        unsigned int target_window_ = 100;
         double       min_af_ = 0.01;
 
         unsigned int     threads_ = 1;
         unsigned int     rthreads_ = 1;
         bool             dups_ = false;
         bool             cellranger_ = false;
+        bool             umi_text_ = false;
 
 };
 }
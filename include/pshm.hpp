@@ -0,0 +1,117 @@
+#pragma once
+/*
+Copyright (c) 2018-2020 Gavin W. Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "pbase.hpp"
+#include "task_log.hpp"
+#include "bwa.h"
+#include <exception>
+
+namespace gwsc{
+
+// Stage BWA indexes in POSIX shared memory so concurrent map jobs on a host share one copy
+class ProgShm : public ProgBase {
+    public:
+        argagg::parser parser() const {
+            argagg::parser argparser {{
+                { "txidx", {"-i", "--index"},
+                  "Transcript Index prefix to stage", 1},
+                { "genome", {"-g", "--genome"},
+                  "Genome BWA mem index to stage", 1},
+                { "tmp", {"-f", "--tmp-file"},
+                  "Temporary file used to reduce peak memory while staging", 1},
+                { "help", {"-h", "--help"},
+                  "shows this help message", 0},
+              }};
+            return argparser;
+        }
+
+        std::string usage() const {
+            return "scsnv shm load -i <transcript index prefix> -g <genome bwa index>\n"
+                   "scsnv shm list\n"
+                   "scsnv shm drop";
+        }
+
+        void load() {
+            if(args_.pos.size() != 1){
+                throw std::runtime_error("Expected one of load, list or drop");
+            }
+            cmd_ = args_.as<std::string>(0);
+            tx_idx_ = args_["txidx"].as<std::string>("");
+            genome_idx_ = args_["genome"].as<std::string>("");
+            tmp_ = args_["tmp"].as<std::string>("");
+            if(cmd_ == "load"){
+                if(tx_idx_.empty() && genome_idx_.empty()){
+                    throw std::runtime_error("load requires -i and/or -g");
+                }
+            }else if(cmd_ != "list" && cmd_ != "drop"){
+                throw std::runtime_error("Unknown shm command " + cmd_);
+            }
+        }
+
+        int run() {
+            if(cmd_ == "list"){
+                if(bwa_shm_list() < 0){
+                    std::cout << "No indexes are staged in shared memory\n";
+                }
+            }else if(cmd_ == "drop"){
+                if(bwa_shm_destroy() < 0){
+                    std::cout << "No indexes are staged in shared memory\n";
+                }else{
+                    tout << "Removed all staged indexes from shared memory\n";
+                }
+            }else{
+                if(!tx_idx_.empty() && !stage_(tx_idx_ + "_bwa")) return EXIT_FAILURE;
+                if(!genome_idx_.empty() && !stage_(genome_idx_)) return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        }
+
+    private:
+        bool stage_(const std::string & hint) const {
+            if(bwa_shm_test(hint.c_str())){
+                tout << "Index " << hint << " is already in shared memory\n";
+                return true;
+            }
+            tout << "Loading " << hint << "\n";
+            bwaidx_t * idx = bwa_idx_load_from_disk(hint.c_str(), BWA_IDX_ALL);
+            if(idx == nullptr){
+                std::cout << "Index load failed\n";
+                return false;
+            }
+            int ret = bwa_shm_stage(idx, hint.c_str(), tmp_.empty() ? nullptr : tmp_.c_str());
+            bwa_idx_destroy(idx);
+            if(ret < 0){
+                std::cout << "Failed to stage " << hint << " in shared memory\n";
+                return false;
+            }
+            tout << "Staged " << hint << " in shared memory\n";
+            return true;
+        }
+
+        std::string cmd_;
+        std::string tx_idx_;
+        std::string genome_idx_;
+        std::string tmp_;
+};
+
+}
@@ -25,11 +25,14 @@ SOFTWARE.
 #include "pmap.hpp"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
 #include "dups.hpp"
+#include "umi_table.hpp"
+#include "align_spill.hpp"
 #include <exception>
 #include <list>
 #include <thread>
 #include <functional>
 #include <map>
+#include <atomic>
 
 namespace gwsc {
 
@@ -48,10 +51,17 @@ class QuantBase {
 
         void build_gene_groups(const std::string & fname);
 
-        void set_data(std::vector<AlignSummary> & aligns, size_t total_barcodes){
+        // Each bucket is sorted in place and quantified by a single thread, merging in any spilled runs
+        void set_data(AlignBuckets & aligns, const std::vector<AlignRun> & runs, size_t total_barcodes){
             aligns_ = & aligns;
+            runs_ = & runs;
             total_barcodes_ = total_barcodes;
-            astart_ = 0;
+            next_ = 0;
+            atotal_ = 0;
+            ltotal_ = 0;
+            tags_ = 0;
+            for(auto & b : aligns) tags_ += b.size();
+            for(auto & r : runs) tags_ += r.offsets.back();
             start_ = tout.seconds();
         }
 
@@ -60,29 +70,34 @@ class QuantBase {
                 std::map<AlignSummary::bint, AlignGroup::ResultCounts> & brates);
         void write_umi_map(const std::string & out_file);
 
-        std::vector<uint32_t>           molecule_counts;
-        std::vector<uint32_t>           group_counts;
+        using barcode_counts_t = Dedup<DupNode, AlignSummary>::BarcodeCounts;
+        std::vector<barcode_counts_t>   barcode_counts;    // Only barcodes with tags, sorted by barcode
+        std::vector<uint32_t>           group_counts;      // Gene groups per row of barcode_counts
         std::vector<GeneCount>          gene_counts;
         std::vector<UMIMap>             umi_correct;
         std::vector<UMIBad>             umi_bad;
+        UMICorrectTable                 umi_table;
 
     private:
-        unsigned int read_(size_t N, std::vector<AlignSummary> & aligns);
+        size_t next_bucket_(size_t done);
 
         group_hash                                  group_map_;
         std::map<uint32_t, uint32_t>                gene_id_map_;
         std::vector<std::string>                    group_names_;
         std::string                                 cmd_;
-        std::vector<size_t>                         bpos_;
+        std::vector<uint32_t>                       bpos_;     // Output order of the barcodes
+        std::vector<uint32_t>                       brow_;     // barcode_counts row of each output barcode
         std::vector<std::string>                    prefixes_;
-        std::mutex                                  mtx_read_;
+        std::mutex                                  mtx_progress_;
         TXIndex                                   * index_;
-        std::vector<AlignSummary>                 * aligns_;
+        AlignBuckets                              * aligns_;
+        const std::vector<AlignRun>               * runs_;
+        std::atomic<size_t>                         next_{0};
         size_t                                      total_ = 0;
         size_t                                      ltotal_ = 0;
         size_t                                      atotal_ = 0;
+        size_t                                      tags_ = 0;
         size_t                                      total_barcodes_ = 0;
-        size_t                                      astart_ = 0;
         size_t                                      start_ = 0;
 };
 
@@ -92,12 +107,12 @@ class QuantWorker {
 
     public:
         friend class QuantBase;
-        using cb_read = std::function<unsigned int(size_t, std::vector<AlignSummary> &)>;
+        using cb_read = std::function<size_t(size_t)>;
         using dedup = Dedup<DupNode, AlignSummary>;
         QuantWorker(const TXIndex & idx, const QuantBase::group_hash & gh, 
-                size_t NG, cb_read cb, unsigned int umi_len, unsigned int total_barcodes) 
+                size_t NG, cb_read cb, unsigned int umi_len) 
 
-            : cb_(cb), dups_(umi_len, total_barcodes, NG, gh), idx_(idx) 
+            : cb_(cb), dups_(umi_len, NG, gh), idx_(idx) 
         {
 
         }
@@ -113,6 +128,9 @@ class QuantWorker {
 
         void operator()();
 
+        AlignBuckets                      * aligns = nullptr;
+        const std::vector<AlignRun>       * runs = nullptr;
+
         size_t                    total_molecules = 0;
         size_t                    total_umis = 0;
         size_t                    total_reads = 0;
@@ -121,7 +139,6 @@ class QuantWorker {
         void process_(std::vector<AlignSummary>::iterator bstart, std::vector<AlignSummary>::iterator bend);
         std::thread                                 thread_;
         cb_read                                     cb_;
-        std::vector<AlignSummary>                   aligns_;
         dedup                                       dups_;
         const TXIndex                             & idx_;
         size_t                                      NG_;
@@ -32,6 +32,10 @@ SOFTWARE.
 #include <functional>
 #include <iostream>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 
 namespace gwsc {
@@ -249,6 +253,100 @@ class GzipBuffer : public BufferBase {
 
 };
 
+// Inflates a gzip stream on its own thread into a small queue of large blocks
+// so the parsing thread only ever swaps in already decompressed data
+class AsyncGzipBuffer : public BufferBase {
+    public:
+    static const size_t BLOCK_SIZE = 1 << 20;
+    static const size_t QUEUE_SIZE = 4;
+
+    AsyncGzipBuffer() : BufferBase() {
+        BUFF_SIZE = BLOCK_SIZE;
+    }
+
+    virtual ~AsyncGzipBuffer(){
+        bclose();
+    }
+
+    bool bopen(const std::string & fin){
+        bclose();
+        fp_ = gzopen(fin.c_str(), "r");
+        init();
+        if(!fp_) {
+            eof = true;
+            return false;
+        }
+        gzbuffer(fp_, BLOCK_SIZE);
+        stop_ = false;
+        done_ = false;
+        thread_ = std::thread(&AsyncGzipBuffer::inflate_, this);
+        return true;
+    }
+
+    void bclose(){
+        if(thread_.joinable()){
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                stop_ = true;
+            }
+            cv_.notify_all();
+            thread_.join();
+        }
+        if(fp_ != nullptr) gzclose(fp_);
+        fp_ = nullptr;
+        full_.clear();
+    }
+
+    size_t bread() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [this]{ return !full_.empty() || done_; });
+        if(full_.empty()) return 0;
+        free_.push_back(std::move(buffer));
+        buffer = std::move(full_.front());
+        full_.pop_front();
+        cv_.notify_all();
+        return buffer.size();
+    }
+
+    private:
+    void inflate_(){
+        while(true){
+            std::string block;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                cv_.wait(lock, [this]{ return stop_ || full_.size() < QUEUE_SIZE; });
+                if(stop_) break;
+                if(!free_.empty()){
+                    block = std::move(free_.back());
+                    free_.pop_back();
+                }
+            }
+            block.resize(BLOCK_SIZE);
+            int n = gzread(fp_, &block[0], BLOCK_SIZE);
+            if(n < 0){
+                int err = 0;
+                std::cerr << "Error decompressing: " << gzerror(fp_, &err) << "\n";
+                exit(1);
+            }
+            block.resize(n);
+            std::lock_guard<std::mutex> lock(mtx_);
+            if(n > 0) full_.push_back(std::move(block));
+            if(static_cast<size_t>(n) < BLOCK_SIZE) done_ = true;
+            cv_.notify_all();
+            if(done_) break;
+        }
+    }
+
+    gzFile                   fp_ = nullptr;
+    std::thread              thread_;
+    std::mutex               mtx_;
+    std::condition_variable  cv_;
+    std::deque<std::string>  full_;
+    std::vector<std::string> free_;
+    bool                     stop_ = false;
+    bool                     done_ = false;
+};
+
 class FileBuffer : public BufferBase {
     public:
 
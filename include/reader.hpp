@@ -25,6 +25,10 @@ SOFTWARE.
 #include <mutex>
 #include <thread>
 #include <random>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
 #include "fastq.hpp"
 #include "misc.hpp"
 #include "aux.hpp"
@@ -47,6 +51,162 @@ struct Read {
 
 using Reads = std::vector<Read>;
 
+// Field view of a single read in a ReadBatch, only valid until the batch is refilled
+struct ReadView {
+    ArenaStr name;
+    ArenaStr barcode;
+    ArenaStr q_barcode;
+    ArenaStr umi;
+    ArenaStr q_umi;
+    ArenaStr tag;
+    ArenaStr q_tag;
+};
+
+// A step of reads stored in one contiguous arena, each read is a set of offsets into it.
+// R2 is stored as name, tag, q_tag and R1 as barcode, q_barcode, umi, q_umi, each NUL terminated.
+// The barcode and UMI are also 2 bit packed while reading so the workers never reparse them
+class ReadBatch {
+    public:
+        struct Rec {
+            uint32_t     name = 0;
+            uint32_t     name_len = 0;
+            uint32_t     tag = 0;
+            uint32_t     tag_len = 0;
+            uint32_t     barcode = 0;
+            uint64_t     barcode_code = 0;
+            uint32_t     umi_code = 0;
+            bool         barcode_ok = false; // No N's (same test as seq2int)
+            bool         umi_ok = false;     // No N's and not a homopolymer
+            unsigned int tend = 0;
+        };
+
+        size_t size() const {
+            return recs_.size();
+        }
+
+        bool empty() const {
+            return recs_.empty();
+        }
+
+        // Keeps the arena and record capacity for the next fill
+        void clear() {
+            arena_.clear();
+            recs_.clear();
+        }
+
+        Rec & operator[](size_t i) {
+            return recs_[i];
+        }
+
+        const Rec & operator[](size_t i) const {
+            return recs_[i];
+        }
+
+        unsigned int barcode_len() const {
+            return blen_;
+        }
+
+        unsigned int umi_len() const {
+            return ulen_;
+        }
+
+        ArenaStr name(size_t i) const { return str_(recs_[i].name, recs_[i].name_len); }
+        ArenaStr tag(size_t i) const { return str_(recs_[i].tag, recs_[i].tag_len); }
+        ArenaStr q_tag(size_t i) const { return str_(recs_[i].tag + recs_[i].tag_len + 1, recs_[i].tag_len); }
+        ArenaStr barcode(size_t i) const { return str_(recs_[i].barcode, blen_); }
+        ArenaStr q_barcode(size_t i) const { return str_(recs_[i].barcode + blen_ + 1, blen_); }
+        ArenaStr umi(size_t i) const { return str_(recs_[i].barcode + 2 * (blen_ + 1), ulen_); }
+        ArenaStr q_umi(size_t i) const { return str_(recs_[i].barcode + 2 * (blen_ + 1) + ulen_ + 1, ulen_); }
+
+        ReadView view(size_t i) const {
+            return {name(i), barcode(i), q_barcode(i), umi(i), q_umi(i), tag(i), q_tag(i)};
+        }
+
+        // Overwrite the barcode in place with a corrected 2 bit code
+        void set_barcode(size_t i, uint64_t code) {
+            Rec & r = recs_[i];
+            r.barcode_code = code;
+            for(size_t j = 0; j < blen_; j++){
+                arena_[r.barcode + blen_ - j - 1] = ADNA4::alphabet_str_[code & 0x3];
+                code >>= 2;
+            }
+        }
+
+        // Readers append R2 directly to the arena after push_back, starting with the name
+        std::string & arena() {
+            return arena_;
+        }
+
+        Rec & push_back() {
+            recs_.emplace_back();
+            recs_.back().name = arena_.size();
+            return recs_.back();
+        }
+
+        // Drop the last read, used when down sampling
+        void pop_back() {
+            arena_.resize(recs_.back().name);
+            recs_.pop_back();
+        }
+
+        // Append R1 to the last record and pack the barcode and UMI
+        void append_r1(const std::string & seq, const std::string & qual, unsigned int blen, unsigned int ulen);
+
+    private:
+        ArenaStr str_(uint32_t off, uint32_t len) const {
+            ArenaStr s;
+            s.p = arena_.data() + off;
+            s.n = len;
+            return s;
+        }
+
+        std::string       arena_;
+        std::vector<Rec>  recs_;
+        unsigned int      blen_ = 0;
+        unsigned int      ulen_ = 0;
+};
+
+inline void ReadBatch::append_r1(const std::string & seq, const std::string & qual, unsigned int blen, unsigned int ulen){
+    blen_ = blen;
+    ulen_ = ulen;
+    Rec & r = recs_.back();
+    r.barcode = arena_.size();
+    arena_.append(seq, 0, blen).push_back('\0');
+    arena_.append(qual, 0, blen).push_back('\0');
+    arena_.append(seq, blen, ulen).push_back('\0');
+    arena_.append(qual, blen, ulen).push_back('\0');
+
+    uint64_t bcode = 0;
+    r.barcode_ok = true;
+    for(size_t i = 0; i < blen; i++){
+        char c = ADNA4::ltable_[static_cast<size_t>(seq[i])];
+        if(c < 0){
+            r.barcode_ok = false;
+            break;
+        }
+        bcode = (bcode << 2) | c;
+    }
+    // seq2int treats an all A code as a failure
+    r.barcode_ok = r.barcode_ok && bcode != 0;
+    r.barcode_code = bcode;
+
+    uint32_t ucode = 0;
+    bool homo = true;
+    r.umi_ok = true;
+    for(size_t i = blen; i < blen + ulen; i++){
+        char c = ADNA4::ltable_[static_cast<size_t>(seq[i])];
+        if(c < 0){
+            r.umi_ok = false;
+            break;
+        }
+        homo = homo && seq[i] == seq[blen];
+        ucode = (ucode << 2) | c;
+    }
+    r.umi_ok = r.umi_ok && ucode != 0 && !homo;
+    r.umi_code = ucode;
+    r.tend = 0;
+}
+
 struct BarcodeRead{
     std::string name;
     std::string comment;
@@ -68,14 +228,19 @@ class MultiReader{
 
         }
 
-        void reset() {
+        ~MultiReader(){
+            stop();
+        }
+
+        void reset(bool open = true) {
             if(files_.empty()) return;
+            read_.clear();
+            read_.resize(files_.size());
+            if(!open) return;
             curr_ = 0;
             if(verbose_) tout << "Processing " << files_[curr_].first << " and " 
                               << files_[curr_].second << " total reads = " << files_[curr_].total  << "\n";
             in_.open(files_[curr_].first, files_[curr_].second);
-            read_.clear();
-            read_.resize(files_.size());
         }
 
         bool read(Read & r);
@@ -83,6 +248,13 @@ class MultiReader{
         unsigned int read_N_safe(size_t N, Reads & reads);
         bool read_barcode(std::string & bc, std::string & qbc);
 
+        // Read the files on lanes background threads, each decompressing R1 and R2 on their own
+        // threads, into a queue of at most queue_size batches of batch_size reads
+        void start(unsigned int lanes, size_t batch_size, size_t queue_size);
+        // Swap the next queued batch into reads, returns 0 once all of the lanes are done **THREAD SAFE**
+        unsigned int next_batch(ReadBatch & reads);
+        void stop();
+
         const FastqPair & file(size_t i) const {
             return files_[i];
         }
@@ -99,14 +271,16 @@ class MultiReader{
             return files_.size();
         }
 
-        void set_files(const FastqPairs & files){
+        // open is false when the files are read with start
+        void set_files(const FastqPairs & files, bool open = true){
             files_ = files;
             curr_ = std::numeric_limits<size_t>::max();
-            reset();
+            reset(open);
         }
 
         void set_downsample(double perc, size_t seed){
             downsample_ = perc;
+            seed_ = seed;
             mt_ = std::mt19937(seed);
             dist_ = std::uniform_real_distribution<double>(0, 1);
         }
@@ -116,17 +290,33 @@ class MultiReader{
         }
 
     private:
+        void lane_(size_t lane);
+
         FastqPairs                 files_;
         T                          in_;
         std::mt19937               mt_;
         std::uniform_real_distribution<double> dist_;
         size_t                     curr_ = std::numeric_limits<size_t>::max();
-        size_t                     skipped_ = 0;
+        std::atomic<size_t>        skipped_{0};
         double                     downsample_ = 0.0;
+        size_t                     seed_ = 0;
         std::vector<size_t>        read_;
         std::mutex                 mutex_;
         bool                       verbose_;
 
+        // Background lanes
+        std::list<std::thread>     lanes_;
+        std::deque<ReadBatch>      full_;
+        std::vector<ReadBatch>     free_;
+        std::mutex                 qmtx_;
+        std::condition_variable    qcv_;
+        std::atomic<size_t>        next_file_{0};
+        size_t                     batch_size_ = 0;
+        size_t                     queue_size_ = 0;
+        unsigned int               active_lanes_ = 0;
+        unsigned int               total_lanes_ = 0;
+        std::atomic<bool>          stop_{false};
+
 };
 
 class ReaderBase{
@@ -148,17 +338,25 @@ class ReaderBase{
         }
 
         void open(const std::string & f1, const std::string & f2){
-            f1_.open(f1);
-            f2_.open(f2);
+            f1_.open(f1, async_);
+            f2_.open(f2, async_);
+        }
+
+        // Decompress R1 and R2 on their own threads for files opened after this call
+        void set_async(bool async){
+            async_ = async;
         }
 
         virtual bool read(Read & r) = 0;
+        // Append the next read to the batch arena
+        virtual bool read(ReadBatch & b) = 0;
         virtual bool read_barcode(std::string & bc, std::string & qbc) = 0;
         unsigned int read_N(size_t N, Reads & reads);
 
     protected:
         FastqReader f1_;
         FastqReader f2_;
+        bool        async_ = false;
 };
 
 class Reader10X_V2 : public ReaderBase {
@@ -181,6 +379,7 @@ class Reader10X_V2 : public ReaderBase {
         }
 
         virtual bool read(Read & r);
+        virtual bool read(ReadBatch & b);
         virtual bool read_barcode(std::string & bc, std::string & qbc);
 
     protected:
@@ -216,6 +415,7 @@ class Reader10X_V3 : public ReaderBase {
         }
 
         virtual bool read(Read & r);
+        virtual bool read(ReadBatch & b);
         virtual bool read_barcode(std::string & bc, std::string & qbc);
 
     protected:
@@ -282,6 +482,95 @@ inline bool MultiReader<T>::read_barcode(std::string & bc, std::string & qbc) {
     return true;
 }
 
+template <typename T>
+inline void MultiReader<T>::start(unsigned int lanes, size_t batch_size, size_t queue_size) {
+    if(lanes < 1) lanes = 1;
+    batch_size_ = batch_size;
+    queue_size_ = std::max<size_t>(queue_size, 1);
+    next_file_ = 0;
+    stop_ = false;
+    active_lanes_ = lanes;
+    total_lanes_ = lanes;
+    read_.clear();
+    read_.resize(files_.size());
+    for(size_t i = 0; i < lanes; i++){
+        lanes_.emplace_back(&MultiReader<T>::lane_, this, i);
+    }
+}
+
+template <typename T>
+inline void MultiReader<T>::stop() {
+    {
+        std::lock_guard<std::mutex> lock(qmtx_);
+        stop_ = true;
+    }
+    qcv_.notify_all();
+    for(auto & t : lanes_){
+        t.join();
+    }
+    lanes_.clear();
+    full_.clear();
+}
+
+template <typename T>
+inline unsigned int MultiReader<T>::next_batch(ReadBatch & reads) {
+    std::unique_lock<std::mutex> lock(qmtx_);
+    qcv_.wait(lock, [this]{ return !full_.empty() || active_lanes_ == 0; });
+    if(full_.empty()) {
+        reads.clear();
+        return 0;
+    }
+    free_.push_back(std::move(reads));
+    reads = std::move(full_.front());
+    full_.pop_front();
+    qcv_.notify_all();
+    return reads.size();
+}
+
+template <typename T>
+inline void MultiReader<T>::lane_(size_t lane) {
+    T in;
+    in.set_async(true);
+    // A single lane reproduces the sequential down sampling, otherwise each file gets its own seed
+    bool shared_rng = total_lanes_ == 1;
+    std::mt19937 mt;
+    std::uniform_real_distribution<double> dist(0, 1);
+    ReadBatch batch;
+    size_t f = 0;
+    while(!stop_ && (f = next_file_++) < files_.size()){
+        if(verbose_) tout << "Lane " << lane << " processing " << files_[f].first << " and " << files_[f].second 
+                          << " total reads = " << files_[f].total << "\n";
+        in.open(files_[f].first, files_[f].second);
+        if(!shared_rng) mt = std::mt19937(seed_ + f);
+        bool more = true;
+        while(more){
+            batch.clear();
+            while(batch.size() < batch_size_ && (more = in.read(batch))){
+                read_[f]++;
+                if(downsample_ > 0.0 && dist(shared_rng ? mt_ : mt) > downsample_){
+                    skipped_++;
+                    batch.pop_back();
+                }
+            }
+            if(batch.empty()) continue;
+
+            std::unique_lock<std::mutex> lock(qmtx_);
+            qcv_.wait(lock, [this]{ return stop_ || full_.size() < queue_size_; });
+            if(stop_) break;
+            full_.push_back(std::move(batch));
+            batch.clear();
+            if(!free_.empty()){
+                batch = std::move(free_.back());
+                free_.pop_back();
+            }
+            qcv_.notify_all();
+        }
+    }
+    std::lock_guard<std::mutex> lock(qmtx_);
+    active_lanes_--;
+    qcv_.notify_all();
+}
+
 template <typename T>
 inline unsigned int MultiReader<T>::read_N_safe(size_t N, Reads & reads) {
     std::lock_guard<std::mutex> lock(mutex_);
@@ -28,9 +28,13 @@ SOFTWARE.
 #include <iostream>
 #include <queue>
 #include <tuple>
+#include <vector>
+#include <fstream>
+#include <cstring>
 #include "misc.hpp"
 #include "htslib/htslib/hts.h"
 #include "htslib/htslib/sam.h"
+#include "htslib/htslib/bgzf.h"
 
 namespace gwsc{
 
@@ -223,4 +227,187 @@ inline void BamMerger::add_bams(IT start, IT end){
     }
 }
 
+// Part of the genome merged on its own, tid -1 holds the unmapped reads
+struct BamRegion {
+    int32_t tid;
+    int64_t beg;
+    int64_t end;
+};
+
+// Split the targets into about n chunks of equal length, each an ordered list of regions.
+// The chunks are in coordinate order and the unmapped reads are the last chunk
+inline std::vector<std::vector<BamRegion>> partition_bam_regions(const bam_hdr_t * h, size_t n) {
+    std::vector<std::vector<BamRegion>> chunks(1);
+    uint64_t total = 0;
+    for(int32_t i = 0; i < h->n_targets; i++) total += h->target_len[i];
+    uint64_t step = std::max<uint64_t>(1, total / std::max<size_t>(n, 1));
+    uint64_t filled = 0;
+    for(int32_t tid = 0; tid < h->n_targets; tid++){
+        int64_t beg = 0, len = h->target_len[tid];
+        while(beg < len){
+            int64_t end = std::min<int64_t>(len, beg + (step - filled));
+            chunks.back().push_back({tid, beg, end});
+            filled += end - beg;
+            beg = end;
+            if(filled >= step){
+                chunks.emplace_back();
+                filled = 0;
+            }
+        }
+    }
+    if(chunks.back().empty()) chunks.pop_back();
+    chunks.push_back({{-1, 0, 0}});
+    return chunks;
+}
+
+// Append a headerless bgzf file to out without recompressing it, its end of file block is dropped
+inline void append_bgzf_segment(BGZF * out, const std::string & seg) {
+    static const uint8_t eof[28] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+        0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    std::ifstream in(seg, std::ios::binary | std::ios::ate);
+    if(!in.good()){
+        std::cerr << "Error opening merged segment " << seg << "\n";
+        exit(1);
+    }
+    size_t size = in.tellg();
+    in.seekg(0);
+    std::vector<char> buffer(1 << 20);
+    if(size >= sizeof(eof)){
+        std::vector<char> tail(sizeof(eof));
+        in.seekg(size - sizeof(eof));
+        in.read(tail.data(), tail.size());
+        if(memcmp(tail.data(), eof, sizeof(eof)) == 0) size -= sizeof(eof);
+        in.seekg(0);
+    }
+    if(bgzf_flush(out) < 0){
+        std::cerr << "Error flushing the merged bam\n";
+        exit(1);
+    }
+    while(size > 0){
+        size_t n = std::min(size, buffer.size());
+        in.read(buffer.data(), n);
+        if(bgzf_raw_write(out, buffer.data(), n) < 0){
+            std::cerr << "Error appending " << seg << " to the merged bam\n";
+            exit(1);
+        }
+        size -= n;
+    }
+}
+
+// Merges one region at a time of indexed, sorted bam files
+class BamRegionMerger {
+    BamRegionMerger( const BamRegionMerger& ) = delete;
+    BamRegionMerger& operator=(const BamRegionMerger&) = delete;
+
+    struct RegionFile {
+        samFile   * sf = nullptr;
+        bam_hdr_t * bh = nullptr;
+        hts_idx_t * idx = nullptr;
+        hts_itr_t * itr = nullptr;
+        bam1_t    * read = nullptr;
+    };
+
+    using Node = std::pair<uint64_t, unsigned int>;
+
+    public:
+        BamRegionMerger(){
+        }
+
+        ~BamRegionMerger(){
+            for(auto & f : files_){
+                if(f.itr != nullptr) hts_itr_destroy(f.itr);
+                if(f.idx != nullptr) hts_idx_destroy(f.idx);
+                if(f.bh != nullptr) bam_hdr_destroy(f.bh);
+                if(f.sf != nullptr) sam_close(f.sf);
+                if(f.read != nullptr) bam_destroy1(f.read);
+            }
+        }
+
+        template <typename IT>
+        void add_bams(IT start, IT end);
+
+        void set_region(const BamRegion & r);
+
+        bam1_t * next(bam1_t * read);
+
+        const bam_hdr_t * header() const {
+            if(files_.empty()) return nullptr;
+            return files_.front().bh;
+        }
+
+    private:
+        bool read_(RegionFile & f);
+        void push_(unsigned int fno);
+
+        std::vector<RegionFile>                                          files_;
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> pq_;
+        BamRegion                                                        region_{-1, 0, 0};
+};
+
+template <typename IT>
+inline void BamRegionMerger::add_bams(IT start, IT end){
+    while(start != end){
+        RegionFile f;
+        f.sf = sam_open(start->c_str(), "r");
+        if(f.sf == nullptr){
+            std::cerr << "Error opening " << *start << "\n";
+            exit(1);
+        }
+        f.bh = sam_hdr_read(f.sf);
+        f.idx = sam_index_load(f.sf, start->c_str());
+        if(f.idx == nullptr){
+            std::cerr << "Error loading the index of " << *start << "\n";
+            exit(1);
+        }
+        f.read = bam_init1();
+        files_.push_back(f);
+        start++;
+    }
+}
+
+inline void BamRegionMerger::set_region(const BamRegion & r){
+    region_ = r;
+    pq_ = decltype(pq_)();
+    for(unsigned int i = 0; i < files_.size(); i++){
+        auto & f = files_[i];
+        if(f.itr != nullptr) hts_itr_destroy(f.itr);
+        if(r.tid < 0){
+            f.itr = sam_itr_queryi(f.idx, HTS_IDX_NOCOOR, 0, 0);
+        }else{
+            f.itr = sam_itr_queryi(f.idx, r.tid, r.beg, r.end);
+        }
+        if(f.itr != nullptr && read_(f)) push_(i);
+    }
+}
+
+// Reads that start before the region were already merged with the previous one
+inline bool BamRegionMerger::read_(RegionFile & f){
+    while(sam_itr_next(f.sf, f.itr, f.read) >= 0){
+        if(region_.tid >= 0 && f.read->core.pos < region_.beg) continue;
+        return true;
+    }
+    return false;
+}
+
+inline void BamRegionMerger::push_(unsigned int fno){
+    auto b = files_[fno].read;
+    int32_t tid = b->core.tid == -1 ? files_[fno].bh->n_targets : b->core.tid;
+    pq_.push({(static_cast<uint64_t>(tid) << 32) | (b->core.pos+1)<<1 | bam_is_rev(b), fno});
+}
+
+inline bam1_t * BamRegionMerger::next(bam1_t * read){
+    if(pq_.empty()) return nullptr;
+    unsigned int fno = pq_.top().second;
+    pq_.pop();
+    auto & f = files_[fno];
+    if(bam_copy1(read, f.read) == NULL) {
+        std::cerr << "Error copying bam record\n"; 
+        exit(1);
+    }
+    if(read_(f)) push_(fno);
+    return read;
+}
+
 }
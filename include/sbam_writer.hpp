@@ -33,6 +33,10 @@ SOFTWARE.
 #include <iostream>
 #include <sstream>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
 #include "align_aux.hpp"
 #include "reader.hpp"
 #include "index.hpp"
@@ -153,6 +157,7 @@ class SortedBamWriter{
         }
 
         void close(){
+            stop_spill_threads_();
             if(pool_.pool != NULL){
                 hts_tpool_destroy(pool_.pool);
                 pool_.pool = NULL;
@@ -161,6 +166,12 @@ class SortedBamWriter{
                 bam_destroy1(p);
             }
             out_.clear();
+            for(auto & f : free_){
+                for(auto p : f){
+                    bam_destroy1(p);
+                }
+            }
+            free_.clear();
         }
 
         ~SortedBamWriter(){
@@ -174,13 +185,26 @@ class SortedBamWriter{
             pool_threads_ = threads;
         }
 
-        void set_thread_buffer(unsigned int out_sz, unsigned int thread_sz){
+        // Allocates spill_threads + 1 record pools of out_sz records so that one pool is always
+        // being filled while the others are sorted and written in the background
+        void set_thread_buffer(unsigned int out_sz, unsigned int thread_sz, unsigned int spill_threads = 1){
             out_sz_ = out_sz;
             thread_sz_ = thread_sz;
+            if(spill_threads < 1) spill_threads = 1;
             
             for(size_t i = 0; i < out_sz_; i++){
                 out_.push_back(bam_init1());
             }
+            for(size_t j = 0; j < spill_threads; j++){
+                free_.emplace_back();
+                auto & f = free_.back();
+                for(size_t i = 0; i < out_sz_; i++){
+                    f.push_back(bam_init1());
+                }
+            }
+            for(size_t j = 0; j < spill_threads; j++){
+                spill_threads_.emplace_back(&SortedBamWriter::spill_loop_, this);
+            }
         }
 
         unsigned int total_reads() const {
@@ -199,6 +223,21 @@ class SortedBamWriter{
             return thread_sz_;
         }
 
+        // Seconds mapping threads spent waiting for a free record pool
+        double spill_wait() const {
+            return 1.0 * spill_wait_ / 1000000.0;
+        }
+
+        // Seconds mapping threads spent waiting to acquire the write lock
+        double lock_wait() const {
+            return 1.0 * lock_wait_ / 1000000.0;
+        }
+
+        // Number of times a mapping thread had to wait for a spill to finish
+        unsigned int spill_stalls() const {
+            return spill_stalls_;
+        }
+
         void prepare_thread_buffer(read_buffer & buff) {
             for(size_t i = 0; i < thread_sz_; i++){
                 buff.push_back(bam_init1());
@@ -209,11 +248,11 @@ class SortedBamWriter{
             prefix_ = prefix;
         }
 
-        // Add a read to the output buffer, write the file if necessary **THREAD SAFE**
-        void write(const AlignGroup & g, const Read & r, read_buffer & buffer, unsigned int & rcount, const TXIndex & idx);
+        // Add a read to the output buffer, queue the pool for writing if necessary **THREAD SAFE**
+        void write(const AlignGroup & g, const ReadView & r, read_buffer & buffer, unsigned int & rcount, const TXIndex & idx);
         // To write any left over reads directly **NOT THREAD SAFE**
         void merge_buffer(read_buffer & buffer, unsigned int & rcount);
-        // Write everything in the buffer **NOT THREAD SAFE** 
+        // Write everything in the buffer and wait for all pending spills **NOT THREAD SAFE** 
         void force_write();
 
         htsThreadPool & pool() {
@@ -223,18 +262,41 @@ class SortedBamWriter{
         BamHeader bh;
 
     private:
-        void _align2bam(bam1_t * bam, const AlignGroup & g, const Read & r, const TXIndex & idx);
-        void _align2unmapped(bam1_t * bam, const AlignGroup & g, const Read & r);
-        std::mutex            mtx_write_;
-        unsigned int          thread_sz_ = 10000;
-        unsigned int          out_sz_    = 2000000;
-        read_buffer           out_;
-        unsigned int          file_number_ = 0;
-        unsigned int          total_reads_ = 0;
-        unsigned int          file_reads_ = 0;
-        unsigned int          pool_threads_ = 1;
-        std::string           prefix_;
-        htsThreadPool         pool_;
+        struct SpillJob{
+            read_buffer  recs;
+            unsigned int count;
+            unsigned int file;
+        };
+
+        void _align2bam(bam1_t * bam, const AlignGroup & g, const ReadView & r, const TXIndex & idx);
+        void _align2unmapped(bam1_t * bam, const AlignGroup & g, const ReadView & r);
+        // Hand the active pool to the spill threads and swap in a free one, mtx_spill_ must be held
+        void queue_spill_(std::unique_lock<std::mutex> & lock);
+        void spill_loop_();
+        void write_file_(read_buffer & recs, unsigned int count, unsigned int file);
+        void stop_spill_threads_();
+
+        std::mutex               mtx_write_;
+        std::mutex               mtx_spill_;
+        std::condition_variable  cv_spill_;
+        std::condition_variable  cv_free_;
+        std::deque<SpillJob>     spills_;
+        std::vector<read_buffer> free_;
+        std::vector<std::thread> spill_threads_;
+        unsigned int             active_spills_ = 0;
+        bool                     stop_ = false;
+        uint64_t                 spill_wait_ = 0;
+        uint64_t                 lock_wait_ = 0;
+        unsigned int             spill_stalls_ = 0;
+        unsigned int             thread_sz_ = 10000;
+        unsigned int             out_sz_    = 2000000;
+        read_buffer              out_;
+        unsigned int             file_number_ = 0;
+        unsigned int             total_reads_ = 0;
+        unsigned int             file_reads_ = 0;
+        unsigned int             pool_threads_ = 1;
+        std::string              prefix_;
+        htsThreadPool            pool_;
 };
 
 }
@@ -23,6 +23,7 @@ SOFTWARE.
 
 #include <string>
 #include <cstdint>
+#include <iterator>
 namespace gwsc {
 
 static constexpr const char reverse_cmpl_[] = {
@@ -36,6 +37,21 @@ static constexpr const char reverse_cmpl_[] = {
     'p','q','y','s','a','a','b','w','x','r','z',123,124,125,126,127
 };
 
+// Non owning view of a NUL terminated sequence, such as a field of a ReadBatch arena
+struct ArenaStr {
+    const char * p = nullptr;
+    uint32_t     n = 0;
+
+    size_t size() const { return n; }
+    size_t length() const { return n; }
+    const char * c_str() const { return p; }
+    const char * data() const { return p; }
+    const char * begin() const { return p; }
+    const char * end() const { return p + n; }
+    std::reverse_iterator<const char*> rbegin() const { return std::reverse_iterator<const char*>(end()); }
+    char operator[](size_t i) const { return p[i]; }
+};
+
 class Sequence{
     public:
 
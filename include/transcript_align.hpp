@@ -52,13 +52,18 @@ class TranscriptAlign{
             args_ = nullptr;
         }
 
-        void load(const std::string & prefix, unsigned int min_overhang);
+        // When shm is set the index is attached from shared memory if it was staged with scsnv shm load
+        void load(const std::string & prefix, unsigned int min_overhang, bool shm = false);
         void set_gidx(const GenomeAlign * gidx) {
             gidx_ = gidx;
         }
-        void align(AlignGroup & ad, const std::string & seq, unsigned int len) const;
-        void get(AlignGroup & ad, size_t i, const std::string & seq, unsigned int len) const;
+        // buf is the calling thread's BWA scratch space, it is reused across reads
+        void align(AlignGroup & ad, const ArenaStr & seq, unsigned int len, mem_buf_t * buf) const;
+        void get(AlignGroup & ad, size_t i, const ArenaStr & seq, unsigned int len, mem_buf_t * buf) const;
         void project(AlignData & a, CigarString & tc) const;
+        // True if the best hit is a full length perfect sense alignment and every hit the
+        // classification would keep belongs to the same gene
+        bool conclusive(const AlignGroup & ad, unsigned int len) const;
 
         AlignScore ascore;
         
@@ -0,0 +1,202 @@
+/*
+Copyright (c) 2018-2020 Gavin W. Wilson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "align_aux.hpp"
+
+namespace gwsc {
+
+// Open addressing table of the UMI corrections and bad UMIs keyed by (barcode, gene, umi)
+class UMICorrectTable {
+    public:
+        static const uint32_t USED = 1U << 31;
+        static const uint32_t BAD = 1U << 30;
+        static const uint32_t CORRECT = 1U << 29;
+        static const uint32_t UMI_MASK = CORRECT - 1;
+        static const size_t   npos = static_cast<size_t>(-1);
+
+        struct Slot {
+            uint32_t barcode;
+            uint32_t gene_id;
+            uint32_t umi;
+            uint32_t value;
+        };
+
+        void build(const std::vector<UMIMap> & correct, const std::vector<UMIBad> & bad) {
+            size_t N = correct.size() + bad.size();
+            size_t cap = 16;
+            // Keep the load factor under 0.5 so probe chains stay short
+            while(cap < 2 * N) cap <<= 1;
+            slots_.assign(cap, Slot{0, 0, 0, 0});
+            mask_ = cap - 1;
+            size_ = 0;
+            corrections_ = 0;
+            for(auto & c : correct) {
+                Slot & s = insert_(c.barcode, c.gene_id, c.umi_from);
+                if(!(s.value & CORRECT)) corrections_++;
+                s.value = (s.value & ~UMI_MASK) | CORRECT | (c.umi_to & UMI_MASK);
+            }
+            for(auto & b : bad) {
+                insert_(b.barcode, b.gene_id, b.umi).value |= BAD;
+            }
+        }
+
+        // Slot index of the key or npos
+        size_t find(uint32_t barcode, uint32_t gene_id, uint32_t umi) const {
+            if(size_ == 0) return npos;
+            size_t i = hash_(barcode, gene_id, umi) & mask_;
+            while(slots_[i].value & USED) {
+                const Slot & s = slots_[i];
+                if(s.barcode == barcode && s.gene_id == gene_id && s.umi == umi) return i;
+                i = (i + 1) & mask_;
+            }
+            return npos;
+        }
+
+        bool corrected(size_t i) const {
+            return slots_[i].value & CORRECT;
+        }
+
+        bool bad(size_t i) const {
+            return slots_[i].value & BAD;
+        }
+
+        uint32_t umi_to(size_t i) const {
+            return slots_[i].value & UMI_MASK;
+        }
+
+        size_t capacity() const {
+            return slots_.size();
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+        size_t corrections() const {
+            return corrections_;
+        }
+
+        size_t bytes() const {
+            return slots_.size() * sizeof(Slot);
+        }
+
+        void clear() {
+            std::vector<Slot>().swap(slots_);
+            mask_ = size_ = corrections_ = 0;
+        }
+
+        void write(const std::string & fname) const {
+            gzFile zout = gzopen(fname.c_str(), "wb");
+            if(zout == nullptr) {
+                std::cout << "Error! Could not open " << fname << " for writing\n";
+                exit(1);
+            }
+            uint64_t header[4] = {MAGIC, slots_.size(), size_, corrections_};
+            gzwrite(zout, reinterpret_cast<const char*>(header), sizeof(header));
+            // Write in pieces, gzwrite takes an unsigned length
+            const char * p = reinterpret_cast<const char*>(slots_.data());
+            size_t left = bytes();
+            while(left > 0) {
+                unsigned int n = std::min<size_t>(left, 1U << 30);
+                if(gzwrite(zout, p, n) != static_cast<int>(n)) {
+                    std::cout << "Error! Failed writing " << fname << "\n";
+                    exit(1);
+                }
+                p += n;
+                left -= n;
+            }
+            gzclose(zout);
+        }
+
+        void load(const std::string & fname) {
+            gzFile zin = gzopen(fname.c_str(), "rb");
+            if(zin == nullptr) {
+                std::cout << "Error! Could not open the UMI correction table " << fname << "\n";
+                exit(1);
+            }
+            uint64_t header[4];
+            if(gzread(zin, reinterpret_cast<char*>(header), sizeof(header)) != sizeof(header) || header[0] != MAGIC ||
+                    header[1] == 0 || (header[1] & (header[1] - 1)) != 0) {
+                std::cout << "Error! " << fname << " is not a UMI correction table\n";
+                exit(1);
+            }
+            slots_.resize(header[1]);
+            mask_ = header[1] - 1;
+            size_ = header[2];
+            corrections_ = header[3];
+            char * p = reinterpret_cast<char*>(slots_.data());
+            size_t left = bytes();
+            while(left > 0) {
+                unsigned int n = std::min<size_t>(left, 1U << 30);
+                if(gzread(zin, p, n) != static_cast<int>(n)) {
+                    std::cout << "Error! Truncated UMI correction table " << fname << "\n";
+                    exit(1);
+                }
+                p += n;
+                left -= n;
+            }
+            gzclose(zin);
+        }
+
+    private:
+        static const uint64_t MAGIC = 0x31544d55564e5343ULL; // "CSNVUMT1"
+
+        static size_t hash_(uint32_t barcode, uint32_t gene_id, uint32_t umi) {
+            uint64_t h = (static_cast<uint64_t>(barcode) << 32) | gene_id;
+            h ^= static_cast<uint64_t>(umi) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        Slot & insert_(uint32_t barcode, uint32_t gene_id, uint32_t umi) {
+            size_t i = hash_(barcode, gene_id, umi) & mask_;
+            while(slots_[i].value & USED) {
+                Slot & s = slots_[i];
+                if(s.barcode == barcode && s.gene_id == gene_id && s.umi == umi) return s;
+                i = (i + 1) & mask_;
+            }
+            size_++;
+            slots_[i] = Slot{barcode, gene_id, umi, USED};
+            return slots_[i];
+        }
+
+        std::vector<Slot>   slots_;
+        size_t              mask_ = 0;
+        size_t              size_ = 0;
+        size_t              corrections_ = 0;
+};
+
+}
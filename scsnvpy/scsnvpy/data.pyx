@@ -116,3 +116,28 @@ def build_matrix(fname, passed_ids, matrix_type = 'dense'):
                 imat = sparse.csc_matrix((data, (ridx, cidx)), shape=(len(gids), len(pids)), dtype='int32')
 
         return gene_ids[gids], gene_names[gids], mat, imat
+
+def load_umi_coverage(fname, start = 0, end = None):
+    """Loads the UMI coverage of pileup positions [start, end) from a _barcode_matrices.h5 file.
+
+    Returns a DataFrame with the chrom, pos and the offset of each position into the returned values.
+    The coverage of row i is values[offsets[i]:offsets[i + 1]], each value packs the consensus
+    read count in the upper 16 bits and the total raw reads in the lower 16 bits.
+    """
+    with h5py.File(fname, 'r') as h5f:
+        cov = h5f['coverage']
+        N = cov['pos'].shape[0]
+        end = N if end is None else min(end, N)
+        start = min(start, end)
+        offsets = NP.array(cov['umi_offsets'][start:end + 1], dtype='uint64')
+        values = NP.array(cov['umi_values'][offsets[0]:offsets[-1]], dtype='uint32')
+        chroms = NP.array(cov['chroms'])
+        if len(chroms) > 0 and type(chroms[0]) == bytes:
+            chroms = NP.array([c.decode('utf-8') for c in chroms])
+        df = pd.DataFrame({'chrom':chroms[NP.array(cov['tid'][start:end])], 'pos':NP.array(cov['pos'][start:end])})
+        return df, offsets - offsets[0], values
+
+def split_umi_coverage(values):
+    """Splits packed UMI coverage values into the consensus and total raw read counts"""
+    values = NP.asarray(values, dtype='uint32')
+    return (values >> 16).astype('uint16'), (values & 0xFFFF).astype('uint16')
@@ -25,6 +25,7 @@ SOFTWARE.
 #include "gzstream.hpp"
 #include <fstream>
 #include <unordered_map>
+#include <zlib.h>
 
 using namespace gwsc;
 
@@ -44,6 +45,8 @@ void CBWhiteListShort::load(const std::string & wlist) {
             counts_.push_back(toks.size() == 1 ? 0 : std::stoi(toks[1]));
         }
     }
+    corr_.clear();
+    indexed_ = false;
     tout << "Loaded " << idx << " known barcodes from " << wlist << "\n";
 }
 
@@ -61,10 +64,14 @@ void CBWhiteListShort::merge(const std::string & wlist) {
             idx++;
         }
     }
+    corr_.clear();
+    indexed_ = false;
     tout << "Merged " << idx << " known barcodes from " << wlist << "\n";
 }
 
 void CBWhiteListShort::reset() {
+    corr_.clear();
+    indexed_ = false;
     counts_.clear();
     counts_.resize(barcodes_.size());
 }
@@ -107,6 +114,32 @@ int CBWhiteListShort::count(const std::string & bc, CountSummary & summary) {
     return 2;
 }
 
+int CBWhiteListShort::count(const std::string & bc, CountSummary & summary, 
+        phmap::flat_hash_map<AlignSummary::bint, unsigned int> & local) const {
+    uint64_t code = 0;
+    summary.total++;
+    bool res = seq2int<gwsc::ADNA4, uint64_t>(bc, code);
+    if(!res) {
+        summary.ambig++;
+        return 1;
+    }
+    auto it = hash_.find(code);
+    if(it != hash_.end()){
+        local[it->second]++;
+        summary.correct++;
+        return 0;
+    }
+    return 2;
+}
+
+void CBWhiteListShort::add_counts(const phmap::flat_hash_map<AlignSummary::bint, unsigned int> & local) {
+    for(auto const & c : local){
+        counts_[c.first] += c.second;
+    }
+    corr_.clear();
+    indexed_ = false;
+}
+
 AlignSummary::bint CBWhiteListShort::bid(const std::string & bc) const {
     uint64_t code = 0;
     seq2int<gwsc::ADNA4, uint64_t>(bc, code);
@@ -118,16 +151,34 @@ int CBWhiteListShort::correct(std::string & bc, AlignSummary::bint & index) cons
     uint64_t code = 0;
     bool res = seq2int<gwsc::ADNA4, uint64_t>(bc, code);
     if(!res) return 1;
+    int ret = correct_code(code, bc.size(), index);
+    if(ret == 2){
+        // Correct the barcode string
+        bc = barcode(index);
+    }
+    return ret;
+}
+
+int CBWhiteListShort::correct_code(uint64_t & code, unsigned int len, AlignSummary::bint & index) const {
     auto it = hash_.find(code);
     if(it != hash_.end()) {
         index = it->second;
         return 0;
     }
 
+    if(indexed_){
+        auto cit = corr_.find(code);
+        if(cit == corr_.end()) return 1;
+        index = cit->second;
+        seq2int<gwsc::ADNA4, uint64_t>(barcodes_[index], code);
+        return 2;
+    }
+
     //Need to try every combination of mismatch
     unsigned int maxc = 0;
+    uint64_t mcode = code;
     index = 0;
-    for(size_t i = 0; i < bc.size(); i++){
+    for(size_t i = 0; i < len; i++){
         uint64_t mask = code & ~getmask<uint64_t>(i, 2);
         //Zero out the two bits for base i
         for(uint64_t b = 0; b < 4; b++){
@@ -137,15 +188,100 @@ int CBWhiteListShort::correct(std::string & bc, AlignSummary::bint & index) cons
             if(it != hash_.end() && counts_[it->second] > maxc){
                 maxc = counts_[it->second];
                 index = it->second;
+                mcode = m;
             }
         }
     }
-    if(maxc > 0){
-        // Correct the barcode string
-        bc = barcode(index);
+    code = mcode;
+    return maxc > 0 ? 2 : 1;
+}
+
+// True if a would be picked over b when correcting code, the highest count wins and ties
+// go to the first candidate in the order correct_code tries them
+bool CBWhiteListShort::better_(AlignSummary::bint a, AlignSummary::bint b, uint64_t code) const {
+    if(counts_[a] != counts_[b]) return counts_[a] > counts_[b];
+    uint64_t ca = 0, cb = 0;
+    seq2int<gwsc::ADNA4, uint64_t>(barcodes_[a], ca);
+    seq2int<gwsc::ADNA4, uint64_t>(barcodes_[b], cb);
+    unsigned int ia = 0, ib = 0;
+    while(((ca ^ code) >> (ia * 2) & 0x3) == 0) ia++;
+    while(((cb ^ code) >> (ib * 2) & 0x3) == 0) ib++;
+    if(ia != ib) return ia < ib;
+    return ((ca >> (ia * 2)) & 0x3) < ((cb >> (ib * 2)) & 0x3);
+}
+
+uint64_t CBWhiteListShort::counts_total_() const {
+    uint64_t total = 0;
+    for(auto c : counts_) total += c;
+    return total;
+}
+
+void CBWhiteListShort::build_correction() {
+    corr_.clear();
+    for(AlignSummary::bint idx = 0; idx < barcodes_.size(); idx++){
+        // correct_code never picks a barcode without reads
+        if(counts_[idx] == 0) continue;
+        const std::string & bc = barcodes_[idx];
+        uint64_t code = 0;
+        seq2int<gwsc::ADNA4, uint64_t>(bc, code);
+        for(size_t i = 0; i < bc.size(); i++){
+            uint64_t mask = code & ~getmask<uint64_t>(i, 2);
+            for(uint64_t b = 0; b < 4; b++){
+                uint64_t m = mask | (b << (i * 2));
+                if(m == code || hash_.find(m) != hash_.end()) continue;
+                auto res = corr_.insert(std::make_pair(m, idx));
+                if(!res.second && better_(idx, res.first->second, m)){
+                    res.first->second = idx;
+                }
+            }
+        }
     }
+    indexed_ = true;
+    tout << "Built a barcode correction index with " << corr_.size() << " one mismatch barcodes\n";
+}
 
-    return maxc > 0 ? 2 : 1;
+void CBWhiteListShort::write_correction(const std::string & out) const {
+    gzFile zout = gzopen(out.c_str(), "wb");
+    if(zout == NULL){
+        std::cout << "Could not open " << out << " for writing\n";
+        exit(1);
+    }
+    uint64_t header[3] = {barcodes_.size(), counts_total_(), corr_.size()};
+    gzwrite(zout, reinterpret_cast<const char*>(header), sizeof(header));
+    for(auto const & c : corr_){
+        gzwrite(zout, reinterpret_cast<const char*>(&c.first), sizeof(c.first));
+        gzwrite(zout, reinterpret_cast<const char*>(&c.second), sizeof(c.second));
+    }
+    gzclose(zout);
+    tout << "Wrote barcode correction index to " << out << "\n";
+}
+
+bool CBWhiteListShort::load_correction(const std::string & in) {
+    gzFile zin = gzopen(in.c_str(), "rb");
+    if(zin == NULL) return false;
+    uint64_t header[3] = {0, 0, 0};
+    gzread(zin, reinterpret_cast<char*>(header), sizeof(header));
+    if(header[0] != barcodes_.size() || header[1] != counts_total_()){
+        tout << "Ignoring " << in << ", it was built from different barcode counts\n";
+        gzclose(zin);
+        return false;
+    }
+    corr_.clear();
+    corr_.reserve(header[2]);
+    for(uint64_t i = 0; i < header[2]; i++){
+        uint64_t code = 0;
+        AlignSummary::bint idx = 0;
+        if(gzread(zin, reinterpret_cast<char*>(&code), sizeof(code)) != sizeof(code) ||
+                gzread(zin, reinterpret_cast<char*>(&idx), sizeof(idx)) != sizeof(idx) || idx >= barcodes_.size()){
+            std::cout << "Error! Truncated barcode correction index " << in << "\n";
+            exit(1);
+        }
+        corr_[code] = idx;
+    }
+    gzclose(zin);
+    indexed_ = true;
+    tout << "Loaded " << corr_.size() << " one mismatch barcodes from " << in << "\n";
+    return true;
 }
 
 void CBWhiteListShort::write(const std::string & out) const {
@@ -25,6 +25,7 @@ SOFTWARE.
 #include "task_log.hpp"
 #include "gzstream.hpp"
 #include "aux.hpp"
+#include "base_track.hpp"
 #include <fstream>
 #include <locale>
 
@@ -136,6 +137,8 @@ void TXIndexBuild::build(const std::string & ref, const std::string & gtf, unsig
     zout_genes << "ref\ttid\tgid\tgene_id\tgene_name\tlft\trgt\tstrand\tintrons\tilfts\tirgts\n";
 
     std::ofstream lout(prefix_ + "_lenghts.txt");
+    // 2 bit packed copy of the genome that collapse, pileup and accuracy memory map
+    GenomeStoreWriter gout(prefix_ + "_genome.bin");
     std::vector<Block> exons;
     while(far.read(fa)){
         size_t total_transcripts = 0, bases = 0, total_retained = 0, total_short = 0;
@@ -143,6 +146,7 @@ void TXIndexBuild::build(const std::string & ref, const std::string & gtf, unsig
         size_t total_genes = 0, rbases = 0;
         auto it = gm.chroms.find(fa.name);
         lout << fa.name << "\t" << fa.seq.size() << "\t" << fa.comment << "\n";
+        gout.add(fa.name, fa.seq.str());
         if(it == gm.chroms.end()) {
             tid++;
             continue;
@@ -209,6 +213,17 @@ void TXIndexBuild::build(const std::string & ref, const std::string & gtf, unsig
     gzclose(zout);
     zout_tx.close();
     zout_genes.close();
+    gout.close();
+    lout.close();
+
+    tout << "Building the base annotation track\n";
+    {
+        TXIndex idx;
+        idx.load(prefix_);
+        BaseTrack track;
+        track.build(idx);
+        track.write(prefix_ + "_btypes.bin");
+    }
     size_t ttotal = 0;
 
     tout << "Done bases = " << wbases << ", kept genes = " << gid  << " out of " << (gid + fgenes) 
@@ -80,6 +80,10 @@ extern "C" {
 	bwt_t *bwa_idx_load_bwt(const char *hint);
 
 	bwaidx_t *bwa_idx_load_from_shm(const char *hint);
+	int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn);
+	int bwa_shm_test(const char *hint);
+	int bwa_shm_list(void);
+	int bwa_shm_destroy(void);
 	bwaidx_t *bwa_idx_load_from_disk(const char *hint, int which);
 	bwaidx_t *bwa_idx_load(const char *hint, int which);
 	void bwa_idx_destroy(bwaidx_t *idx);
@@ -1077,11 +1077,30 @@ void mem_reg2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac,
 	}
 }
 
+void *mem_aux_init(void)
+{
+	return smem_aux_init();
+}
+
+void mem_aux_destroy(void *buf)
+{
+	smem_aux_destroy((smem_aux_t*)buf);
+}
+
 mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf)
 {
+	mem_alnreg_v regs;
+	kv_init(regs);
+	mem_align1_core_v(opt, bwt, bns, pac, l_seq, seq, buf, &regs);
+	return regs;
+}
+
+void mem_align1_core_v(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf, mem_alnreg_v *av)
+{ // same as mem_align1_core() but appends to av after clearing it so its storage can be reused
 	int i;
 	mem_chain_v chn;
-	mem_alnreg_v regs;
+	mem_alnreg_v regs = *av;
+	regs.n = 0;
 
 	for (i = 0; i < l_seq; ++i) // convert to 2-bit encoding if we have not done so
 		seq[i] = seq[i] < 4? seq[i] : nst_nt4_table[(int)seq[i]];
@@ -1091,7 +1110,6 @@ mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntse
 	mem_flt_chained_seeds(opt, bns, pac, l_seq, (uint8_t*)seq, chn.n, chn.a);
 	if (bwa_verbose >= 4) mem_print_chain(bns, &chn);
 
-	kv_init(regs);
 	for (i = 0; i < chn.n; ++i) {
 		mem_chain_t *p = &chn.a[i];
 		if (bwa_verbose >= 4) err_printf("* ---> Processing chain(%d) <---\n", i);
@@ -1112,11 +1130,16 @@ mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntse
 		if (p->rid >= 0 && bns->anns[p->rid].is_alt)
 			p->is_alt = 1;
 	}
-	return regs;
+	*av = regs;
 }
 
 mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const char *query_, const mem_alnreg_t *ar)
 {
+	return mem_reg2aln_q(opt, bns, pac, l_query, query_, ar, 0);
+}
+
+mem_aln_t mem_reg2aln_q(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const char *query_, const mem_alnreg_t *ar, uint8_t *qbuf)
+{ // qbuf, if not NULL, must hold at least l_query bytes and is used instead of a temporary allocation
 	mem_aln_t a;
 	int i, w2, tmp, qb, qe, NM, score, is_rev, last_sc = -(1<<30), l_MD;
 	int64_t pos, rb, re;
@@ -1129,7 +1152,7 @@ mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *
 	}
 	qb = ar->qb, qe = ar->qe;
 	rb = ar->rb, re = ar->re;
-	query = malloc(l_query);
+	query = qbuf? qbuf : malloc(l_query);
 	for (i = 0; i < l_query; ++i) // convert to the nt4 encoding
 		query[i] = query_[i] < 5? query_[i] : nst_nt4_table[(int)query_[i]];
 	a.mapq = ar->secondary < 0? mem_approx_mapq_se(opt, ar) : 0;
@@ -1183,7 +1206,7 @@ mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *
 	a.pos = pos - bns->anns[a.rid].offset;
 	a.score = ar->score; a.sub = ar->sub > ar->csub? ar->sub : ar->csub;
 	a.is_alt = ar->is_alt; a.alt_sc = ar->alt_sc;
-	free(query);
+	if (qbuf == 0) free(query);
 	return a;
 }
 
@@ -191,6 +191,36 @@ extern "C" {
 	 */
 	mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_seq, const char *seq, const mem_alnreg_t *ar);
 	mem_aln_t mem_reg2aln2(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_seq, const char *seq, const mem_alnreg_t *ar, const char *name);
+	mem_aln_t mem_reg2aln_q(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_seq, const char *seq, const mem_alnreg_t *ar, uint8_t *qbuf);
+
+	/**
+	 * Reusable per-thread scratch space for mem_align1_buf() and mem_reg2aln_buf()
+	 *
+	 * Holds the SMEM collection buffers and a query copy so repeated calls on one
+	 * thread do not allocate and free them for every read.
+	 */
+	typedef struct {
+		void    *aux;   // smem_aux_t
+		char    *seq;   // 2-bit copy of the query
+		int      m_seq;
+	} mem_buf_t;
+
+	mem_buf_t *mem_buf_init(void);
+	void mem_buf_destroy(mem_buf_t *buf);
+	void *mem_aux_init(void);
+	void mem_aux_destroy(void *buf);
+	void mem_align1_core_v(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf, mem_alnreg_v *av);
+
+	/**
+	 * Same as mem_align1() but uses the scratch space in buf and writes the regions
+	 * into ar, reusing its storage. ar must be zero initialized or from a previous call.
+	 */
+	void mem_align1_buf(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, const char *seq, mem_buf_t *buf, mem_alnreg_v *ar);
+
+	/**
+	 * Same as mem_reg2aln() but converts the query into the scratch space in buf
+	 */
+	mem_aln_t mem_reg2aln_buf(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_seq, const char *seq, const mem_alnreg_t *ar, mem_buf_t *buf);
 
 	/**
 	 * Infer the insert size distribution from interleaved alignment regions
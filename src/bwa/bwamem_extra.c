@@ -113,6 +113,46 @@ mem_alnreg_v mem_align1(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *
 	return ar;
 }
 
+mem_buf_t *mem_buf_init(void)
+{
+	mem_buf_t *b;
+	b = calloc(1, sizeof(mem_buf_t));
+	b->aux = mem_aux_init();
+	return b;
+}
+
+void mem_buf_destroy(mem_buf_t *b)
+{
+	if (b == 0) return;
+	mem_aux_destroy(b->aux);
+	free(b->seq);
+	free(b);
+}
+
+static inline void mem_buf_reserve(mem_buf_t *b, int l_seq)
+{
+	if (l_seq > b->m_seq) {
+		b->m_seq = l_seq;
+		kroundup32(b->m_seq);
+		b->seq = realloc(b->seq, b->m_seq);
+	}
+}
+
+void mem_align1_buf(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, const char *seq_, mem_buf_t *b, mem_alnreg_v *ar)
+{
+	extern void mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
+	mem_buf_reserve(b, l_seq);
+	memcpy(b->seq, seq_, l_seq);
+	mem_align1_core_v(opt, bwt, bns, pac, l_seq, b->seq, b->aux, ar);
+	mem_mark_primary_se(opt, ar->n, ar->a, lrand48());
+}
+
+mem_aln_t mem_reg2aln_buf(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const char *query_, const mem_alnreg_t *ar, mem_buf_t *b)
+{
+	mem_buf_reserve(b, l_query);
+	return mem_reg2aln_q(opt, bns, pac, l_query, query_, ar, (uint8_t*)b->seq);
+}
+
 static inline int get_pri_idx(double XA_drop_ratio, const mem_alnreg_t *a, int i)
 {
 	int k = a[i].secondary_all;
@@ -238,7 +238,7 @@ void CollapseWorker::collapse_umi_(){
         }
 
         bam1_t * bf = umis_[islands_[0]->contigs[0]->index]->b;
-        auto & ref = genome_[bf->core.tid];
+        int32_t rtid = bf->core.tid;
         unsigned int lft = islands_[0]->lft;
         unsigned int qlft = 0;
         //std::string rstr, qstr, astr;
@@ -252,7 +252,7 @@ void CollapseWorker::collapse_umi_(){
                 case Cigar::MATCH:
                     bases += c.len;
                     for(size_t i = 0; i < c.len; i++, lft++, qlft++){
-                        NM += (ref.seq[lft] != fbases_[qlft]);
+                        NM += (genome_.base(rtid, lft) != fbases_[qlft]);
                         //rstr.push_back(ref.seq[lft]);
                         //qstr.push_back(fbases_[qlft]);
                         //astr.push_back(fbases_[qlft] == ref.seq[lft] ? '|' : '*');
@@ -25,12 +25,16 @@ SOFTWARE.
 #include <stdlib.h>
 using namespace gwsc;
 
-void GenomeAlign::load(const std::string & prefix, unsigned int min_overhang) {
+void GenomeAlign::load(const std::string & prefix, unsigned int min_overhang, bool shm) {
     args_ = mem_opt_init();
     args_->b = ascore.mismatch;
     args_->a = ascore.match;
     bwa_fill_scmat(args_->a, args_->b, args_->mat);
-    bidx_ = bwa_idx_load(prefix.c_str(), BWA_IDX_ALL);
+    if(shm){
+        bidx_ = bwa_idx_load_from_shm(prefix.c_str());
+        if(bidx_ == nullptr) std::cout << "Index " << prefix << " is not in shared memory, loading it from disk\n";
+    }
+    if(bidx_ == nullptr) bidx_ = bwa_idx_load(prefix.c_str(), BWA_IDX_ALL);
     min_overhang_ = min_overhang;
     if(bidx_ == nullptr) {
         std::cout << "Index load failed\n";
@@ -48,25 +52,22 @@ void GenomeAlign::load(const std::string & prefix, unsigned int min_overhang) {
 }
 
 
-void GenomeAlign::align(AlignGroup & ad, const std::string & seq, unsigned int len) const {
+void GenomeAlign::align(AlignGroup & ad, const ArenaStr & seq, unsigned int len, mem_buf_t * buf) const {
     ad.genome_score = 0;
-    ad.genome_ar = mem_align1(args_, bidx_->bwt, bidx_->bns, bidx_->pac, len, seq.c_str());
-    if(ad.genome_ar.n <= 0 || ad.genome_ar.a[0].score < static_cast<int>(ascore.min_score)){
-        free(ad.genome_ar.a);
-        ad.genome_ar.a = NULL;
+    mem_align1_buf(args_, bidx_->bwt, bidx_->bns, bidx_->pac, len, seq.c_str(), buf, &ad.genome_ar);
+    if(ad.genome_ar.n == 0 || ad.genome_ar.a[0].score < static_cast<int>(ascore.min_score)){
         ad.genome_ar.n = 0;
-        ad.genome_ar.m = 0;
         return;
     }
-    
+
     ad.genome_score = ad.genome_ar.a[0].score;
 }
 
-void GenomeAlign::get(AlignGroup & ad, size_t i, const std::string & seq, unsigned int len) const {
+void GenomeAlign::get(AlignGroup & ad, size_t i, const ArenaStr & seq, unsigned int len, mem_buf_t * buf) const {
     auto & ar = ad.genome_ar;
     assert(i < ar.n);
     mem_aln_t a;
-    a = mem_reg2aln(args_, bidx_->bns, bidx_->pac, len, seq.c_str(), &ar.a[i]);
+    a = mem_reg2aln_buf(args_, bidx_->bns, bidx_->pac, len, seq.c_str(), &ar.a[i], buf);
     //std::cout << "  a.score = " << ar.a[i].score << " a.truesc = " << ar.a[i].truesc << " reg score = " << a.score << "\n";
 
     if((ad.acount + 1) >= ad.alns.size()){
@@ -550,7 +551,7 @@ void rescore_(BWAit rit, AlignData & a, T qlft, mem_opt_t * args_, bool check, c
     a.NM = NM;
 }
 
-void GenomeAlign::verify(AlignData & a, const std::string & seq, const std::string & msg) const {
+void GenomeAlign::verify(AlignData & a, const ArenaStr & seq, const std::string & msg) const {
     //auto ref = bidx_->bns->anns[a.tid];
     //auto offset = ref.offset;
     //auto pacseq = bidx_->pac;
@@ -568,7 +569,7 @@ void GenomeAlign::verify(AlignData & a, const std::string & seq, const std::stri
     }
 
 }
-void GenomeAlign::rescore(AlignData & a, const std::string & seq) const {
+void GenomeAlign::rescore(AlignData & a, const ArenaStr & seq) const {
     //auto ref = bidx_->bns->anns[a.tid];
     //auto offset = ref.offset;
     //auto pacseq = bidx_->pac;
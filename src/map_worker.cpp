@@ -28,31 +28,53 @@ void MapWorker::operator()() {
     unsigned int N = in_(rps_, reads_, counts);
     while(N > 0){
         for(size_t i = 0; i < N; i++){
-            map_(reads_[i]);
-            if(data.countable){
-                aligns.push_back(data.summary);
+            pending_[i] = prepare_(i, batch[i]);
+        }
+
+        // Align the whole step to the transcriptome and then the genome so each index stays in cache
+        for(size_t i = 0; i < N; i++){
+            if(pending_[i]) tx_align->align(batch[i], reads_.tag(i), reads_[i].tend, abuf_);
+        }
+        for(size_t i = 0; i < N; i++){
+            genome_[i] = false;
+            if(!pending_[i]) continue;
+            genome_[i] = gpolicy_ == GENOME_ALWAYS || 
+                (gpolicy_ == GENOME_FALLBACK && !tx_align->conclusive(batch[i], reads_[i].tend));
+            if(genome_[i]){
+                genome_align->align(batch[i], reads_.tag(i), reads_[i].tend, abuf_);
+                genome_aligned++;
+            }else{
+                genome_avoided++;
             }
+        }
 
-            if(write_bam_){
-                bout->write(data, reads_[i], buff, rcount, *tx_idx);
+        for(size_t i = 0; i < N; i++){
+            auto & data = batch[i];
+            if(pending_[i]){
+                classify_(i, data);
+                if(!genome_[i]) avoided_counts[data.res]++;
             }
-            /*
-            if(data.res == AlignGroup::CDNA){
-                std::sort(data.alns.begin(), data.alns.begin() + data.acount);
-                for(size_t i = 0; i < data.acount; i++){
-                    auto & a = data.alns[i];
-                    std::cout << "  " << i << " " << a.print() << "\n";
-                }
-                std::cout << "\n";
+            if(data.countable){
+                aligns[align_bucket(data.summary.barcode, aligns.size())].push_back(data.summary);
+                held_++;
+            }
+
+            if(write_bam_ && (write_empty || data.res != AlignGroup::EMPTY_DROPLET)){
+                bout->write(data, reads_.view(i), buff, rcount, *tx_idx);
             }
-            */
             //std::cout << "  " << reads_[i].name << " res = " << AlignGroup::alignres2str(data.res) << " tag = " << reads_[i].tag << "\n";
         }
+        if(spill_limit > 0 && held_ >= spill_limit) spill_();
         N = in_(rps_, reads_, counts);
         std::fill(counts.begin(), counts.end(), 0);
     }
 }
 
+void MapWorker::spill_() {
+    runs.push_back(write_align_run(spill_prefix + "_" + std::to_string(runs.size()) + ".bin", aligns));
+    held_ = 0;
+}
+
 /*
 int find_poly(const std::string & tag, char target){
     char lb = ' ';
@@ -104,39 +126,48 @@ int find_poly(const std::string & tag, char target){
 }
 */
 
-void MapWorker::map_(Read & read){
+bool MapWorker::prepare_(size_t i, AlignGroup & data){
     data.reset();
+    auto & read = reads_[i];
     AlignSummary::bint barcode_index = 0;
-    uint32_t umi_encoded = 0;
-    int res = bc_(read.barcode, barcode_index);
-    //std::cout << read.name << "\n";
+    // The reader already packed the barcode, an N fails without a lookup
+    uint64_t bcode = read.barcode_code;
+    int res = read.barcode_ok ? bc_(bcode, reads_.barcode_len(), barcode_index) : 1;
     if(res == 1){
         counts[AlignGroup::BARCODE_FAIL]++;
         data.res = AlignGroup::BARCODE_FAIL;
-        return;
+        return false;
     }
 
     //std::cout << "  Barcode Passed = " << read.barcode << " res = " << res << " Barcode index = " << barcode_index << "\n";
 
     if(res == 2) {
+        reads_.set_barcode(i, bcode);
         barcode_corrected++;
         bc_rates[barcode_index][AlignGroup::BARCODE_FAIL]++;
     }else{
         barcode_correct++;
     }
 
+    if(cells != nullptr && !(*cells)[barcode_index]){
+        bc_rates[barcode_index][AlignGroup::EMPTY_DROPLET]++;
+        counts[AlignGroup::EMPTY_DROPLET]++;
+        data.res = AlignGroup::EMPTY_DROPLET;
+        return false;
+    }
+
     //Check the UMI
-    if(!seq2int<gwsc::ADNA4, uint32_t>(read.umi, umi_encoded) || 
-            read.umi.find_first_not_of(read.umi[0]) == std::string::npos){
+    if(!read.umi_ok){
         bc_rates[barcode_index][AlignGroup::UMI_FAIL]++;
         counts[AlignGroup::UMI_FAIL]++;
         data.res = AlignGroup::UMI_FAIL;
-        return;
+        return false;
     }
 
     //std::cout << "  UMI Passed\n";
 
-    int end = read.tag.size() - 1;
+    ArenaStr tag = reads_.tag(i);
+    int end = tag.size() - 1;
     if(smode_ == StrandMode::TAG_REV){
         /*
         if(internal_){
@@ -144,7 +175,7 @@ void MapWorker::map_(Read & read){
             if(end < ((int)read.tag.size() - 1)) itrimmed++;
         }
         */
-        while(end >= 0 && read.tag[end] == 'T'){
+        while(end >= 0 && tag[end] == 'T'){
             end--;
         }
     }else{
@@ -154,21 +185,21 @@ void MapWorker::map_(Read & read){
             if(end < ((int)read.tag.size() - 1)) itrimmed++;
         }
          */
-        while(end >= 0 && read.tag[end] == 'A'){
+        while(end >= 0 && tag[end] == 'A'){
             end--;
         }
     }
-    unsigned int N = (read.tag.size() - end - 1);
-    double dust = (max_dust_ >= 0 ? dust_.calculate(read.tag, end + 1) : -1);
+    unsigned int N = (tag.size() - end - 1);
+    double dust = (max_dust_ >= 0 ? dust_.calculate(tag.data(), end + 1) : -1);
     if(N < 6){
-        end = read.tag.size() - 1;
+        end = tag.size() - 1;
     }
 
-    if(N > (read.tag.size() / 2) || (dust > max_dust_)){
+    if(N > (tag.size() / 2) || (dust > max_dust_)){
         data.res = AlignGroup::TAG_FAIL;
         bc_rates[barcode_index][AlignGroup::TAG_FAIL]++;
         counts[AlignGroup::TAG_FAIL]++;
-        return;
+        return false;
     }
 
     //std::cout << read.tag << "\n";
@@ -179,10 +210,15 @@ void MapWorker::map_(Read & read){
 
 
     data.summary.barcode = barcode_index;
-    data.summary.umi = umi_encoded;
+    data.summary.umi = read.umi_code;
     data.summary.gene_id = std::numeric_limits<uint32_t>::max();
-    tx_align->align(data, read.tag, read.tend);
-    genome_align->align(data, read.tag, read.tend);
+    return true;
+}
+
+void MapWorker::classify_(size_t ri, AlignGroup & data){
+    auto & read = reads_[ri];
+    ArenaStr tag = reads_.tag(ri);
+    AlignSummary::bint barcode_index = data.summary.barcode;
     //idx_.align(read.tag, data);
     // times 3 in case we do some end trimming
     int max_score = std::max(data.transcript_score, data.genome_score);
@@ -202,13 +238,13 @@ void MapWorker::map_(Read & read){
     //std::cout << "Max Score = " << max_score << " tend = " << read.tend << "\n";
     for(size_t i = 0; i < data.transcript_ar.n; i++){
         if(data.transcript_ar.a[i].score < max_score || data.transcript_ar.a[i].is_alt) continue;
-        tx_align->get(data, i, read.tag, read.tend);
+        tx_align->get(data, i, tag, read.tend, abuf_);
         //genome_align->verify(data.alns[data.acount - 1], read.tag);
         nmax_score = std::max(nmax_score, data.alns[data.acount - 1].score);
     }
     for(size_t i = 0; i < data.genome_ar.n; i++){
         if(data.genome_ar.a[i].score < max_score || data.genome_ar.a[i].is_alt) continue;
-        genome_align->get(data, i, read.tag, read.tend);
+        genome_align->get(data, i, tag, read.tend, abuf_);
         //genome_align->verify(data.alns[data.acount - 1], read.tag);
         nmax_score = std::max(nmax_score, data.alns[data.acount - 1].score);
     }
@@ -38,7 +38,7 @@ argagg::parser ProgAccuracy::parser() const {
         { "txidx", {"-i", "--index"},
           "scSNV Transcript Index", 1},
         { "reference", {"-r", "--ref"},
-          "Reference Genome File", 1},
+          "Reference genome FASTA or the _genome.bin from scsnv index (Default <index>_genome.bin)", 1},
         { "output", {"-o", "--output"},
           "Output prefix", 1},
         { "snvs", {"-s", "--snvs"},
@@ -78,7 +78,7 @@ void ProgAccuracy::load() {
     threads_ = args_["threads"].as<unsigned int>(1);
     iprefix_ = args_["txidx"].as<std::string>();
     bcin_ = args_["barcodes"].as<std::string>();
-    iref_ = args_["reference"].as<std::string>();
+    iref_ = args_["reference"].as<std::string>("");
     window_ = args_["window"].as<unsigned int>(100);
     lib_ = args_["library"].as<std::string>("V2");
     outp_ = args_["output"].as<std::string>();
@@ -97,15 +97,13 @@ void ProgAccuracy::load() {
 
 
     tout << "Loading the genome\n";
-    {
-        FastaReader fr(iref_);
-        fr.read_all(genome_);
-    }
+    genome_.open(iref_.empty() ? iprefix_ + "_genome.bin" : iref_);
 }
 
 template <typename B>
 inline int ProgAccuracy::run_(){
     idx_.load(iprefix_);
+    btrack_.load(iprefix_, idx_);
     tout << "Loading the index\n";
     read_passed_(B::BARCODE_LEN);
 
@@ -221,7 +219,7 @@ inline int ProgAccuracy::run_(){
         }
 
 
-        IndexProcessor * pp = new IndexProcessor(iname_, p, idx_, genome_, aligners_[0] != 'D', bam_, bchash_, barcodes_.size(), aligners_[0] != 'G');
+        IndexProcessor * pp = new IndexProcessor(iname_, p, idx_, genome_, btrack_, aligners_[0] != 'D', bam_, bchash_, barcodes_.size(), aligners_[0] != 'G');
         pp->make_targets(data.snvs);
         pp->worker().set_params(min_alternative_, min_qual_, min_barcodes_, min_edge_, splice_win_, min_af_, &pp->targets());
         data.processors[i] = pp;
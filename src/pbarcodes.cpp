@@ -31,6 +31,10 @@ argagg::parser ProgBarcodes::parser() const {
           "Barcode count output file", 1},
         { "library", {"-l", "--library"},
           "libary type (V2, V3)", 1},
+        { "threads", {"-t", "--threads"},
+          "Number of fastq files to count at once", 1},
+        { "index", {"-x", "--correct-index"},
+          "Also write a one mismatch barcode correction index for map", 0},
         { "help", {"-h", "--help"},
           "shows this help message", 0},
       }};
@@ -38,13 +42,15 @@ argagg::parser ProgBarcodes::parser() const {
 }
 
 std::string ProgBarcodes::usage() const {
-    return "scsnv count -k known_barcodes.txt -o barcodes.gz <fastq folder 1> <fastq folder 2> ...";
+    return "scsnv count -k known_barcodes.txt -o barcodes.gz -t 4 <fastq folder 1> <fastq folder 2> ...";
 }
 
 void ProgBarcodes::load() {
     known_ = args_["known"].as<std::string>("");
     out_ = args_["out"].as<std::string>();
     lib_type_ = args_["library"].as<std::string>("V2");
+    correct_index_ = args_["index"];
+    threads_ = std::max(1U, args_["threads"].as<unsigned int>(1));
     if(args_.pos.size() == 0){
         throw std::runtime_error("Missing fastq folder argument(s)");
     }
@@ -24,6 +24,7 @@ SOFTWARE.
 #include "gzstream.hpp"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
 #include "collapse_worker.hpp"
+#include "collapse_queue.hpp"
 #include <list>
 #include <thread>
 #include <algorithm>
@@ -34,7 +35,7 @@ using namespace gwsc;
 void ProgCollapse::load() {
     index_ = args_["txidx"].as<std::string>();
     out_ = args_["out"].as<std::string>();
-    ref_ = args_["reference"].as<std::string>();
+    ref_ = args_["reference"].as<std::string>("");
     lib_type_ = args_["library"].as<std::string>("V2");
     bam_write_threads_ = args_["bam_write"].as<unsigned int>(1);
     threads_ = args_["threads"].as<unsigned int>(1);
@@ -45,10 +46,7 @@ void ProgCollapse::load() {
     }
 
     tout << "Loading the genome\n";
-    {
-        FastaReader fr(ref_);
-        fr.read_all(genome_);
-    }
+    genome_.open(ref_.empty() ? index_ + "_genome.bin" : ref_);
 
     bam_file_ = args_.pos[0];
 }
@@ -70,46 +68,85 @@ int ProgCollapse::run_wrap_(){
     CollapsedBamWriter bout(out_, bam_write_threads_, br.header());
     BamOutputBuffer cbuffer;
 
-    BamBuffer * rbuffer = new BamBuffer();
-    unsigned int t = 0;
     CollapseWorker::cb_bhash cbhash = std::bind(&T::LibraryBarcode::bid, &bc, std::placeholders::_1);
 
-    std::list<CollapseWorker> threads;
-
-
-    //CollapseWorker cw(umi_map, ghash, cbhash, T::UMI_LEN, cbuffer);
-    //cw.set_buffer(rbuffer);
-
+    std::list<CollapseWorker> workers;
     for(size_t i = 0; i < threads_; i++){
-        threads.emplace_back(cbuffer, genome_);
-        threads.back().set_callback(cbhash);
+        workers.emplace_back(cbuffer, genome_);
+        workers.back().set_callback(cbhash);
     }
 
-    bool started = false;
+    // A fixed pool of gene group tasks bounds how far the reader can run ahead of the workers
+    std::list<CollapseTask> tasks(threads_ + 2);
+    CollapseQueue free_q, work_q;
+    CollapseOrder done_q;
+    for(auto & t : tasks) free_q.push(&t);
+
+    std::thread reader([&](){
+        size_t seq = 0;
+        CollapseTask * task;
+        while((task = free_q.pop()) != nullptr){
+            if(br.read_genes(task->buffer, 1) == 0) break;
+            task->seq = seq++;
+            work_q.push(task);
+        }
+        work_q.close();
+        done_q.close(seq);
+    });
+
+    std::list<std::thread> threads;
+    for(auto & w : workers){
+        threads.emplace_back([&work_q, &done_q](CollapseWorker & w){
+            CollapseTask * task;
+            while((task = work_q.pop()) != nullptr){
+                unsigned int total = w.total, ambig = w.ambig, rlost = w.rlost, rreads = w.rreads;
+                unsigned int rdups = w.rdups, rcollapsed = w.rcollapsed, creads = w.creads;
+                w.set_buffer(&task->buffer);
+                w();
+                task->total = w.total - total;
+                task->ambig = w.ambig - ambig;
+                task->rlost = w.rlost - rlost;
+                task->rreads = w.rreads - rreads;
+                task->rdups = w.rdups - rdups;
+                task->rcollapsed = w.rcollapsed - rcollapsed;
+                task->creads = w.creads - creads;
+                task->collapsed.assign(w.collapsed.begin(), w.collapsed.begin() + w.ccount);
+                w.collapsed.erase(w.collapsed.begin(), w.collapsed.begin() + w.ccount);
+                w.ccount = 0;
+                done_q.push(task);
+            }
+        }, std::ref(w));
+    }
 
+    bool started = false;
     unsigned int total = 0, ambig = 0, rlost = 0, rreads = 0, rdups = 0, rcollapsed = 0, creads = 0;
     unsigned int lreads = 0;
-    //unsigned int t2 = 0, t3 = 0, t4 = 0;
-    //int lnum = -1;
-    while((t = br.read_genes(*rbuffer, threads_)) > 0){
-        for(auto & t : threads){
-            t.start(rbuffer);
-        }
-        total = 0; ambig = 0; rlost = 0; rreads = 0; rdups = 0; rcollapsed = 0; creads = 0;
-        for(auto & t : threads){
-            t.join();
-            total += t.total;
-            ambig += t.ambig;
-            rlost += t.rlost;
-            rreads += t.rreads;
-            rdups += t.rdups;
-            rcollapsed += t.rcollapsed;
-            creads += t.creads;
-        }
+    std::vector<BamDetail*> pending;
+
+    // Groups come back in read order, so handing them to the writer in batches keeps the output sorted
+    auto flush = [&](){
+        if(started) bout.join();
+        cbuffer.ret(bout.collapsed);
+        bout.collapsed.swap(pending);
+        bout.start();
+        started = true;
+    };
+
+    CollapseTask * task;
+    while((task = done_q.pop()) != nullptr){
+        total += task->total;
+        ambig += task->ambig;
+        rlost += task->rlost;
+        rreads += task->rreads;
+        rdups += task->rdups;
+        rcollapsed += task->rcollapsed;
+        creads += task->creads;
+        pending.insert(pending.end(), task->collapsed.begin(), task->collapsed.end());
+        task->collapsed.clear();
+        free_q.push(task);
 
         if((rreads - lreads) > 500000){
             tout << "Processed " << rreads << " reads from " << total << " groups,"
-                //<< " PCR Dups = " << std::fixed << std::setprecision(2) << (100.0 * rdups / rreads) << "%,"
                     << " Collapsed = " << std::fixed << std::setprecision(2) << (100.0 * rcollapsed / rreads) << "%,"
                     << " Lost = " << std::fixed << std::setprecision(6) << (100.0 * rlost / rreads) << "%"
                     << " due to " << ambig << " ambiguous groups,"
@@ -118,16 +155,15 @@ int ProgCollapse::run_wrap_(){
             lreads = rreads;
         }
 
-        if(started) bout.join();
-        cbuffer.ret(bout.collapsed);
-        for(auto & t : threads){
-            bout.collapsed.insert(bout.collapsed.end(), t.collapsed.begin(), t.collapsed.begin() + t.ccount);
-            t.collapsed.erase(t.collapsed.begin(), t.collapsed.begin() + t.ccount);
-            t.ccount = 0;
-        }
-        bout.start();
-        started = true;
+        if(pending.size() >= COLLAPSE_WRITE_BATCH) flush();
     }
+    if(!pending.empty()) flush();
+
+    reader.join();
+    for(auto & t : threads) t.join();
+
+    tout << "Reader waited " << std::fixed << std::setprecision(2) << free_q.wait() << " sec for free buffers, workers waited "
+        << work_q.wait() << " sec for gene groups\n";
 
     //std::cout << "t = " << t2 << " rb count = " << t3 << " buff total " << t4
     //    << " br total = " << br.total() << " bm total = " << br.mtotal() << "\n";
@@ -149,7 +185,6 @@ int ProgCollapse::run_wrap_(){
 
     if(started) bout.join();
     bout.close();
-    delete rbuffer;
 
     return EXIT_SUCCESS;
 }
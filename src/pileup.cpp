@@ -27,10 +27,11 @@ using namespace gwsc;
 using namespace std;
 
 
-void Pileup::build_reads(BamBuffer::rpair range) {
+void Pileup::build_reads(BamBuffer::rpair range, const std::vector<uint32_t> * slots) {
     count_ = 0;
     idx_ = 0;
-    for(auto it = range.first; it != range.second; it++){
+    size_t i = 0;
+    for(auto it = range.first; it != range.second; it++, i++){
         if((count_ + 1) >= reads_.size()){
             for(size_t i = 0; i < 16; i++){
                 reads_.push_back(new PileupRead());
@@ -38,7 +39,8 @@ void Pileup::build_reads(BamBuffer::rpair range) {
         }
 
         if((!dups_ && (*it)->dup)) continue;
-        reads_[count_++]->init(*(*it));
+        reads_[count_]->init(*(*it));
+        reads_[count_++]->slot = slots == nullptr ? 0 : (*slots)[i];
     }
 }
 
@@ -117,6 +119,17 @@ void PileupRead::init(BamDetail & d){
         NM = bam_aux2i(ptr);
     }
 
+    cc = bam_aux_get(d.b, "CC");
+    cc_len = (cc == NULL ? 0 : bam_auxB_len(cc));
+    //B/c of read length encoding, should always come in pairs 
+    if((cc_len % 2) != 0){
+        std::cerr << "[Error] Odd length CC tag in read " << bam_get_qname(d.b) << "\n";
+        exit(1);
+    }
+    cc_idx = 0;
+    cc_end = 0;
+    cc_value = 0;
+
     qpositions.clear();
     auto xc = bam_aux_get(d.b, "XC");
     char * mstr = (xc == NULL ? NULL : bam_aux2Z(xc));
@@ -40,7 +40,9 @@ void PileupWorker::operator()() {
 
 void PileupWorker::process_range(BamBuffer::rpair range){
     if(range.first == range.second) return;
-    gids_.clear();
+    slot_map_.clear();
+    sbarcodes_.clear();
+    rslots_.clear();
     //std::cout << "pworker genome address: " << &genome_ << " count = " << (range.second - range.first) << "\n";
 
     for(auto it = range.first; it != range.second; it++){
@@ -66,16 +68,21 @@ void PileupWorker::process_range(BamBuffer::rpair range){
         }else{
             d.pos = d.lft;
         }
-        if(d.gid < std::numeric_limits<uint32_t>::max() && (gids_.empty() || d.gid != gids_.back())) gids_.push_back(d.gid);
+        auto sit = slot_map_.insert(std::make_pair(static_cast<uint32_t>(d.barcode), static_cast<uint32_t>(sbarcodes_.size())));
+        if(sit.second) sbarcodes_.push_back(d.barcode);
+        rslots_.push_back(sit.first->second);
         reads++;
     }
+    if(scounts_.size() < sbarcodes_.size()){
+        scounts_.resize(sbarcodes_.size(), std::array<uint16_t, 8>{});
+        sused_.resize(sbarcodes_.size(), 0);
+    }
     //std::cout << "Pileup " << (range.second - range.first) << " reads \n";
-    unsigned int base_pos_delta = build_genes_();
-
 
-    pup_.build_reads(range);
+    pup_.build_reads(range, &rslots_);
 
     while(pup_.next(out_)){
+        if(windowed_ && (pup_.tid != wtid_ || pup_.pos < wlft_ || pup_.pos > wrgt_)) continue;
         const TargetFinder::Target * target = nullptr;
         if(tloaded_){
             target = targets_.check(pup_.tid, pup_.pos);
@@ -87,7 +94,7 @@ void PileupWorker::process_range(BamBuffer::rpair range){
         });
         */
         pcount++;
-        bcounter_.clear();
+        reset_slots_();
         while(pcount >= positions.size()){
             positions.push_back(PositionCount());
         }
@@ -96,7 +103,7 @@ void PileupWorker::process_range(BamBuffer::rpair range){
         p.reset();
         p.tid = pup_.tid;
         p.pos = pup_.pos;
-        p.ref = genome_[p.tid].seq[p.pos];
+        p.ref = genome_.base(p.tid, p.pos);
         switch(p.ref){
             case 'A': p.refi = 0; break;
             case 'C': p.refi = 1; break;
@@ -127,8 +134,11 @@ void PileupWorker::process_range(BamBuffer::rpair range){
                 }
                 p.coverage++;
                 tmp_umi_coverages.push_back(r.umi_coverage);
-                auto it = bcounter_.insert(std::make_pair(r.d->barcode, std::array<uint16_t, 8>{}));
-                it.first->second[r.base + 4 * r.rev]++;
+                if(!sused_[r.slot]){
+                    sused_[r.slot] = 1;
+                    touched_.push_back(r.slot);
+                }
+                scounts_[r.slot][r.base + 4 * r.rev]++;
             }else{
                 p.ambig++;
             }
@@ -154,9 +164,9 @@ void PileupWorker::process_range(BamBuffer::rpair range){
             unsigned int rc = 0, ac = 0;
             unsigned int mdist = 0;
             char max_nr = 'N';
-            for(auto & b : bcounter_) {
-                bcoverage[b.first]++;
-                bbases[b.first] += std::accumulate(b.second.begin(), b.second.end(), 0);
+            for(auto s : touched_) {
+                bcoverage[sbarcodes_[s]]++;
+                bbases[sbarcodes_[s]] += std::accumulate(scounts_[s].begin(), scounts_[s].end(), 0);
             }
             for(size_t i = 0; i < 4; i++){
                 unsigned int c = p.bases[i].p_count + p.bases[i].m_count;
@@ -179,7 +189,7 @@ void PileupWorker::process_range(BamBuffer::rpair range){
                     max_nr = target->base;
                 }
             }
-            uint16_t bt = 0;
+            uint16_t bt = btrack_.at(p.tid, p.pos);
             char pbase = '-', mbase = '-';
             //unsigned int pidx = 6, midx = 6;
             if(has_plus){
@@ -191,8 +201,7 @@ void PileupWorker::process_range(BamBuffer::rpair range){
                 mbase = 'I';
             }
 
-            if(p.pos >= base_pos_delta && p.pos < (base_pos_delta + btypes_.size())){
-                bt = btypes_[p.pos - base_pos_delta];
+            if(bt != 0){
                 if(has_minus){
                     if((bt & SBaseType::MEXON)){
                         //midx = 0;
@@ -273,64 +282,30 @@ void PileupWorker::process_range(BamBuffer::rpair range){
 }
 
 
-void PileupWorker::count_barcodes_(PositionCount & p){
-    p.barcodes = bcounter_.size();
-    for(auto & b : bcounter_){
-        p.bcounts.push_back(BarcodeCount(b.first));
-        for(size_t i = 0; i < 4; i++){
-            p.bases[i].t_barcodes += (b.second[i] + b.second[i + 4]) > 0;
-            p.bases[i].p_barcodes += b.second[i] > 0;
-            p.bases[i].m_barcodes += b.second[i + 4] > 0;
-            p.pbarcodes += b.second[i] > 0;
-            p.mbarcodes += b.second[i + 4] > 0;
-            p.bcounts.back().pbases[i] += b.second[i];
-            p.bcounts.back().mbases[i] += b.second[i + 4]; 
-            p.bases[i].tar_barcodes += (b.second[i] + b.second[i + 4]) > 0 || (b.second[p.refi] > 0 || b.second[p.refi + 4] > 0);
-            p.bases[i].par_barcodes += (b.second[i] > 0 || b.second[p.refi] > 0);
-            p.bases[i].mar_barcodes += (b.second[i + 4] > 0 || b.second[p.refi + 4] > 0);
-        }
+void PileupWorker::reset_slots_(){
+    for(auto s : touched_){
+        scounts_[s].fill(0);
+        sused_[s] = 0;
     }
+    touched_.clear();
 }
 
-unsigned int PileupWorker::build_genes_(){
-    if(gids_.empty()) return 0;
-    std::sort(gids_.begin(), gids_.end());
-    gids_.erase(std::unique(gids_.begin(), gids_.end()), gids_.end());
-    btypes_.clear();
-
-    unsigned int gl = std::numeric_limits<unsigned int>::max(), gr = 0;
-    for(auto gid : gids_){
-        const auto & g = txidx_.gene(gid);
-        gl = std::min(gl, g.lft);
-        gr = std::max(gr, g.rgt);
-    }
-    btypes_.resize(gr - gl + 1);
-    for(auto gid : gids_){
-        const auto & g = txidx_.gene(gid);
-        for(auto & intron : g.introns){
-            for(size_t i = intron.lft; i <= intron.rgt; i++){
-                btypes_[i - gl] |= g.strand == '+' ? SBaseType::PINTRON : SBaseType::MINTRON;
-            }
-        }
-
-        for(size_t txid = g.tstart; txid < g.tend; txid++){
-            const auto & t = txidx_.transcript(txid);
-            for(size_t ei = 0; ei < t.exons.size(); ei++){
-                auto const & e = t.exons[ei];
-                for(size_t i = e.lft; i <= e.rgt; i++){
-                    if(t.coding_start > -1 && static_cast<int>(i) < t.coding_start){
-                        btypes_[i - gl] |= t.strand == '+' ? SBaseType::P5UTR : SBaseType::M3UTR;
-                    }else if(t.coding_end > -1 && static_cast<int>(i) > t.coding_end){
-                        btypes_[i - gl] |= t.strand == '+' ? SBaseType::P3UTR : SBaseType::M5UTR;
-                    }else if(t.coding_start > -1){
-                        btypes_[i - gl] |= t.strand == '+' ? SBaseType::PEXON : SBaseType::MEXON;
-                    }else{
-                        btypes_[i - gl] |= t.strand == '+' ? SBaseType::PNC : SBaseType::MNC;
-                    }
-                }
-            }
+void PileupWorker::count_barcodes_(PositionCount & p){
+    p.barcodes = touched_.size();
+    for(auto s : touched_){
+        auto const & counts = scounts_[s];
+        p.bcounts.push_back(BarcodeCount(sbarcodes_[s]));
+        for(size_t i = 0; i < 4; i++){
+            p.bases[i].t_barcodes += (counts[i] + counts[i + 4]) > 0;
+            p.bases[i].p_barcodes += counts[i] > 0;
+            p.bases[i].m_barcodes += counts[i + 4] > 0;
+            p.pbarcodes += counts[i] > 0;
+            p.mbarcodes += counts[i + 4] > 0;
+            p.bcounts.back().pbases[i] += counts[i];
+            p.bcounts.back().mbases[i] += counts[i + 4]; 
+            p.bases[i].tar_barcodes += (counts[i] + counts[i + 4]) > 0 || (counts[p.refi] > 0 || counts[p.refi + 4] > 0);
+            p.bases[i].par_barcodes += (counts[i] > 0 || counts[p.refi] > 0);
+            p.bases[i].mar_barcodes += (counts[i + 4] > 0 || counts[p.refi + 4] > 0);
         }
-
     }
-    return gl;
 }
@@ -26,6 +26,7 @@ SOFTWARE.
 #include "quant_worker.hpp"
 #include "sbam_merge.hpp"
 #include "bam_genes.hpp"
+#include "h5misc.hpp"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "misc.hpp"
@@ -33,7 +34,13 @@ SOFTWARE.
 #include "htslib/htslib/hts.h"
 #include "htslib/htslib/thread_pool.h"
 #include "htslib/htslib/sam.h"
+#include "htslib/htslib/bgzf.h"
 #include "parallel-hashmap/parallel_hashmap/phmap.h"
+#include <atomic>
+#include <thread>
+#include <list>
+#include <sstream>
+#include <iomanip>
 
 using namespace gwsc;
 
@@ -62,7 +69,7 @@ argagg::parser ProgMap::parser() const {
         { "no_bam", {"--no-bam"},
           "Disable writing the sorted bam files of the countable (ie. uniquely mapped reads)", 0},
         { "bam_tmp", {"--bam-tmp"},
-          "Temporary directory to store sorted bam files (Default: {out_prefix}_btmp", 1},
+          "Temporary directory to store sorted bam files and spilled alignment tags (Default: {out_prefix}_btmp)", 1},
         { "cgroups", {"-c", "--count-groups"},
           "Gene Groups for cell quantification", 1},
         { "bam_per_thread", {"--bam-thread"},
@@ -71,6 +78,30 @@ argagg::parser ProgMap::parser() const {
           "Number of output reads per file (Default: 5000000)", 1},
         { "bam_write", {"--bam-write"},
           "Number of writer threads to use when emitting sorted bam files (Default 1)", 1},
+        { "bam_spill", {"--bam-spill"},
+          "Number of background threads that sort and write temporary bam files, each adds a --bam-file sized buffer (Default 1)", 1},
+        { "read_lanes", {"--read-lanes"},
+          "Number of fastq file pairs to read concurrently, each uses two decompression threads (Default 1)", 1},
+        { "genome_align", {"--genome-align"},
+          "When to align reads to the genome: always, fallback (only if the transcriptome hit is not a unique perfect sense match) or never (Default: always)", 1},
+        { "min_cell_reads", {"--min-cell-reads"},
+          "Skip the alignment of barcodes with fewer reads in the barcode counts, they are reported as empty droplets (Default: 0)", 1},
+        { "top_cells", {"--top-cells"},
+          "Only align the barcodes with the most reads in the barcode counts, 0 to disable (Default: 0)", 1},
+        { "write_empty", {"--write-empty"},
+          "Write the reads of skipped barcodes to the bam files as unmapped reads", 0},
+        { "merge_only", {"--merge-only"},
+          "Only merge the temporary bam files of a previous run using its saved UMI correction table", 0},
+        { "max_mem", {"--max-mem"},
+          "Memory budget in GB for the alignment tags, tags beyond it are spilled to sorted runs in the temporary directory (Default: 0 unlimited)", 1},
+        { "shm", {"--shm"},
+          "Attach to BWA indexes staged in shared memory with scsnv shm load (falls back to disk)", 0},
+        { "h5_level", {"--h5-level"},
+          "Deflate level of the HDF5 datasets, 0 disables compression (Default: 6)", 1},
+        { "h5_chunk", {"--h5-chunk"},
+          "Elements per HDF5 dataset chunk (Default: 65536)", 1},
+        { "h5_shuffle", {"--h5-shuffle"},
+          "Byte shuffle the HDF5 chunks before compressing them", 0},
         { "downsample", {"--downsample"}, 
             "Downsample the reads to XX reads, 0 to disable (Default: 0)", 1},
         { "downsample_seed", {"--downsample-seed"}, 
@@ -84,23 +115,53 @@ std::string ProgMap::usage() const {
 }
 
 void ProgMap::load() {
-    tx_idx_ = args_["txidx"].as<std::string>();
-    bc_counts_ = args_["barcodes"].as<std::string>();
     out_prefix_ = args_["output"].as<std::string>();
     lib_type_ = args_["library"].as<std::string>("V2");
     tmp_bam_ = args_["bam_tmp"].as<std::string>("");
-    gene_groups_ = args_["cgroups"].as<std::string>("");
     threads_ = args_["threads"].as<unsigned int>(1);
+    merge_only_ = args_["merge_only"];
+    if(merge_only_){
+        if(tmp_bam_.empty()){
+            tmp_bam_ = out_prefix_ + "_btmp";
+        }
+        return;
+    }
+    tx_idx_ = args_["txidx"].as<std::string>();
+    bc_counts_ = args_["barcodes"].as<std::string>();
+    gene_groups_ = args_["cgroups"].as<std::string>("");
     qthreads_ = args_["qthreads"].as<unsigned int>(1);
+    h5_compression().level = args_["h5_level"].as<unsigned int>(6);
+    h5_compression().chunk = args_["h5_chunk"].as<size_t>(1 << 16);
+    h5_compression().shuffle = args_["h5_shuffle"];
+    h5_compression().threads = std::max(threads_, qthreads_);
     min_overhang_ = args_["overhang"].as<unsigned int>(5);
     dust_ = args_["dust"].as<double>(-1);
     downsample_ = args_["downsample"].as<size_t>(0);
     seed_ = args_["downsample_seed"].as<size_t>(42);
     bam_write_threads_ = args_["bam_write"].as<unsigned int>(1);
+    bam_spill_threads_ = args_["bam_spill"].as<unsigned int>(1);
+    if(bam_spill_threads_ < 1) bam_spill_threads_ = 1;
     bam_ = !args_["no_bam"];
+    shm_ = args_["shm"];
+    read_lanes_ = args_["read_lanes"].as<unsigned int>(1);
+    if(read_lanes_ < 1) read_lanes_ = 1;
+    min_cell_reads_ = args_["min_cell_reads"].as<unsigned int>(0);
+    top_cells_ = args_["top_cells"].as<unsigned int>(0);
+    write_empty_ = args_["write_empty"];
+    std::string gpolicy = args_["genome_align"].as<std::string>("always");
+    if(gpolicy == "always"){
+        gpolicy_ = GENOME_ALWAYS;
+    }else if(gpolicy == "fallback"){
+        gpolicy_ = GENOME_FALLBACK;
+    }else if(gpolicy == "never"){
+        gpolicy_ = GENOME_NEVER;
+    }else{
+        throw std::runtime_error("Unknown --genome-align policy " + gpolicy + " expected always, fallback or never");
+    }
     //internal_ = args_["internal"];
     //write_tags_ = args_["wtags"];
-    if(bam_){
+    max_mem_ = static_cast<size_t>(args_["max_mem"].as<double>(0) * 1024 * 1024 * 1024);
+    if(bam_ || max_mem_ > 0){
         if(tmp_bam_.empty()){
             tmp_bam_ = out_prefix_ + "_btmp";
         }
@@ -108,7 +169,8 @@ void ProgMap::load() {
         if (stat(tmp_bam_.c_str(), &st) == -1) {
             mkdir(tmp_bam_.c_str(), 0700);
         }
-
+    }
+    if(bam_){
         auto bams = glob(tmp_bam_ + "/scsnv_tmp_*.bam");
         if(!bams.empty()){
             tout << "Removing " << bams.size() << " temporary bam files from " << tmp_bam_ << "\n";
@@ -150,6 +212,8 @@ void ProgMap::load() {
     fastqs_ = find_fastq_files(dirs_);
 }
 
+namespace gwsc {
+
 struct BamData{
     BamData(){
         b = bam_init1();
@@ -179,6 +243,22 @@ struct BamData{
     char               ra = 0;
 };
 
+// Read only state shared by the merge threads and their totals
+struct MergeShared {
+    std::vector<std::string>                        bam_files;
+    std::vector<std::vector<BamRegion>>             chunks;
+    std::vector<std::string>                        segments;
+    std::atomic<size_t>                             next{0};
+    const UMICorrectTable                         * table = nullptr;
+    std::unique_ptr<std::atomic<bool>[]>            ccheck;
+    unsigned int                                    umi_len = 0;
+    std::atomic<size_t>                             dups{0};
+    std::atomic<size_t>                             counted{0};
+    std::atomic<size_t>                             discarded{0};
+};
+
+}
+
 size_t process_dups(std::vector<BamData *>::const_iterator start, std::vector<BamData *>::const_iterator end, 
         std::vector<BamData*> & tmp){
     tmp.clear();
@@ -211,6 +291,7 @@ size_t process_dups(std::vector<BamData *>::const_iterator start, std::vector<Ba
 }
 
 void ProgMap::write_progress_(){
+    std::lock_guard<std::mutex> lock(mtx_progress_);
     if((written_ - lwritten_) < 5000000) 
         return;
 
@@ -218,22 +299,152 @@ void ProgMap::write_progress_(){
 
     size_t sec = tout.seconds();
     double ps = 1.0 * written_ / (sec - start_);
+    // The total read count is unknown when only merging
+    if(total_ < written_){
+        tout << "Merged " << written_.load() << " [" << static_cast<int>(ps) << " / sec]\n";
+        return;
+    }
     size_t eta = (total_ - written_) / ps;
     int hours = eta / (60 * 60);
     int minutes = (eta - (hours * 60 * 60)) / 60;
-    tout << "Merged " << written_ << " / " << total_ << " [" << static_cast<int>(ps) << " / sec], ETA = " 
+    tout << "Merged " << written_.load() << " / " << total_ << " [" << static_cast<int>(ps) << " / sec], ETA = " 
         << hours << "h " << minutes << "m\n";
 
 }
 
+// UMI correction and bad UMI marking of a merged read using the integer barcode and gene tags
+static void annotate_merged(BamData & bd, MergeShared & ms, std::string & key){
+    bd.tid = bd.b->core.tid;
+    bd.gid = std::numeric_limits<uint32_t>::max();
+    bd.ra = bam_aux2A(bam_aux_get(bd.b, "RA"));
+    uint8_t * xb = bam_aux_get(bd.b, "xb");
+    if(xb == nullptr){
+        std::cerr << "Error! Temporary bam record without a barcode index\n";
+        exit(1);
+    }
+    bd.barcode = bam_aux2i(xb);
+    bam_aux_del(bd.b, xb);
+    bd.pos = (static_cast<uint64_t>(bd.b->core.pos) << 32) | (bam_endpos(bd.b) - 1);
+    key = bam_aux2Z(bam_aux_get(bd.b, "UB"));
+    seq2int<gwsc::ADNA4, uint32_t>(key, bd.umi);
+
+    if(bd.ra != 'E' && bd.ra != 'N') return;
+    ms.counted++;
+    bd.gid = bam_aux2i(bam_aux_get(bd.b, "XI"));
+    auto & table = *ms.table;
+    size_t slot = table.find(bd.barcode, bd.gid, bd.umi);
+    if(slot != UMICorrectTable::npos && table.corrected(slot)){
+        ms.ccheck[slot] = true;
+        uint32_t mask = (1 << ADNA4::size_) - 1;
+        uint8_t * cumi = bam_aux_get(bd.b, "UB") + 1;
+        uint32_t val = table.umi_to(slot);
+        bd.umi = val;
+        for(size_t i = 0; i < ms.umi_len; i++){
+            cumi[ms.umi_len - i - 1] = ADNA4::alphabet_str_[val & mask];
+            val >>= ADNA4::size_;
+        }
+        bam_aux_append(bd.b, "UR", 'Z', key.length() + 1, reinterpret_cast<uint8_t*>(const_cast<char*>(key.c_str())));
+        slot = table.find(bd.barcode, bd.gid, bd.umi);
+    }
+    if(slot != UMICorrectTable::npos && table.bad(slot)){
+        bd.ra = '?';
+        uint8_t * rptr = bam_aux_get(bd.b, "RA") + 1;
+        (*rptr) = '?';
+        ms.discarded++;
+    }
+}
+
+void ProgMap::write_reads_(BGZF * out, std::vector<BamData*> & reads, size_t n){
+    for(size_t i = 0; i < n; i++){
+        if(bam_write1(out, reads[i]->b) < 0){
+            std::cerr << "Error writing sam\n"; exit(1);
+        }
+    }
+    written_ += n;
+    write_progress_();
+}
+
+void ProgMap::merge_chunks_(MergeShared & ms){
+    BamRegionMerger bm;
+    bm.add_bams(ms.bam_files.begin(), ms.bam_files.end());
+    BamData * next = new BamData;
+    std::vector<BamData*> reads, treads;
+    for(size_t i = 0; i < 20; i++) reads.push_back(new BamData);
+    std::string key;
+    size_t c = 0;
+    while((c = ms.next++) < ms.chunks.size()){
+        BGZF * out = bgzf_open(ms.segments[c].c_str(), "w");
+        if(out == nullptr){
+            std::cerr << "Error opening " << ms.segments[c] << "\n"; exit(1);
+        }
+        for(auto const & r : ms.chunks[c]){
+            bm.set_region(r);
+            // Unmapped reads are copied as is
+            if(r.tid < 0){
+                size_t n = 0;
+                while(bm.next(next->b) != nullptr){
+                    if(bam_write1(out, next->b) < 0){
+                        std::cerr << "Error writing sam\n"; exit(1);
+                    }
+                    if(++n == 100000){
+                        written_ += n;
+                        write_progress_();
+                        n = 0;
+                    }
+                }
+                written_ += n;
+                continue;
+            }
+
+            size_t bidx = 0;
+            int lpos = -1;
+            while(bm.next(next->b) != nullptr){
+                BamData & bd = *next;
+                annotate_merged(bd, ms, key);
+                if(bd.b->core.pos != lpos){
+                    if(bidx > 0){
+                        ms.dups += process_dups(reads.begin(), reads.begin() + bidx, treads);
+                        write_reads_(out, reads, bidx);
+                    }
+                    lpos = bd.b->core.pos;
+                    bidx = 0;
+                }
+                if(bidx >= reads.size()){
+                    for(size_t i = 0; i < 20; i++) reads.push_back(new BamData);
+                }
+                std::swap(reads[bidx], next);
+                bidx++;
+            }
+            if(bidx > 0){
+                ms.dups += process_dups(reads.begin(), reads.begin() + bidx, treads);
+                write_reads_(out, reads, bidx);
+            }
+        }
+        if(bgzf_close(out) < 0){
+            std::cerr << "Error closing " << ms.segments[c] << "\n"; exit(1);
+        }
+    }
+    for(auto r : reads) delete r;
+    delete next;
+}
+
 template <typename T>
 int ProgMap::run_wrap_(){
+    if(merge_only_){
+        UMICorrectTable table;
+        table.load(out_prefix_ + "umi_correct.gz");
+        return merge_bams_(table, T::UMI_LEN);
+    }
     std::vector<std::string> bstrings;
     MapBase<T> base;
     base.load_barcode_counts(bc_counts_, fastqs_);
-    base.load_index(tx_idx_, min_overhang_, genome_idx_);
+    base.load_index(tx_idx_, min_overhang_, genome_idx_, shm_);
+    base.set_genome_policy(gpolicy_);
+    base.set_read_lanes(read_lanes_);
+    base.set_cell_filter(min_cell_reads_, top_cells_, write_empty_);
+    base.set_max_mem(max_mem_, tmp_bam_);
     if(bam_){
-        base.prepare_bam(full_cmd_, bam_per_thread_, bam_per_file_, tmp_bam_, bam_write_threads_);
+        base.prepare_bam(full_cmd_, bam_per_thread_, bam_per_file_, tmp_bam_, bam_write_threads_, bam_spill_threads_);
     }
     base.run(threads_, fastqs_, dust_, internal_, downsample_, seed_);
     base.write_output(out_prefix_);
@@ -244,9 +455,10 @@ int ProgMap::run_wrap_(){
     gwsc::QuantBase qbase;
     qbase.set_index(base.index());
     base.get_barcodes(bstrings);
-    qbase.set_data(base.aligns, bstrings.size());
+    qbase.set_data(base.aligns, base.runs, bstrings.size());
     qbase.build_gene_groups(gene_groups_);
     qbase.run(T::UMI_LEN, qthreads_, bam_, full_cmd_);
+    base.remove_runs();
     qbase.write_output(out_prefix_ + "summary.h5", bstrings, base.brates);
     tout << "Quantification done\n\n";
 
@@ -255,193 +467,85 @@ int ProgMap::run_wrap_(){
         return EXIT_SUCCESS;
     }
 
-    auto & umi_correct = qbase.umi_correct;
-    auto & umi_bad = qbase.umi_bad;
-    std::sort(umi_correct.begin(), umi_correct.end());
-    std::sort(umi_bad.begin(), umi_bad.end());
-    std::vector<uint32_t> bindex(bstrings.size() + 1);
-    std::vector<uint32_t> bad_index(bstrings.size() + 1);
-    for(auto & u : umi_correct) bindex[u.barcode + 1]++;
-    for(auto & u : umi_bad) bad_index[u.barcode + 1]++;
-    for(size_t i = 1; i < bindex.size(); i++) bindex[i] += bindex[i - 1];
-    for(size_t i = 1; i < bad_index.size(); i++) bad_index[i] += bad_index[i - 1];
+    qbase.write_umi_map(out_prefix_ + "umi_correct.gz");
+    return merge_bams_(qbase.umi_table, T::UMI_LEN);
+}
 
+int ProgMap::merge_bams_(const UMICorrectTable & table, unsigned int umi_len){
     tout << "Merging bam files and correcting UMIs\n";
-    tout << "Total UMI corrections " << umi_correct.size() << "\n";
-    tout << "Total bad UMI combinations " << umi_bad.size() << "\n";
-
-    /*
-    if(write_tags_){
-        base.write_tags(out_prefix_ + "align", umi_correct, bindex);
-        qbase.write_umi_map(out_prefix_ + "tag_corrections.gz");
-    }
-    */
-
+    tout << "Total UMI corrections " << table.corrections() << "\n";
+    tout << "Total UMI table keys " << table.size() << " using " << (table.bytes() >> 20) << " MB\n";
 
     start_ = tout.seconds();
 
-    phmap::flat_hash_map<std::string, size_t> bhash;
-    std::vector<bool> ccheck(umi_correct.size());
-    for(size_t i = 0; i < bstrings.size(); i++) bhash[bstrings[i]] = i;
+    MergeShared ms;
+    ms.table = &table;
+    ms.ccheck.reset(new std::atomic<bool>[table.capacity()]());
+    ms.umi_len = umi_len;
+
     std::string  d = tmp_bam_ + "/scsnv_tmp_*.bam";
-    auto bam_files = glob(d);
-    tout << "Found " << bam_files.size() << " bam files to merge\n";
-    BamMerger bm;
-    bm.add_bams(bam_files.begin(), bam_files.end());
+    ms.bam_files = glob(d);
+    tout << "Found " << ms.bam_files.size() << " bam files to merge\n";
+    if(ms.bam_files.empty()){
+        std::cout << "Error! No temporary bam files found in " << tmp_bam_ << "\n";
+        exit(1);
+    }
 
-    tout << "Merging, writing and correcting alignments\n";
-    std::string outf = out_prefix_ + "merged.bam";
-    samFile * bam_out = sam_open(outf.c_str(), "wb");
+    // Each thread merges, corrects and compresses whole chunks of the genome, the compressed
+    // chunks are then concatenated in order behind the header
+    samFile * hin = sam_open(ms.bam_files.front().c_str(), "r");
+    bam_hdr_t * hdr = sam_hdr_read(hin);
+    unsigned int mthreads = std::max(1U, threads_);
+    ms.chunks = partition_bam_regions(hdr, 4 * mthreads);
+    for(size_t i = 0; i < ms.chunks.size(); i++){
+        std::stringstream ss;
+        ss << tmp_bam_ << "/scsnv_merge_" << std::setw(4) << std::setfill('0') << i << ".bam";
+        ms.segments.push_back(ss.str());
+    }
+    tout << "Merging, writing and correcting alignments in " << ms.chunks.size() << " genome chunks on " << mthreads << " threads\n";
 
-    if(bam_write_threads_ > 1){
-        hts_set_threads(bam_out, bam_write_threads_);
+    std::list<std::thread> mthreads_list;
+    for(unsigned int i = 1; i < mthreads; i++){
+        mthreads_list.emplace_back(&ProgMap::merge_chunks_, this, std::ref(ms));
+    }
+    merge_chunks_(ms);
+    for(auto & t : mthreads_list){
+        t.join();
     }
 
-    std::cout << bm.header() << " " << bm.header()->n_targets << "\n";
-    if(sam_hdr_write(bam_out, bm.header()) < 0) {
+    std::string outf = out_prefix_ + "merged.bam";
+    BGZF * bam_out = bgzf_open(outf.c_str(), "w");
+    if(bam_out == nullptr || bam_hdr_write(bam_out, hdr) < 0) {
         std::cerr << "Error writing header\n";
         exit(1);
     }
-
-    BamData * next = new BamData;
-    std::vector<BamData*> reads, treads;
-    for(size_t i = 0; i < 20; i++) reads.push_back(new BamData);
-    size_t bidx = 0;
-    int ltid = -1;
-    int lpos = 0;
-    std::string key;
-    bool has_unmapped = false;
-    size_t total_dups = 0;
-    size_t total_counted = 0;
-    size_t discarded = 0;
-    while(bm.next(next->b) != nullptr){
-        BamData & bd = *next;
-        if(bd.b->core.flag & BAM_FUNMAP){
-            has_unmapped = true;
-            break;
-        }else{
-            bd.tid = bd.b->core.tid;
-            bd.gid = std::numeric_limits<uint32_t>::max();
-            bd.ra = bam_aux2A(bam_aux_get(bd.b, "RA"));
-            bd.barcode = bhash[bam_aux2Z(bam_aux_get(bd.b, "CB"))];
-            bd.pos = (static_cast<uint64_t>(bd.b->core.pos) << 32) | (bam_endpos(bd.b) - 1);
-            key = bam_aux2Z(bam_aux_get(bd.b, "UB"));
-            seq2int<gwsc::ADNA4, uint32_t>(key, bd.umi);
-
-            if(bd.ra == 'E' || bd.ra == 'N'){
-                total_counted++;
-                bd.gid = base.index().gene_from_id(bam_aux2Z(bam_aux_get(bd.b, "XG"))).gid;
-                UMIMap m;
-                m.gene_id = bd.gid;
-                m.barcode = bd.barcode;
-                m.umi_from = bd.umi;
-                auto bs = umi_correct.begin() + bindex[bd.barcode];
-                auto be = umi_correct.begin() + bindex[bd.barcode + 1];
-                if(bs != be){
-                    auto rit = std::lower_bound(bs, be, m);
-                    if(rit != be && (*rit) == m){
-                        size_t ridx = std::distance(umi_correct.begin(), rit);
-                        ccheck[ridx] = true;
-                        uint32_t mask = (1 << ADNA4::size_) - 1;
-                        uint8_t * cumi = bam_aux_get(bd.b, "UB") + 1;
-                        uint32_t val = rit->umi_to;
-                        bd.umi = val;
-                        for(size_t i = 0; i < T::UMI_LEN; i++){
-                            cumi[T::UMI_LEN - i - 1] = ADNA4::alphabet_str_[val & mask];
-                            val >>= ADNA4::size_;
-                        }
-                        bam_aux_append(bd.b, "UR", 'Z', key.length() + 1, reinterpret_cast<uint8_t*>(const_cast<char*>(key.c_str())));
-                    }
-                }
-                auto bad_s = umi_bad.begin() + bad_index[bd.barcode];
-                auto bad_e = umi_bad.begin() + bad_index[bd.barcode + 1];
-                UMIBad bm(bd.barcode, bd.gid, bd.umi);
-                auto brit = std::lower_bound(bad_s, bad_e, bm);
-                if(brit != bad_e && (*brit) == bm){
-                    bd.ra = '?';
-                    uint8_t * rptr = bam_aux_get(bd.b, "RA") + 1;
-                    (*rptr) = '?';
-                    discarded++;
-                }
-            }
-
-            if(bd.tid != ltid || bd.b->core.pos != lpos){
-                if(bidx > 0){
-                    total_dups += process_dups(reads.begin(), reads.begin() + bidx, treads);
-                    for(size_t i = 0; i < bidx; i++){
-                        if(sam_write1(bam_out, bm.header(), reads[i]->b) < 0){
-                            std::cerr << "Error writing sam\n"; exit(1);
-                        }
-                        written_++;
-                        write_progress_();
-                    }
-                }
-                ltid = bd.tid;
-                lpos = bd.b->core.pos;
-                bidx = 0;
-            }
-            if(bidx >= reads.size()){
-                for(size_t i = 0; i < 20; i++) reads.push_back(new BamData);
-            }
-            std::swap(reads[bidx], next);
-            bidx++;
-
-            /*
-            if(sam_write1(bam_out, bm.header(), bd.b) < 0){
-                std::cerr << "Error writing sam\n";
-                exit(1);
-            }
-            */
-        }
-    }
-
-
-    if(bidx > 0){
-        total_dups += process_dups(reads.begin(), reads.begin() + bidx, treads);
-        for(size_t i = 0; i < bidx; i++){
-            if(sam_write1(bam_out, bm.header(), reads[i]->b) < 0){
-                std::cerr << "Error writing sam\n"; exit(1);
-            }
-            written_++;
-            write_progress_();
-        }
+    for(auto & seg : ms.segments){
+        append_bgzf_segment(bam_out, seg);
+        unlink(seg.c_str());
     }
-    tout << "Done writing mapped reads\n";
-    if(has_unmapped){
-        tout << "Writing unmapped reads\n";
-        written_++;
-        if(sam_write1(bam_out, bm.header(), next->b) < 0){
-            std::cerr << "Error writing sam\n"; exit(1);
-        }
-        while(bm.next(next->b) != nullptr){
-            if(sam_write1(bam_out, bm.header(), next->b) < 0){
-                std::cerr << "Error writing sam\n"; exit(1);
-            }
-            written_++;
-            write_progress_();
-        }
-        tout << "Done writing unmapped reads\n";
+    if(bgzf_close(bam_out) < 0){
+        std::cerr << "Error closing " << outf << "\n";
+        exit(1);
     }
+    bam_hdr_destroy(hdr);
+    sam_close(hin);
 
     size_t missing = 0;
-    for(auto c : ccheck){
-        if(!c){
+    for(size_t i = 0; i < table.capacity(); i++){
+        if(table.corrected(i) && !ms.ccheck[i]){
             missing++;
         }
     }
     if(missing > 0){
-        std::cout << "Missed " << missing << " out of " << umi_correct.size() << " UMI corrections\n";
+        std::cout << "Missed " << missing << " out of " << table.corrections() << " UMI corrections\n";
     }
-    //std::cout << "Duplicate check " << (100.0 * total_dups / total_counted) << "\n";
-    tout << "Done writing " << written_ << " reads and " << discarded << " marked as discarded\n";
-
-    //std::cout << "Read destroyed\n";
-    //std::cout << "Bam Closed\n";
-    sam_close(bam_out);
+    //std::cout << "Duplicate check " << (100.0 * ms.dups / ms.counted) << "\n";
+    tout << "Done writing " << written_.load() << " reads and " << ms.discarded.load() << " marked as discarded\n";
 
     tout << "Deleting the temporary bam files\n";
-    for(auto & b : bam_files){
+    for(auto & b : ms.bam_files){
         unlink(b.c_str());
+        unlink((b + ".csi").c_str());
     }
 
     tout << "Done\n";
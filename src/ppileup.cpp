@@ -31,8 +31,11 @@ SOFTWARE.
 #include <list>
 #include <fstream>
 #include <thread>
+#include <atomic>
 #include <algorithm>
 #include <numeric>
+#include <memory>
+#include <array>
 #include <sstream> //for uint32_vector_to_string
 
 using namespace gwsc;
@@ -40,10 +43,15 @@ using namespace gwsc;
 void ProgPileup::load() {
     index_ = args_["txidx"].as<std::string>();
     out_ = args_["out"].as<std::string>();
-    ref_ = args_["reference"].as<std::string>();
+    ref_ = args_["reference"].as<std::string>("");
     lib_type_ = args_["library"].as<std::string>("V2");
     threads_ = args_["threads"].as<unsigned int>(1);
     rthreads_ = args_["rthreads"].as<unsigned int>(1);
+    h5_compression().level = args_["h5_level"].as<unsigned int>(6);
+    h5_compression().chunk = args_["h5_chunk"].as<size_t>(1 << 16);
+    h5_compression().shuffle = args_["h5_shuffle"];
+    umi_text_ = args_["umi_text"];
+    h5_compression().threads = threads_;
 
     //min_coverage_ = args_["mincov"].as<unsigned int>(min_coverage_);
     min_alternative_ = args_["minalt"].as<unsigned int>(min_alternative_);
@@ -54,6 +62,7 @@ void ProgPileup::load() {
     splice_win_ = args_["splicewin"].as<unsigned int>(splice_win_);
     passed_ = args_["passed"].as<std::string>();
     read_genes_ = args_["genes"].as<unsigned int>(read_genes_);
+    target_window_ = args_["target_window"].as<unsigned int>(target_window_);
     if(args_["snvlist"])
         snvlist_ = args_["snvlist"].as<std::string>();
     cellranger_ = args_["cellranger"];
@@ -66,10 +75,7 @@ void ProgPileup::load() {
     }
 
     tout << "Loading the genome\n";
-    {
-        FastaReader fr(ref_);
-        fr.read_all(genome_);
-    }
+    genome_.open(ref_.empty() ? index_ + "_genome.bin" : ref_);
     bam_file_ = args_.pos[0];
 
     if(!snvlist_.empty()) parse_targets_();
@@ -87,18 +93,405 @@ void ProgPileup::read_passed_(){
     tout << "Read " << barcodes_.size() << " passed barcodes\n";
 }
 
+//Takes vector of ints [1,2,3] -> "1_2_3" for external parsing
+//TODO deal with string encoding for space. RLE optimization?
+std::string uint32_vector_to_string(const std::vector<uint32_t> &v) {
+  std::stringstream oss;
+  for (const auto &i : v) {
+    oss << i << "_";
+  }
+  // Remove final underscore, optional if slows down
+  return oss.str().substr(0, oss.str().size() - 1);
+}
+
+// Every dataset is appended in position order as batches finish so memory stays bounded by
+// the batch in flight. Each writer only buffers a few chunks before they are compressed and written.
+// The UMI coverage of position i is coverage/umi_values[umi_offsets[i]:umi_offsets[i + 1]].
+struct ProgPileup::PileupOutput {
+    using U16 = H5ChunkWriter<uint16_t>;
+    using U32 = H5ChunkWriter<uint32_t>;
+
+    struct BaseOut {
+        std::unique_ptr<U32> snps;
+        std::unique_ptr<U32> barcodes;
+        std::unique_ptr<U16> plus;
+        std::unique_ptr<U16> minus;
+    };
+
+    PileupOutput(const std::string & prefix, const std::vector<std::string> & barcodes, const GenomeStore & genome, bool umi_text)
+        : file(prefix + "_barcode_matrices.h5", H5F_ACC_TRUNC)
+    {
+        using namespace H5;
+        H5Compression opts = h5_compression();
+        opts.threads = 1;
+        std::vector<const char *> ctmp;
+        for(auto & b : barcodes) ctmp.push_back(b.c_str());
+        write_h5_string("barcodes", ctmp, file);
+        refs.reset(new H5ChunkWriter<uint8_t>("refs", file, PredType::NATIVE_UINT8, opts));
+        tids.reset(new U32("tids", file, PredType::NATIVE_UINT32, opts));
+        pos.reset(new U32("pos", file, PredType::NATIVE_UINT32, opts));
+        for(size_t bi = 0; bi < 4; bi++){
+            std::string gs = "/base_";
+            gs+="ACGT"[bi];
+            H5::Group group(file.createGroup(gs));
+            auto & bb = bases[bi];
+            bb.snps.reset(new U32("snps", group, PredType::NATIVE_UINT32, opts));
+            bb.barcodes.reset(new U32("barcode_ids", group, PredType::NATIVE_UINT32, opts));
+            bb.plus.reset(new U16("plus", group, PredType::NATIVE_UINT16, opts));
+            bb.minus.reset(new U16("minus", group, PredType::NATIVE_UINT16, opts));
+        }
+
+        H5::Group group(file.createGroup("coverage"));
+        ctmp.clear();
+        for(size_t i = 0; i < genome.size(); i++) ctmp.push_back(genome.name(i).c_str());
+        write_h5_string("chroms", ctmp, group);
+        ctid.reset(new H5ChunkWriter<int32_t>("tid", group, PredType::NATIVE_INT32, opts));
+        cpos.reset(new U32("pos", group, PredType::NATIVE_UINT32, opts));
+        const char * names[5] = {"plus", "minus", "total_barcodes", "plus_barcodes", "minus_barcodes"};
+        for(size_t i = 0; i < 5; i++){
+            cvals[i].reset(new U32(names[i], group, PredType::NATIVE_UINT32, opts));
+            nonzero[i] = 0;
+        }
+        umi_offsets.reset(new H5ChunkWriter<uint64_t>("umi_offsets", group, PredType::NATIVE_UINT64, opts));
+        umi_values.reset(new U32("umi_values", group, PredType::NATIVE_UINT32, opts));
+        umi_offsets->push_back(0);
+        if(umi_text) umi_out.reset(new gzofstream(prefix + "_umi_coverage.txt.gz"));
+    }
+
+    void add_coverage(const PositionCoverage & c) {
+        ctid->push_back(c.tid);
+        cpos->push_back(c.pos);
+        uint32_t vals[5] = {c.pcoverage, c.mcoverage, c.tbarcodes, c.pbarcodes, c.mbarcodes};
+        for(size_t i = 0; i < 5; i++){
+            cvals[i]->push_back(vals[i]);
+            nonzero[i] += vals[i] > 0;
+        }
+        umi_values->append(c.umi_coverages);
+        umi_offsets->push_back(umi_values->size());
+        if(umi_out) (*umi_out) << uint32_vector_to_string(c.umi_coverages) << "\n";
+    }
+
+    void close() {
+        refs->close();
+        tids->close();
+        pos->close();
+        for(auto & bb : bases){
+            bb.snps->close();
+            bb.barcodes->close();
+            bb.plus->close();
+            bb.minus->close();
+        }
+        const char * names[5] = {"plus", "minus", "total_barcodes", "plus_barcodes", "minus_barcodes"};
+        for(size_t i = 0; i < 5; i++){
+            std::cout << names[i] << " > 0: " << nonzero[i] << " / " << cpos->size() << "\n";
+            cvals[i]->close();
+        }
+        std::cout << "|umi_coverages|: " << cpos->size() << " values = " << umi_values->size() << "\n";
+        ctid->close();
+        cpos->close();
+        umi_offsets->close();
+        umi_values->close();
+        file.close();
+        if(umi_out) umi_out->close();
+    }
+
+    H5::H5File                                 file;
+    std::unique_ptr<gzofstream>                umi_out;
+    std::unique_ptr<H5ChunkWriter<uint8_t>>    refs;
+    std::unique_ptr<U32>                       tids;
+    std::unique_ptr<U32>                       pos;
+    std::array<BaseOut, 4>                     bases;
+    std::unique_ptr<H5ChunkWriter<int32_t>>    ctid;
+    std::unique_ptr<U32>                       cpos;
+    std::array<std::unique_ptr<U32>, 5>        cvals;
+    std::array<size_t, 5>                      nonzero;
+    std::unique_ptr<H5ChunkWriter<uint64_t>>   umi_offsets;
+    std::unique_ptr<U32>                       umi_values;
+};
+
+void ProgPileup::write_batch_(PileupOutput & out, const std::vector<PositionCount*> & buffer, std::vector<PositionCoverage> & coverage){
+    for(uint32_t i = 0; i < buffer.size(); i++){
+        auto const & p = *buffer[i];
+        uint32_t snp_id = out.tids->size();
+        out.tids->push_back(p.tid);
+        out.pos->push_back(p.pos);
+        out.refs->push_back(p.ref);
+        for(auto & b : p.bcounts){
+            for(size_t k = 0; k < 4; k++){
+                if((b.pbases[k] + b.mbases[k]) > 0){
+                    auto & bb = out.bases[k];
+                    bb.snps->push_back(snp_id);
+                    bb.barcodes->push_back(b.barcode);
+                    bb.plus->push_back(b.pbases[k]);
+                    bb.minus->push_back(b.mbases[k]);
+                }
+            }
+        }
+    }
+
+    // Batches cover increasing, non overlapping gene groups so sorting each one keeps the files in order
+    std::sort(coverage.begin(), coverage.end());
+    for(auto const & c : coverage) out.add_coverage(c);
+}
+
+void ProgPileup::write_header_(gzofstream & os){
+    //cos << "chrom\tpos\tplus_coverage\tminus_coverage\n";
+    os << "chrom\tpos\tcoverage\tbarcodes\tfailed_count\tref\tmax_non_ref\tplus_base\tminus_base\tplus_donor_dist\tplus_acceptor_dist\tminus_donor_dist\tminus_acceptor_dist";
+    for(size_t i = 0; i < 4; i++){
+        char bs = "ACGT"[i];
+        os << "\t" 
+            << bs << "_total\t" 
+            << bs << "_total_barcodes";
+    }
+    for(auto s : {"_plus", "_minus"}){
+        for(size_t i = 0; i < 4; i++){
+            std::string bs(1, "ACGT"[i]);
+            bs += s;
+            os << "\t" 
+                << bs << "_counts\t"
+                << bs << "_end_dist";
+        }
+    }
+    os << "\n";
+}
+
+// Sorts the positions and coverage the workers finished and appends them to the outputs
+const PositionCount * ProgPileup::write_workers_(const std::vector<PileupWorker*> & threads, PileupOutput & pout, gzofstream & os){
+    std::vector<PositionCount*> buffer;
+    std::vector<PositionCoverage> cbuffer;
+    for(auto tp : threads){
+        auto & t = *(tp);
+        for(size_t i = 0; i < t.pcount; i++){
+            buffer.push_back(&t.positions[i]);
+        }
+        cbuffer.insert(cbuffer.end(), std::make_move_iterator(t.coverage.begin()), std::make_move_iterator(t.coverage.end()));
+    }
+
+    //std::cout << "Sorting buffer size = " << buffer.size() << "\n";
+    std::sort(buffer.begin(), buffer.end(), [](const PositionCount * p1, PositionCount * p2) { return (*p1) < (*p2); });
+    write_batch_(pout, buffer, cbuffer);
+
+    for(auto ptr : buffer){
+        auto const & p = *ptr;
+        os << genome_.name(p.tid) << "\t" << p.pos << "\t" 
+           << p.coverage << "\t" << p.barcodes << "\t" << p.ambig << "\t" 
+           << p.ref << "\t" << p.max_nr << "\t" << p.pbase << "\t" << p.mbase
+           << "\t" << p.sdists[0] << "\t" << p.sdists[1] << "\t" << p.sdists[3] << "\t" << p.sdists[2];
+
+        for(size_t i = 0; i < 4; i++){
+            auto const & b = p.bases[i];
+            os << "\t" << (b.m_count + b.p_count) << "\t" << b.t_barcodes;
+        }
+        for(size_t i = 0; i < 4; i++){
+            auto const & b = p.bases[i];
+            os 
+                << "\t" << b.p_count
+                << "\t" << b.p_edge_dist;
+        }
+        for(size_t i = 0; i < 4; i++){
+            auto const & b = p.bases[i];
+            os 
+                << "\t" << b.m_count
+                << "\t" << b.m_edge_dist;
+        }
+        os << "\n";
+    }
+    return buffer.empty() ? nullptr : buffer.back();
+}
+
+void ProgPileup::write_barcodes_(const std::vector<PileupWorker*> & threads, const std::vector<unsigned int> & barcode_molecules){
+    std::vector<unsigned int> barcode_coverage(barcodes_.size());
+    std::vector<unsigned int> barcode_bases(barcodes_.size());
+    for(size_t i = 0; i < threads.size(); i++){
+        std::transform (barcode_coverage.begin(), barcode_coverage.end(), threads[i]->bcoverage.begin(), barcode_coverage.begin(), std::plus<unsigned int>());
+        std::transform (barcode_bases.begin(), barcode_bases.end(), threads[i]->bbases.begin(), barcode_bases.begin(), std::plus<unsigned int>());
+    }
+
+    gzofstream ofz(out_ + "_barcodes.txt.gz");
+    ofz << "barcode\tmolecules\tbases_covered\tbases\n";
+    for(size_t i = 0; i < barcodes_.size(); i++){
+        ofz << barcodes_[i] << "\t" << barcode_molecules[i] << "\t" << barcode_coverage[i] << "\t" << barcode_bases[i] << "\n"; 
+
+    }
+}
+
+// Every targeted pileup thread needs its own handle, hts iterators can't share a samFile
+struct TargetBam {
+    TargetBam( const TargetBam& ) = delete;
+    TargetBam& operator=(const TargetBam&) = delete;
+
+    TargetBam(){
+    }
+
+    ~TargetBam(){
+        for(auto * d : recs) delete d;
+        if(idx != nullptr) hts_idx_destroy(idx);
+        if(bh != nullptr) bam_hdr_destroy(bh);
+        if(sf != nullptr) sam_close(sf);
+    }
+
+    bool open(const std::string & bam){
+        sf = sam_open(bam.c_str(), "r");
+        if(sf == nullptr) return false;
+        bh = sam_hdr_read(sf);
+        idx = sam_index_load(sf, bam.c_str());
+        return idx != nullptr;
+    }
+
+    samFile                 * sf = nullptr;
+    bam_hdr_t               * bh = nullptr;
+    hts_idx_t               * idx = nullptr;
+    std::vector<BamDetail*>   recs;
+    std::vector<unsigned int> molecules;
+    std::string               btmp;
+};
+
+// Targets and the window around them that are piled up from one indexed query
+struct TargetCluster {
+    int32_t  tid;
+    uint32_t lft;
+    uint32_t rgt;
+};
+
+template <typename T, typename P>
+int ProgPileup::run_targets_(const TXIndex & index){
+    // Windows that touch are merged so no position is piled up by two clusters
+    std::vector<TargetCluster> clusters;
+    for(size_t tid = 0; tid < targets_.size(); tid++){
+        for(auto & t : targets_[tid]){
+            uint32_t lft = t.target > target_window_ ? t.target - target_window_ : 0;
+            uint32_t rgt = t.target + target_window_;
+            if(!clusters.empty() && clusters.back().tid == static_cast<int32_t>(tid) && lft <= clusters.back().rgt + 1){
+                clusters.back().rgt = rgt;
+            }else{
+                clusters.push_back({static_cast<int32_t>(tid), lft, rgt});
+            }
+        }
+    }
+
+    size_t nt = std::max(threads_, 1u);
+    std::vector<PileupWorker*> threads;
+    std::vector<std::unique_ptr<TargetBam>> bams;
+    for(size_t i = 0; i < nt; i++){
+        threads.push_back(new PileupWorker(barcodes_.size(), index, genome_, btrack_, dups_));
+        threads.back()->set_params(min_alternative_, min_qual_, min_barcodes_, min_edge_, splice_win_, min_af_, &targets_);
+        bams.emplace_back(new TargetBam());
+        if(!bams.back()->open(bam_file_)){
+            std::cerr << "Could not open bam index for " << bam_file_ << "\n";
+            exit(1);
+        }
+        bams.back()->molecules.resize(barcodes_.size());
+    }
+    tout << "Targeted pileup of " << clusters.size() << " target clusters with " << nt << " threads\n";
+
+    gzofstream os(out_ + ".txt.gz");
+    PileupOutput pout(out_, barcodes_, genome_, umi_text_);
+    write_header_(os);
+
+    auto pileup_cluster = [&](PileupWorker & w, TargetBam & tb, P & rf, size_t ci){
+        const TargetCluster & c = clusters[ci];
+        int32_t btid = bam_name2id(tb.bh, genome_.name(c.tid).c_str());
+        if(btid < 0) return;
+        hts_itr_t * iter = sam_itr_queryi(tb.idx, btid, c.lft, c.rgt + 1);
+        if(iter == nullptr) return;
+        if(tb.recs.empty()) for(size_t i = 0; i < 100; i++) tb.recs.push_back(new BamDetail());
+        size_t curr = 0;
+        while(sam_itr_next(tb.sf, iter, tb.recs[curr]->b) > 0){
+            BamDetail & d = *tb.recs[curr];
+            if(!rf(d, 0)) continue;
+            uint8_t * cb = bam_aux_get(d.b, "CB");
+            uint8_t * ub = bam_aux_get(d.b, "UB");
+            if(cb == nullptr || ub == nullptr) continue;
+            tb.btmp = bam_aux2Z(cb);
+            size_t dash = tb.btmp.find('-');
+            if(dash != std::string::npos){
+                tb.btmp.erase(dash);
+            }
+            tb.btmp += "_";
+            tb.btmp += bam_aux2Z(ub);
+            unsigned int bid = filter_func(tb.btmp, 0);
+            if(bid == std::numeric_limits<unsigned int>::max()) continue;
+            d.barcode = bid;
+            d.filenum = 0;
+
+            // Reads reaching back into the previous cluster were already counted there
+            if(ci == 0 || clusters[ci - 1].tid != c.tid || static_cast<uint32_t>(d.b->core.pos) > clusters[ci - 1].rgt){
+                tb.molecules[bid]++;
+            }
+            curr++;
+            if(curr >= tb.recs.size()) for(size_t i = 0; i < 100; i++) tb.recs.push_back(new BamDetail());
+        }
+        hts_itr_destroy(iter);
+
+        if(curr > 0){
+            BamBuffer::rpair range = {tb.recs.begin(), tb.recs.begin() + curr};
+            w.set_window(btid, c.lft, c.rgt);
+            w.process_range(range);
+        }
+    };
+
+    unsigned int pbases = 0, bases = 0, reads = 0;
+    size_t batch = std::max<size_t>(1, static_cast<size_t>(read_genes_) * nt);
+    for(size_t bstart = 0; bstart < clusters.size(); bstart += batch){
+        size_t bend = std::min(clusters.size(), bstart + batch);
+        std::atomic<size_t> next(bstart);
+        std::vector<std::thread> workers;
+        for(size_t i = 0; i < nt; i++){
+            threads[i]->reset(clusters[bstart].tid, clusters[bstart].lft);
+            workers.push_back(std::thread([&, i](){
+                P rf(index, T::LibraryStrand);
+                size_t ci;
+                while((ci = next++) < bend){
+                    pileup_cluster(*threads[i], *bams[i], rf, ci);
+                }
+            }));
+        }
+        for(auto & t : workers) t.join();
+
+        pbases = 0; bases = 0; reads = 0;
+        for(auto tp : threads){
+            bases += tp->bases;
+            pbases += tp->pbases;
+            reads += tp->reads;
+        }
+        const PositionCount * last = write_workers_(threads, pout, os);
+        if(last != nullptr){
+            tout << "Processed " << bend << " / " << clusters.size() << " target clusters, " << reads << " reads, bases with min barcodes = " << bases << ", total passed bases = " << pbases << " current ref = " << genome_.name(last->tid) << ": " << last->pos << "\n";
+        }
+    }
+
+    std::vector<unsigned int> barcode_molecules(barcodes_.size());
+    for(auto & tb : bams){
+        std::transform(barcode_molecules.begin(), barcode_molecules.end(), tb->molecules.begin(), barcode_molecules.begin(), std::plus<unsigned int>());
+    }
+    tout << "Finished. Processed " << reads << " reads over " << clusters.size() << " target clusters, bases with min barcodes = " << bases << ", total passed bases = " << pbases << "\n";
+
+    pout.close();
+    write_barcodes_(threads, barcode_molecules);
+    for(auto t : threads) delete t;
+    threads.clear();
+    return EXIT_SUCCESS;
+}
+
 template <typename T, typename P>
 int ProgPileup::run_wrap_(){
     read_passed_();
     tout << "Loading the transcriptome index\n";
 
-    typename BamGeneReaderFiltered<T, BamReader, P>::bcfilter_func fp = std::bind(&ProgPileup::filter_func, *this, std::placeholders::_1, std::placeholders::_2);
+    typename BamGeneReaderFiltered<T, BamReader, P>::bcfilter_func fp = std::bind(&ProgPileup::filter_func, this, std::placeholders::_1, std::placeholders::_2);
     BamGeneReaderFiltered<T, BamReader, P> br(fp); //br(cellranger_);
 
     br.index.load(index_);
     br.index.build_splice_site_index();
+    btrack_.load(index_, br.index);
     std::cout << "Splice site index built\n";
 
+    if(!targets_.empty()){
+        TargetBam probe;
+        if(probe.open(bam_file_)) return run_targets_<T, P>(br.index);
+        tout << "No bam index for " << bam_file_ << ", streaming the whole bam for the SNV list\n";
+    }
+
     br.set_bam(bam_file_);
     if(rthreads_ > 1){
         br.set_threads(rthreads_);
@@ -110,7 +503,7 @@ int ProgPileup::run_wrap_(){
     std::vector<PileupWorker*> threads;
     if(threads_ < 2) threads_ = 2;
     for(size_t i = 0; i < threads_ - 1; i++){
-        threads.push_back(new PileupWorker(barcodes_.size(), br.index, genome_, dups_));
+        threads.push_back(new PileupWorker(barcodes_.size(), br.index, genome_, btrack_, dups_));
         threads.back()->set_params(min_alternative_, min_qual_, min_barcodes_, min_edge_, splice_win_, min_af_, 
                 (targets_.empty() ? nullptr : &targets_));
     }
@@ -118,30 +511,10 @@ int ProgPileup::run_wrap_(){
     unsigned int pbases = 0, bases = 0, reads = 0;
     unsigned int plus_bases = 0, minus_bases = 0;
     unsigned int lreads = 0;
-    std::vector<PositionCount*> buffer;
-    //std::vector<PositionCoverage*> cbuffer;
     gzofstream os(out_ + ".txt.gz");
-    std::vector<BBout> bouts;
-    bouts.resize(4);
+    PileupOutput pout(out_, barcodes_, genome_, umi_text_);
 
-    //cos << "chrom\tpos\tplus_coverage\tminus_coverage\n";
-    os << "chrom\tpos\tcoverage\tbarcodes\tfailed_count\tref\tmax_non_ref\tplus_base\tminus_base\tplus_donor_dist\tplus_acceptor_dist\tminus_donor_dist\tminus_acceptor_dist";
-    for(size_t i = 0; i < 4; i++){
-        char bs = "ACGT"[i];
-        os << "\t" 
-            << bs << "_total\t" 
-            << bs << "_total_barcodes";
-    }
-    for(auto s : {"_plus", "_minus"}){
-        for(size_t i = 0; i < 4; i++){
-            std::string bs(1, "ACGT"[i]);
-            bs += s;
-            os << "\t" 
-                << bs << "_counts\t"
-                << bs << "_end_dist";
-        }
-    }
-    os << "\n";
+    write_header_(os);
 
     std::cout << "Min af = " << min_af_ << "\n";
     unsigned int tot = br.read_genes(*rbuffer, read_genes_);
@@ -170,88 +543,20 @@ int ProgPileup::run_wrap_(){
             (*it)->join();
         }
 
-        buffer.clear();
-        //cbuffer.clear();
         for(auto tp : threads){
             auto & t = *(tp);
-            for(size_t i = 0; i < t.pcount; i++){
-                buffer.push_back(&t.positions[i]);
-            }
-
-            coverage_.insert(coverage_.end(), t.coverage.begin(), t.coverage.end());
             bases += t.bases;
             plus_bases += t.plus_bases;
             minus_bases += t.minus_bases;
             reads += t.reads;
             pbases += t.pbases;
         }
+        const PositionCount * last = write_workers_(threads, pout, os);
 
-        //std::cout << "Sorting buffer size = " << buffer.size() << "\n";
-        std::sort(buffer.begin(), buffer.end(), [](const PositionCount * p1, PositionCount * p2) { return (*p1) < (*p2); });
-        for(uint32_t i = 0; i < buffer.size(); i++){
-            auto const & p = *buffer[i];
-            size_t snp_id = tids_.size();
-            tids_.push_back(p.tid);
-            pos_.push_back(p.pos);
-            refs_.push_back(p.ref);
-            for(auto & b : p.bcounts){
-                for(size_t k = 0; k < 4; k++){
-                    if((b.pbases[k] + b.mbases[k]) > 0){
-                        auto & bb = bouts[k];
-                        bb.snps.push_back(snp_id);
-                        bb.barcodes.push_back(b.barcode);
-                        bb.plus.push_back(b.pbases[k]);
-                        bb.minus.push_back(b.mbases[k]);
-                    }
-                }
-            }
-        }
-
-        for(auto ptr : buffer){
-            auto const & p = *ptr;
-            os << genome_[p.tid].name << "\t" << p.pos << "\t" 
-               << p.coverage << "\t" << p.barcodes << "\t" << p.ambig << "\t" 
-               << p.ref << "\t" << p.max_nr << "\t" << p.pbase << "\t" << p.mbase
-               << "\t" << p.sdists[0] << "\t" << p.sdists[1] << "\t" << p.sdists[3] << "\t" << p.sdists[2];
-
-            for(size_t i = 0; i < 4; i++){
-                auto const & b = p.bases[i];
-                os << "\t" << (b.m_count + b.p_count) << "\t" << b.t_barcodes;
-            }
-            for(size_t i = 0; i < 4; i++){
-                auto const & b = p.bases[i];
-                os 
-                    << "\t" << b.p_count
-                    << "\t" << b.p_edge_dist;
-            }
-            for(size_t i = 0; i < 4; i++){
-                auto const & b = p.bases[i];
-                os 
-                    << "\t" << b.m_count
-                    << "\t" << b.m_edge_dist;
-            }
-            os << "\n";
-        }
-
-                /*
-                std::cout
-                    << "Piled up ref = " << p.ref << " " << " reads = " << (out_.end() - out_.begin())
-                    << "  Position: " << p.tid << ": " << p.pos << " coverage = " << p.coverage << " ambig = " << p.ambig << "\n";
-                for(size_t i = 0; i < 4; i++){
-                    auto & b = p.bases[i];
-                    if(b.count > 0){
-                        std::cout << std::setprecision(2) << std::fixed
-                            << "    base = " << "ACGT"[i] << " count = " << b.count 
-                            << " gaps = " << (1.0 * b.gaps / b.count) << " NM = " << (1.0 * b.NM / b.count) 
-                            << " barcodes = " << b.barcodes << " lens = " << (1.0 * b.lens / b.count) << "\n";
-                    }
-                }
-                */
-
-        if((reads - lreads) > 500000 && !buffer.empty()){
+        if((reads - lreads) > 500000 && last != nullptr){
             size_t sec = tout.seconds();
             double ps = 1.0 * reads / (sec - start_time);
-            tout << "Processed " << reads << " reads [" << ps << " / second], bases with min barcodes = " << bases << " plus = " << plus_bases << " minus = " << minus_bases << ", total passed bases = " << pbases << " current ref = " << genome_[buffer.back()->tid].name << ": " << buffer.back()->pos << "\n";
+            tout << "Processed " << reads << " reads [" << ps << " / second], bases with min barcodes = " << bases << " plus = " << plus_bases << " minus = " << minus_bases << ", total passed bases = " << pbases << " current ref = " << genome_.name(last->tid) << ": " << last->pos << "\n";
         }
     }
 
@@ -260,145 +565,20 @@ int ProgPileup::run_wrap_(){
     delete rbuffer;
     delete pbuffer;
 
-    std::vector<unsigned int> barcode_coverage(barcodes_.size());
-    std::vector<unsigned int> barcode_bases(barcodes_.size());
-    for(size_t i = 0; i < threads.size(); i++){
-        std::transform (barcode_coverage.begin(), barcode_coverage.end(), threads[i]->bcoverage.begin(), barcode_coverage.begin(), std::plus<unsigned int>());
-        std::transform (barcode_bases.begin(), barcode_bases.end(), threads[i]->bbases.begin(), barcode_bases.begin(), std::plus<unsigned int>());
-        delete threads[i];
-    }
-
-    write_h5f_(out_ + "_barcode_matrices.h5", bouts);
-    {
-        gzofstream ofz(out_ + "_barcodes.txt.gz");
-        ofz << "barcode\tmolecules\tbases_covered\tbases\n";
-        for(size_t i = 0; i < barcodes_.size(); i++){
-            ofz << barcodes_[i] << "\t" << barcode_molecules[i] << "\t" << barcode_coverage[i] << "\t" << barcode_bases[i] << "\n"; 
-
-        }
-    }
-    bouts.clear();
+    pout.close();
+    write_barcodes_(threads, barcode_molecules);
+    for(auto t : threads) delete t;
     threads.clear();
 
 
     return EXIT_SUCCESS;
 }
 
-uint32_t count_bigger(const std::vector<uint32_t> & elems) {
-    return std::count_if(elems.begin(), elems.end(), [](int c){return c > 0;});
-}
-
-//Takes vector of ints [1,2,3] -> "1_2_3" for external parsing
-//TODO deal with string encoding for space. RLE optimization?
-std::string uint32_vector_to_string(const std::vector<uint32_t> &v) {
-  std::stringstream oss;
-  for (const auto &i : v) {
-    oss << i << "_";
-  }
-  // Remove final underscore, optional if slows down
-  return oss.str().substr(0, oss.str().size() - 1);
-}
-
-void ProgPileup::write_h5f_(const std::string & out, std::vector<BBout> & bouts){
-    using namespace H5;
-    H5File file(out, H5F_ACC_TRUNC);
-    //H5::Group group(file.createGroup("/barcode_rates"));
-    std::vector<const char *> ctmp;
-
-    for(auto & b : barcodes_) ctmp.push_back(b.c_str());
-    write_h5_string("barcodes", ctmp, file);
-    write_h5_numeric("refs", refs_, file, PredType::NATIVE_UINT8);
-    write_h5_numeric("tids", tids_, file, PredType::NATIVE_UINT32);
-    write_h5_numeric("pos", pos_, file, PredType::NATIVE_UINT32);
-    for(size_t bi = 0; bi < 4; bi++){
-        std::string gs = "/base_";
-        auto & bb = bouts[bi];
-        gs+="ACGT"[bi];
-        H5::Group group(file.createGroup(gs));
-
-        write_h5_numeric("snps", bb.snps, group, PredType::NATIVE_UINT32);
-        write_h5_numeric("barcode_ids", bb.barcodes, group, PredType::NATIVE_UINT32);
-        write_h5_numeric("plus", bb.plus, group, PredType::NATIVE_UINT16);
-        write_h5_numeric("minus", bb.minus, group, PredType::NATIVE_UINT16);
-    }
-
-    {
-
-        H5::Group group(file.createGroup("coverage"));
-        std::vector<int32_t> ti;
-        std::vector<uint32_t> tu;
-        std::sort(coverage_.begin(), coverage_.end());
-        ctmp.clear();
-
-        for(size_t i = 0; i < genome_.size(); i++) ctmp.push_back(genome_[i].name.c_str());
-        write_h5_string("chroms", ctmp, group);
-        for(auto c : coverage_) ti.push_back(c.tid);
-        write_h5_numeric("tid", ti, group, PredType::NATIVE_INT32);
-        for(auto c : coverage_) tu.push_back(c.pos);
-        write_h5_numeric("pos", tu, group, PredType::NATIVE_UINT32);
-
-        tu.clear();
-        for(auto c : coverage_) tu.push_back(c.pcoverage);
-        std::cout << "plus > 0: " << count_bigger(tu) << " / " << tu.size() << "\n";
-        write_h5_numeric("plus", tu, group, PredType::NATIVE_UINT32);
-
-
-        tu.clear();
-        for(auto c : coverage_) tu.push_back(c.mcoverage);
-        std::cout << "minus > 0: " << count_bigger(tu) << " / " << tu.size() << "\n";
-        write_h5_numeric("minus", tu, group, PredType::NATIVE_UINT32);
-
-        tu.clear();
-        for(auto c : coverage_) tu.push_back(c.tbarcodes);
-        std::cout << "total_barcodes > 0: " << count_bigger(tu) << " / " << tu.size() << "\n";
-        write_h5_numeric("total_barcodes", tu, group, PredType::NATIVE_UINT32);
-
-        tu.clear();
-        for(auto c : coverage_) tu.push_back(c.pbarcodes);
-        std::cout << "plus_barcodes > 0: " << count_bigger(tu) << " / " << tu.size() << "\n";
-        write_h5_numeric("plus_barcodes", tu, group, PredType::NATIVE_UINT32);
-
-        tu.clear();
-        for(auto c : coverage_) tu.push_back(c.mbarcodes);
-        std::cout << "minus_barcodes > 0: " << count_bigger(tu) << " / " << tu.size() << "\n";
-        write_h5_numeric("minus_barcodes", tu, group, PredType::NATIVE_UINT32);
-
-
-        std::vector<std::string> str_tmp;
-        str_tmp.reserve(coverage_.size());
-
-        for(auto c : coverage_) str_tmp.push_back(uint32_vector_to_string(c.umi_coverages));
-        std::cout << "|umi_coverages|: " << str_tmp.size() << "\n";
-
-        // Could transform the std::string into c_strs -> h5 file. But found
-        // weirdness with max chunk size and gets very big. Better off writing
-        // to a separate coverage file to deal with separately. But when parsing
-        // subset, have to keep indices in track
-
-        gzofstream umi_out_file(out_ + "_umi_coverage.txt.gz");
-        // std::ofstream output_file("./umi_coverage_lines.txt");
-
-        std::ostream_iterator<std::string> output_iterator(umi_out_file, "\n");
-        std::copy(std::begin(str_tmp), std::end(str_tmp), output_iterator);
-
-        // c_strs -> h5 but crashes right at end :-(
-        // std::vector<const char *> c_strs(coverage_.size());
-        // std::transform(std::begin(str_tmp), std::end(str_tmp),
-        //                std::back_inserter(c_strs),
-        //                std::mem_fn(&std::string::c_str)
-        //                );
-
-        // write_h5_string("umi_coverages", c_strs, group);
-    }
-
-    file.close();
-}
-
 void ProgPileup::parse_targets_(){
     targets_.resize(genome_.size());
     std::map<std::string, int32_t> tids;
     for(size_t i = 0; i < genome_.size(); i++)
-        tids[genome_[i].name] = i;
+        tids[genome_.name(i)] = i;
 
     FileWrapper in(snvlist_);
     ParserTokens toks;
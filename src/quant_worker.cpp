@@ -26,7 +26,9 @@ SOFTWARE.
 #include <algorithm>
 #include <cstdio>
 #include <H5Cpp.h>
+#include <limits>
 #include <numeric>
+#include <tuple>
 
 using namespace gwsc;
 
@@ -79,20 +81,6 @@ void QuantBase::build_gene_groups(const std::string & fname) {
     */
 }
 
-// Sort barcodes by their index
-//From https://stackoverflow.com/questions/1577475/c-sorting-and-keeping-track-of-indexes
-template <typename T>
-std::vector<size_t> sort_molecule_indexes(const std::vector<T> &v, size_t NG) {
-    // initialize original index locations
-    std::vector<size_t> idx(v.size() / NG);
-    std::iota(idx.begin(), idx.end(), 0);
-
-    sort(idx.begin(), idx.end(),
-            [&v, &NG](size_t i1, size_t i2) {return v[i1 * NG] > v[i2 * NG];});
-
-    return idx;
-}
-
 void QuantBase::run(unsigned int umi_len, unsigned int num_threads, bool bam, const std::string & cmd){
     using namespace std::placeholders;
     cmd_ = cmd;
@@ -100,10 +88,12 @@ void QuantBase::run(unsigned int umi_len, unsigned int num_threads, bool bam, co
     tout << "Quantifying UMIs\n";
 
     size_t NG = group_names_.size();
-    QuantWorker::cb_read read_cb = std::bind(&QuantBase::read_, this, _1, _2);
+    QuantWorker::cb_read read_cb = std::bind(&QuantBase::next_bucket_, this, _1);
     std::list<QuantWorker> threads;
     for(size_t i = 0; i < num_threads; i++){
-        threads.emplace_back(*index_, group_map_, NG, read_cb, umi_len, total_barcodes_);
+        threads.emplace_back(*index_, group_map_, NG, read_cb, umi_len);
+        threads.back().aligns = aligns_;
+        threads.back().runs = runs_;
     }
 
 
@@ -120,58 +110,97 @@ void QuantBase::run(unsigned int umi_len, unsigned int num_threads, bool bam, co
     //in_.debug();
 
     tout << "Summarizing\n";
-    molecule_counts.resize(total_barcodes_ * QuantWorker::dedup::ELEM_COUNT);
-    group_counts.resize(total_barcodes_ * NG);
-
-    std::vector<size_t> bcounts(total_barcodes_);
-    size_t N = 0;
+    using dedup = QuantWorker::dedup;
     size_t R = 0, R2 = 0, R3 = 0, R4 = 0;
+    // Merge the sparse barcode rows of every thread by barcode
+    std::vector<std::tuple<AlignSummary::bint, QuantWorker*, uint32_t>> rows;
     for(auto it = threads.begin(); it != threads.end(); it++){
         R += it->total_reads;
         R2 += it->dups_.total_reads;
         R3 += it->dups_.total_reads2;
         R4 += it->dups_.total_reads3;
-        for(size_t i = 0; i < molecule_counts.size(); i++) molecule_counts[i] += it->dups_.molecule_counts[i];
-        for(size_t i = 0; i < group_counts.size(); i++) group_counts[i] += it->dups_.group_counts[i];
-        for(auto & c : it->dups_.gene_counts) {
-            bcounts[c.barcode]++;
-            N++;
+        for(uint32_t r = 0; r < it->dups_.barcode_counts.size(); r++){
+            rows.emplace_back(it->dups_.barcode_counts[r].barcode, &(*it), r);
         }
         if(bam) {
             umi_correct.insert(umi_correct.end(), it->dups_.umi_correct.begin(), it->dups_.umi_correct.end());
             umi_bad.insert(umi_bad.end(), it->dups_.umi_bad.begin(), it->dups_.umi_bad.end());
         }
     }
+    std::sort(rows.begin(), rows.end(), 
+        [](const std::tuple<AlignSummary::bint, QuantWorker*, uint32_t> & r1, const std::tuple<AlignSummary::bint, QuantWorker*, uint32_t> & r2) {
+            return std::get<0>(r1) < std::get<0>(r2);
+        }
+    );
+    barcode_counts.clear();
+    group_counts.clear();
+    phmap::flat_hash_map<AlignSummary::bint, uint32_t> row_map;
+    for(auto & r : rows){
+        auto & src = std::get<1>(r)->dups_;
+        uint32_t sr = std::get<2>(r);
+        if(barcode_counts.empty() || barcode_counts.back().barcode != std::get<0>(r)){
+            row_map[std::get<0>(r)] = barcode_counts.size();
+            barcode_counts.push_back(src.barcode_counts[sr]);
+            group_counts.insert(group_counts.end(), src.group_counts.begin() + sr * NG, src.group_counts.begin() + (sr + 1) * NG);
+        }else{
+            auto & dst = barcode_counts.back().counts;
+            for(size_t i = 0; i < dst.size(); i++) dst[i] += src.barcode_counts[sr].counts[i];
+            size_t g = group_counts.size() - NG;
+            for(size_t i = 0; i < NG; i++) group_counts[g + i] += src.group_counts[sr * NG + i];
+        }
+    }
+    std::vector<std::tuple<AlignSummary::bint, QuantWorker*, uint32_t>>().swap(rows);
+    if(bam) {
+        umi_table.build(umi_correct, umi_bad);
+        tout << "UMI correction table " << umi_table.size() << " keys in " << umi_table.capacity() 
+            << " slots using " << (umi_table.bytes() >> 20) << " MB\n";
+        std::vector<UMIMap>().swap(umi_correct);
+        std::vector<UMIBad>().swap(umi_bad);
+    }
     std::cout << "R = " << R << " R2 = " << R2 << " R3 = " << R3 << " R4 = " << R4 << "\n";
+    tout << "Counted " << barcode_counts.size() << " barcodes with tags out of " << total_barcodes_ << "\n";
+
+    // Barcodes with tags are ordered by their molecules, the barcodes without tags follow in index order
+    std::vector<uint32_t> order(barcode_counts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+        [this](uint32_t r1, uint32_t r2) {
+            return barcode_counts[r1].counts[dedup::MOLECULES] > barcode_counts[r2].counts[dedup::MOLECULES];
+        }
+    );
+    std::vector<uint32_t> rank(barcode_counts.size());
+    std::vector<bool> seen(total_barcodes_, false);
+    bpos_.clear();
+    brow_.clear();
+    for(auto r : order){
+        rank[r] = bpos_.size();
+        bpos_.push_back(barcode_counts[r].barcode);
+        brow_.push_back(r);
+        seen[barcode_counts[r].barcode] = true;
+    }
+    for(uint32_t b = 0; b < total_barcodes_; b++){
+        if(seen[b]) continue;
+        bpos_.push_back(b);
+        brow_.push_back(std::numeric_limits<uint32_t>::max());
+    }
 
-    //tout << "Index sorting the molecule counts N = " << N << " MC = " << molecule_counts.size() << "\n";
-    //Indexes of where each barcode should go to sort them by their total molecules
-    bpos_ = sort_molecule_indexes(molecule_counts, QuantWorker::dedup::ELEM_COUNT);
-
-    // This tells me the order of the barcode items ie. the one with the highest counts is bpos[0]
-    std::vector<size_t> bindex(total_barcodes_ + 1);
-    std::vector<size_t> brev(total_barcodes_);
+    // Place the gene counts of each barcode in the output order, a barcode's counts come from one thread
+    // already sorted by gene
+    std::vector<size_t> bindex(barcode_counts.size() + 1);
+    for(auto & t : threads){
+        for(auto & c : t.dups_.gene_counts) bindex[rank[row_map[c.barcode]] + 1]++;
+    }
+    total_ = 0;
     for(size_t i = 1; i < bindex.size(); i++){
-        bindex[i] = bcounts[bpos_[i - 1]] + bindex[i - 1];
-        brev[bpos_[i - 1]] = i - 1;
+        if(bindex[i] > 0) total_++;
+        bindex[i] += bindex[i - 1];
     }
-    //tout << "Index N = " << bindex.back() << "\n";
-    // Just write each tag to a gzipped file
     gene_counts.resize(bindex.back());
-    //tout << "Merging the tags\n";
     auto it = threads.begin();
-    total_ = 0;
     while(it != threads.end()){
-        auto bit = it->dups_.gene_counts.begin();
-        while(bit != it->dups_.gene_counts.end()){
-            //auto lbarcode = bit->barcode;
-            auto idx = brev[bit->barcode];
-            total_++;
-            for(size_t i = bindex[idx]; i < bindex[idx + 1]; i++){
-                //if(lbarcode != bit->barcode) std::cout << "Error with logic lgid = " << lbarcode << " gid = " << bit->barcode << "\n";
-                gene_id_map_.insert(std::make_pair(bit->gene_id, 0));
-                gene_counts[i] = *bit++;
-            }
+        for(auto & c : it->dups_.gene_counts){
+            gene_id_map_.insert(std::make_pair(c.gene_id, 0));
+            gene_counts[bindex[rank[row_map[c.barcode]]]++] = c;
         }
         it = threads.erase(it);
     }
@@ -182,77 +211,60 @@ void QuantBase::run(unsigned int umi_len, unsigned int num_threads, bool bam, co
     tout << "Total genes detected " << gene_id_map_.size() << " from " << total_ << " barcodes\n";
 }
 
-unsigned int QuantBase::read_(size_t N, std::vector<AlignSummary> & aligns) {
-    aligns.clear();
-    std::lock_guard<std::mutex> lock(mtx_read_);
-    if(astart_ >= aligns_->size()) return 0;
-    size_t r = 0;
-    auto lb = aligns_->at(astart_).barcode;
-    while(r < N && astart_ < aligns_->size()){
-        if(lb != aligns_->at(astart_).barcode){
-            r++;
-            lb = aligns_->at(astart_).barcode;
-        }else{
-            aligns.push_back(aligns_->at(astart_));
-            astart_++;
+// Index of the next unclaimed bucket, done is the number of tags in the bucket the caller finished
+size_t QuantBase::next_bucket_(size_t done) {
+    if(done > 0){
+        std::lock_guard<std::mutex> lock(mtx_progress_);
+        atotal_ += done;
+        if((ltotal_ + 10000000) <= atotal_){
+            size_t sec = tout.seconds();
+            double ps = 1.0 * atotal_ / std::max<size_t>(1, sec - start_);
+            size_t eta = (tags_ - atotal_) / ps;
+            int hours = eta / (60 * 60);
+            int minutes = (eta - (hours * 60 * 60)) / 60;
+
+            tout << "Tags processed: " << atotal_ << " / " << tags_ << " [" << static_cast<int>(ps) << " / sec], ETA = " 
+                << hours << "h " << minutes << "m\n";
+            ltotal_ = atotal_;
         }
     }
-    if(astart_ >= aligns_->size()) r++;
-    //std::cout << "Read " << r << " " << astart_  << "/" << aligns_->size() << " data = " << aligns.size() << "\n";
-    atotal_ += r;
-    if((ltotal_ + 20000) <= atotal_){
-        size_t sec = tout.seconds();
-        double ps = 1.0 * astart_ / (sec - start_);
-        size_t eta = (aligns_->size() - astart_) / ps;
-        int hours = eta / (60 * 60);
-        int minutes = (eta - (hours * 60 * 60)) / 60;
-
-        tout << "Barcodes procesed: " <<  atotal_ << " barcodes, tags = " 
-            << astart_ << " [" << static_cast<int>(ps) << " / sec], ETA = " 
-            << hours << "h " << minutes << "m\n";
-        ltotal_ = atotal_;
-    }
-    return r;
+    return next_++;
 }
 
 void QuantWorker::operator()() {
-    unsigned int N = cb_(100, aligns_);
-    while(N > 0){
-        std::sort(aligns_.begin(), aligns_.end());
-        auto start = aligns_.begin();
-        for(auto it = std::next(start); it != aligns_.end(); it++){
-            // If the next barcode is different or we are on the last barcode
-            if(it->barcode != start->barcode){
-                dups_.process(start, it);
-                total_reads += (it - start);
-                start = it;
+    std::vector<AlignSummary> tags;
+    AlignBucketMerger merger;
+    size_t b = cb_(0);
+    while(b < aligns->size()){
+        auto & bucket = (*aligns)[b];
+        std::sort(bucket.begin(), bucket.end());
+        size_t n = 0;
+        if(!runs->empty()){
+            merger.open(bucket, *runs, b);
+            while(merger.next(tags)){
+                dups_.process(tags.begin(), tags.end());
+                n += tags.size();
             }
+        }else if(!bucket.empty()){
+            auto start = bucket.begin();
+            for(auto it = std::next(start); it != bucket.end(); it++){
+                // If the next barcode is different or we are on the last barcode
+                if(it->barcode != start->barcode){
+                    dups_.process(start, it);
+                    start = it;
+                }
+            }
+            dups_.process(start, bucket.end());
+            n = bucket.size();
         }
-        if(start != aligns_.end()) {
-            dups_.process(start, aligns_.end());
-            total_reads += (aligns_.end() - start);
-        }
-
-        N = cb_(100, aligns_);
+        total_reads += n;
+        b = cb_(n);
     }
 }
 
 void QuantBase::write_umi_map(const std::string & out_file){
-    if(umi_correct.empty()) return;
-
-    tout << "Writing the umi map data\n";
-    gzFile zout = gzopen(out_file.c_str(), "wb");
-    for(auto & a : umi_correct)
-        gzwrite(zout, reinterpret_cast<char*>(&a), sizeof(AlignSummary));
-    gzclose(zout);
-
-    /*
-    gzofstream zout(out_file + "_umi_map.txt.gz");
-    for(auto & u : umi_correct){
-        zout << in_.barcodes[u.barcode] << "\t" << u.gene_id << "\t" << u.umi_from << "\t" << u.umi_to << "\n";
-    }
-    zout.close();
-    */
+    tout << "Writing the UMI correction table\n";
+    umi_table.write(out_file);
 }
 
 #include <fstream>
@@ -272,6 +284,7 @@ void QuantBase::write_output(const std::string & out_file, std::vector<std::stri
         barcode_ids.push_back(i);
         barcode_map[i] = idx++;
     }
+    const uint32_t none = std::numeric_limits<uint32_t>::max();
 
     for(auto const & m : gene_id_map_) {
         gene_names.push_back(index_->gene(m.first).gene_name.c_str());
@@ -291,8 +304,8 @@ void QuantBase::write_output(const std::string & out_file, std::vector<std::stri
         for(size_t i = 0; i < QuantWorker::dedup::ELEM_COUNT; i++){
             totals[i] = 0;
             t1.clear();
-            for(auto b : barcode_ids) { 
-                t1.push_back(molecule_counts[b * QuantWorker::dedup::ELEM_COUNT + i]);
+            for(auto r : brow_) { 
+                t1.push_back(r == none ? 0 : barcode_counts[r].counts[i]);
                 totals[i] += t1.back();
             }
             k = QuantWorker::dedup::ctype2str(static_cast<QuantWorker::dedup::CountType>(i));
@@ -312,32 +325,13 @@ void QuantBase::write_output(const std::string & out_file, std::vector<std::stri
         std::cout << "  Total PCR Dups   = " << std::noshowpoint << (totals[QuantWorker::dedup::IPCR_DUPS] + totals[QuantWorker::dedup::PCR_DUPS]) << "\n";
         std::cout << "  Total Discarded  = " << std::noshowpoint << (totals[QuantWorker::dedup::DREADS]) << "\n";
 
-        /*
-        for(size_t i = 0; i < static_cast<size_t>(group_counts.size() / NG); i++){
-            std::cout << i << " " << bnames[i] << " idx = " << (i * NG) << " ";
-            for(size_t j = 0; j < NG; j++){
-                std::cout << group_counts[i * NG + j] << ", ";
-            }
-            std::cout << "\n";
-        }
-        */
 
         auto NG = group_names_.size();
-        /*
-        std::cout << "Group counts raw\n";
-        for(auto b : barcode_ids) {
-            std::cout << b << "\t" << bnames[b] << "\t" << molecule_counts[QuantWorker::dedup::MOLECULES + b * QuantWorker::dedup::ELEM_COUNT];
-            for(size_t i = 0; i < NG; i++){
-                std::cout << "\t" << group_counts[b * NG + i];
-            }
-            std::cout << "\n";
-        }
-        */
         for(size_t i = 0; i < NG; i++){
             size_t TNG = 0;
             t1.clear();
-            for(auto b : barcode_ids) {
-                t1.push_back(group_counts[b * NG + i]);
+            for(auto r : brow_) {
+                t1.push_back(r == none ? 0 : group_counts[r * NG + i]);
                 TNG += t1.back();
             }
             k = "group_" + group_names_[i];
@@ -350,9 +344,11 @@ void QuantBase::write_output(const std::string & out_file, std::vector<std::stri
         t1.clear();
         for(auto i : barcode_ids){
             size_t t = 0;
-            auto & br = arates[i];
-            for(size_t i = 0; i < AlignGroup::ELEM_COUNT; i++){
-                t += br[i];
+            auto bit = arates.find(i);
+            if(bit != arates.end()){
+                for(size_t i = 0; i < AlignGroup::ELEM_COUNT; i++){
+                    t += bit->second[i];
+                }
             }
             t1.push_back(t);
         }
@@ -361,7 +357,10 @@ void QuantBase::write_output(const std::string & out_file, std::vector<std::stri
 
         for(size_t i = 0; i < AlignGroup::ELEM_COUNT; i++){
             t1.clear();
-            for(auto b : barcode_ids) t1.push_back(arates[b][i]);
+            for(auto b : barcode_ids) {
+                auto bit = arates.find(b);
+                t1.push_back(bit == arates.end() ? 0 : bit->second[i]);
+            }
             if(static_cast<AlignGroup::Result>(i) == AlignGroup::BARCODE_FAIL){
                 order.push_back("align_barcode_corrected");
             }else{
@@ -382,37 +381,33 @@ void QuantBase::write_output(const std::string & out_file, std::vector<std::stri
     write_h5_string("gene_ids", gene_ids, file);
     write_h5_string("barcodes", barcodes, file);
 
-    //Build the molecule count matrix
-    std::vector<uint32_t> rows, cols, data;
+    //Stream the molecule count matrices
     {
+        H5::Group group(file.createGroup("/exonic"));
+        tout << "Writing cDNA counts\n";
+        H5ChunkWriter<uint32_t> data("data", group, PredType::NATIVE_UINT32);
+        H5ChunkWriter<uint32_t> rows("rows", group, PredType::NATIVE_UINT32);
+        H5ChunkWriter<uint32_t> cols("cols", group, PredType::NATIVE_UINT32);
         for(auto & g : gene_counts){
             if(g.molecules == 0) continue;
             rows.push_back(gene_id_map_[g.gene_id]);
             cols.push_back(barcode_map[g.barcode]);
             data.push_back(g.molecules);
         }
-        H5::Group group(file.createGroup("/exonic"));
-
-        tout << "Writing cDNA counts\n";
-        write_h5_numeric("data", data, group, PredType::NATIVE_UINT32);
-        write_h5_numeric("rows", rows, group, PredType::NATIVE_UINT32);
-        write_h5_numeric("cols", cols, group, PredType::NATIVE_UINT32);
     }
-    {
-        rows.clear(); cols.clear(); data.clear();
+    bool intronic = std::any_of(gene_counts.begin(), gene_counts.end(), [](const GeneCount & g) { return g.intronic > 0; });
+    if(intronic){
+        tout << "Writing intronic counts\n";
+        H5::Group group(file.createGroup("/intronic"));
+        H5ChunkWriter<uint32_t> data("data", group, PredType::NATIVE_UINT32);
+        H5ChunkWriter<uint32_t> rows("rows", group, PredType::NATIVE_UINT32);
+        H5ChunkWriter<uint32_t> cols("cols", group, PredType::NATIVE_UINT32);
         for(auto & g : gene_counts){
             if(g.intronic == 0) continue;
             rows.push_back(gene_id_map_[g.gene_id]);
             cols.push_back(barcode_map[g.barcode]);
             data.push_back(g.intronic);
         }
-        if(!rows.empty()){
-            tout << "Writing intronic counts\n";
-            H5::Group group(file.createGroup("/intronic"));
-            write_h5_numeric("data", data, group, PredType::NATIVE_UINT32);
-            write_h5_numeric("rows", rows, group, PredType::NATIVE_UINT32);
-            write_h5_numeric("cols", cols, group, PredType::NATIVE_UINT32);
-        }
     }
 
     file.close();
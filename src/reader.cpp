@@ -87,6 +87,22 @@ bool Reader10X_V2::read(Read & r) {
     return true; 
 }
 
+bool Reader10X_V2::read(ReadBatch & b) {
+    bool res1 = f1_.read(r1_);
+    auto & r = b.push_back();
+    bool res2 = f2_.append(b.arena(), r.name_len, r.tag_len);
+    if(res1 != res2){
+        std::cout << "Error! Inconsistent number of reads between the read1 and read 2 files\n";
+        exit(0);
+    }else if(!res1){
+        b.pop_back();
+        return false;
+    }
+    r.tag = r.name + r.name_len + 1;
+    b.append_r1(r1_.seq.str(), r1_.qual, BARCODE_LEN, UMI_LEN);
+    return true; 
+}
+
 bool Reader10X_V2::read_barcode(std::string & bc, std::string & qbc) {
     bool res1 = f1_.read(r1_);
     if(!res1) return false;
@@ -114,6 +130,22 @@ bool Reader10X_V3::read(Read & r) {
     return true; 
 }
 
+bool Reader10X_V3::read(ReadBatch & b) {
+    bool res1 = f1_.read(r1_);
+    auto & r = b.push_back();
+    bool res2 = f2_.append(b.arena(), r.name_len, r.tag_len);
+    if(res1 != res2){
+        std::cout << "Error! Inconsistent number of reads between the read1 and read 2 files\n";
+        exit(0);
+    }else if(!res1){
+        b.pop_back();
+        return false;
+    }
+    r.tag = r.name + r.name_len + 1;
+    b.append_r1(r1_.seq.str(), r1_.qual, BARCODE_LEN, UMI_LEN);
+    return true; 
+}
+
 bool Reader10X_V3::read_barcode(std::string & bc, std::string & qbc) {
     bool res1 = f1_.read(r1_);
     if(!res1) return false;
@@ -26,15 +26,18 @@ SOFTWARE.
 
 using namespace gwsc;
 
-void SortedBamWriter::write(const AlignGroup & g, const Read & r, read_buffer & buffer, unsigned int & rcount, const TXIndex & idx){
+void SortedBamWriter::write(const AlignGroup & g, const ReadView & r, read_buffer & buffer, unsigned int & rcount, const TXIndex & idx){
     bam1_t * s = NULL;
     if(rcount < buffer.size()){
         s = buffer[rcount++];
     }else{
+        auto lstart = std::chrono::steady_clock::now();
         std::lock_guard<std::mutex> lock(mtx_write_);
+        lock_wait_ += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - lstart).count();
         if((buffer.size() + file_reads_) >= out_sz_){
-            // Must write the contents of the buffer
-            force_write();
+            // Hand the full pool to the spill threads and continue with an empty one
+            std::unique_lock<std::mutex> slock(mtx_spill_);
+            queue_spill_(slock);
         }
         //std::cout << "Filling output slots " << file_reads_ << " - " << (file_reads_ + buffer.size()) << " out size = " << out_.size() << " buffer size = " << buffer.size() << " rcount = " << rcount << "\n";
         for(size_t i = 0; i < buffer.size(); i++, file_reads_++){
@@ -49,7 +52,7 @@ void SortedBamWriter::write(const AlignGroup & g, const Read & r, read_buffer &
     }
 
     if(g.res == AlignGroup::AMBIGUOUS || g.res == AlignGroup::UNMAPPED || 
-            g.res == AlignGroup::BARCODE_FAIL || g.res == AlignGroup::BARCODE_FAIL ||
+            g.res == AlignGroup::BARCODE_FAIL || g.res == AlignGroup::EMPTY_DROPLET ||
             g.res == AlignGroup::TAG_FAIL || g.res == AlignGroup::UMI_FAIL || 
             (g.res == AlignGroup::MULTIMAPPED && g.total_passed > 5))
     { 
@@ -71,13 +74,78 @@ void SortedBamWriter::merge_buffer(read_buffer & buffer, unsigned int & rcount)
 }
 
 void SortedBamWriter::force_write() {
+    std::unique_lock<std::mutex> lock(mtx_spill_);
+    if(file_reads_ > 0){
+        queue_spill_(lock);
+    }
+    cv_free_.wait(lock, [this]{ return spills_.empty() && active_spills_ == 0; });
+}
+
+void SortedBamWriter::queue_spill_(std::unique_lock<std::mutex> & lock) {
     if(file_reads_ == 0) return;
+    if(spill_threads_.empty()){
+        // No background threads were requested so write in the calling thread
+        write_file_(out_, file_reads_, file_number_);
+        total_reads_ += file_reads_;
+        file_reads_ = 0;
+        file_number_++;
+        return;
+    }
+    spills_.push_back(SpillJob{std::move(out_), file_reads_, file_number_});
+    out_.clear();
+    file_number_++;
+    file_reads_ = 0;
+    cv_spill_.notify_one();
+
+    if(free_.empty()){
+        auto start = std::chrono::steady_clock::now();
+        cv_free_.wait(lock, [this]{ return !free_.empty(); });
+        spill_wait_ += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        spill_stalls_++;
+    }
+    out_ = std::move(free_.back());
+    free_.pop_back();
+}
+
+void SortedBamWriter::spill_loop_() {
+    std::unique_lock<std::mutex> lock(mtx_spill_);
+    while(true){
+        cv_spill_.wait(lock, [this]{ return stop_ || !spills_.empty(); });
+        if(spills_.empty()) break;
+        SpillJob job = std::move(spills_.front());
+        spills_.pop_front();
+        active_spills_++;
+        lock.unlock();
+
+        write_file_(job.recs, job.count, job.file);
+
+        lock.lock();
+        active_spills_--;
+        total_reads_ += job.count;
+        free_.push_back(std::move(job.recs));
+        cv_free_.notify_all();
+    }
+}
+
+void SortedBamWriter::stop_spill_threads_() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_spill_);
+        stop_ = true;
+    }
+    cv_spill_.notify_all();
+    for(auto & t : spill_threads_){
+        t.join();
+    }
+    spill_threads_.clear();
+}
+
+void SortedBamWriter::write_file_(read_buffer & recs, unsigned int count, unsigned int file) {
     SortBamTidPos psort;
     psort.max_tid = bh.bam_hdr()->n_targets;
 
-    std::sort(out_.begin(), out_.begin() + file_reads_, psort);
+    std::sort(recs.begin(), recs.begin() + count, psort);
     std::stringstream ss;
-    ss << prefix_  << "/scsnv_tmp_" << std::setw(4) << std::setfill('0') << file_number_ << ".bam";
+    ss << prefix_  << "/scsnv_tmp_" << std::setw(4) << std::setfill('0') << file << ".bam";
     std::string outf = ss.str();
 
     samFile * bam_out = sam_open(outf.c_str(), "wb");
@@ -86,20 +154,27 @@ void SortedBamWriter::force_write() {
         std::cerr << "Error writing header\n";
         exit(1);
     }
-    for(size_t i = 0; i < file_reads_; i++){
-        if(sam_write1(bam_out, bh.bam_hdr(), out_[i]) < 0){
+    // Index while writing so the merge can read any region of every temporary file
+    std::string idxf = outf + ".csi";
+    if(sam_idx_init(bam_out, bh.bam_hdr(), 14, idxf.c_str()) < 0){
+        std::cerr << "Error initializing the index for " << outf << "\n";
+        exit(1);
+    }
+    for(size_t i = 0; i < count; i++){
+        if(sam_write1(bam_out, bh.bam_hdr(), recs[i]) < 0){
             std::cerr << "Error writing sam\n";
             exit(1);
         }
     }
+    if(sam_idx_save(bam_out) < 0){
+        std::cerr << "Error writing the index " << idxf << "\n";
+        exit(1);
+    }
     sam_close(bam_out);
     bam_out = nullptr;
-    total_reads_ += file_reads_;
-    file_reads_ = 0;
-    file_number_++;
 }
 
-void SortedBamWriter::_align2unmapped(bam1_t * bam, const AlignGroup & g, const Read & r){
+void SortedBamWriter::_align2unmapped(bam1_t * bam, const AlignGroup & g, const ReadView & r){
     BamFlag flag;
     flag.f.unmapped = true;
     bam->core.flag = flag.flag_val;
@@ -158,7 +233,7 @@ void SortedBamWriter::_align2unmapped(bam1_t * bam, const AlignGroup & g, const
     bam_aux_append(bam, "RA", 'A', 1, reinterpret_cast<uint8_t*>(&tmpc));
 }
 
-void SortedBamWriter::_align2bam(bam1_t * bam, const AlignGroup & g, const Read & r, const TXIndex & idx){
+void SortedBamWriter::_align2bam(bam1_t * bam, const AlignGroup & g, const ReadView & r, const TXIndex & idx){
     auto it = g.alns.begin();
     auto aend = g.alns.begin() + g.acount;
     if(g.countable){
@@ -320,5 +395,8 @@ void SortedBamWriter::_align2bam(bam1_t * bam, const AlignGroup & g, const Read
     }
     tmpc = AlignGroup::alignres2code(g.res);
     bam_aux_append(bam, "RA", 'A', 1, reinterpret_cast<uint8_t*>(&tmpc));
+    // Internal barcode index so the merge never hashes CB, removed before merged.bam is written
+    tmpu = g.summary.barcode;
+    bam_aux_append(bam, "xb", 'i', 4, reinterpret_cast<uint8_t*>(&tmpu));
 }
 
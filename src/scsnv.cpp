@@ -33,6 +33,7 @@ SOFTWARE.
 #include "psnvcounts.hpp"
 #include "ptrim.hpp"
 #include "paccuracy.hpp"
+#include "pshm.hpp"
 
 using namespace std;
 using namespace gwsc;
@@ -66,6 +67,9 @@ int main(int argc, char * argv[]){
     }else if(cmd == "accuracy"){
         ProgAccuracy prog;
         prog.parse(argc, argv);
+    }else if(cmd == "shm"){
+        ProgShm prog;
+        prog.parse(argc, argv);
     }
     return 0;
 }
@@ -23,27 +23,29 @@ SOFTWARE.
 #include <cctype>
 using namespace gwsc;
 
-void TranscriptAlign::load(const std::string & prefix, unsigned int min_overhang){
+void TranscriptAlign::load(const std::string & prefix, unsigned int min_overhang, bool shm){
     args_ = mem_opt_init();
     args_->b = ascore.mismatch;
     args_->a = ascore.match;
     bwa_fill_scmat(args_->a, args_->b, args_->mat);
     min_overhang_ = min_overhang;
-    bidx_ = bwa_idx_load((prefix + "_bwa").c_str(), BWA_IDX_ALL);
+    std::string hint = prefix + "_bwa";
+    if(shm){
+        bidx_ = bwa_idx_load_from_shm(hint.c_str());
+        if(bidx_ == nullptr) std::cout << "Index " << hint << " is not in shared memory, loading it from disk\n";
+    }
+    if(bidx_ == nullptr) bidx_ = bwa_idx_load(hint.c_str(), BWA_IDX_ALL);
     if(bidx_ == nullptr) {
         std::cout << "Index load failed\n";
         exit(1);
     }
 }
 
-void TranscriptAlign::align(AlignGroup & ad, const std::string & seq, unsigned int len) const {
+void TranscriptAlign::align(AlignGroup & ad, const ArenaStr & seq, unsigned int len, mem_buf_t * buf) const {
     ad.transcript_score = 0;
-    ad.transcript_ar = mem_align1(args_, bidx_->bwt, bidx_->bns, bidx_->pac, len, seq.c_str());
-    if(ad.transcript_ar.n <= 0 || ad.transcript_ar.a[0].score < static_cast<int>(ascore.min_score)){
-        free(ad.transcript_ar.a);
-        ad.transcript_ar.a = NULL;
+    mem_align1_buf(args_, bidx_->bwt, bidx_->bns, bidx_->pac, len, seq.c_str(), buf, &ad.transcript_ar);
+    if(ad.transcript_ar.n == 0 || ad.transcript_ar.a[0].score < static_cast<int>(ascore.min_score)){
         ad.transcript_ar.n = 0;
-        ad.transcript_ar.m = 0;
         return;
     }
 
@@ -58,12 +60,39 @@ void TranscriptAlign::align(AlignGroup & ad, const std::string & seq, unsigned i
     */
 }
 
-void TranscriptAlign::get(AlignGroup & ad, size_t i, const std::string & seq, unsigned int len) const{
+bool TranscriptAlign::conclusive(const AlignGroup & ad, unsigned int len) const {
+    auto & ar = ad.transcript_ar;
+    if(ar.n == 0) return false;
+    auto const & best = ar.a[0];
+    if(best.score != static_cast<int>(len * ascore.match) || best.qb != 0 || best.qe != static_cast<int>(len)) return false;
+
+    // Same window MapWorker uses to decide which hits are kept
+    int min_score = std::max(static_cast<int>(ascore.min_score), best.score - static_cast<int>(ascore.max_diff * 3));
+    uint32_t gid = std::numeric_limits<uint32_t>::max();
+    for(size_t i = 0; i < ar.n; i++){
+        auto const & r = ar.a[i];
+        if(r.score < min_score || r.is_alt) continue;
+        if(r.rid < 0) return false;
+        bool rev = r.rb >= bidx_->bns->l_pac;
+        if((smode_ == StrandMode::TAG_FWD && rev) || (smode_ == StrandMode::TAG_REV && !rev) || smode_ == StrandMode::TAG_UNKNOWN){
+            return false;
+        }
+        uint32_t g = idx_.transcript(r.rid).gid;
+        if(gid == std::numeric_limits<uint32_t>::max()){
+            gid = g;
+        }else if(gid != g){
+            return false;
+        }
+    }
+    return true;
+}
+
+void TranscriptAlign::get(AlignGroup & ad, size_t i, const ArenaStr & seq, unsigned int len, mem_buf_t * buf) const{
     auto & ar = ad.transcript_ar;
     //std::cout << "Transcript get " << i << " " << ar.n << " " << ad.acount << " " << " " << ad.alns.size() << "\n";
     mem_aln_t a;
     assert(i < ar.n);
-    a = mem_reg2aln(args_, bidx_->bns, bidx_->pac, len, seq.c_str(), &ar.a[i]);
+    a = mem_reg2aln_buf(args_, bidx_->bns, bidx_->pac, len, seq.c_str(), &ar.a[i], buf);
     //std::cout << "  a.score = " << ar.a[i].score << " a.truesc = " << ar.a[i].truesc << " reg score = " << a.score << "\n";
     if((ad.acount + 1) >= ad.alns.size()){
         ad.alns.resize(ad.acount + 5);